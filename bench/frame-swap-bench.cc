@@ -0,0 +1,242 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Measures the SwapOnVSync() hand-off: how long a producer waits for its
+// frame to be picked up, and how evenly spaced the refreshes are while
+// frames are swapped back to back.
+//
+// The refresh loop is the one of the update thread, writing to a software
+// GPIO. For comparison, -b runs the previous mutex + condition variable
+// hand-off instead of the lock-free FrameSwap.
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "frame-swap.h"
+#include "framebuffer-internal.h"
+#include "gpio-trace.h"
+#include "gpio.h"
+#include "thread.h"
+
+using rgb_matrix::GPIO;
+using rgb_matrix::GPIOTrace;
+using rgb_matrix::Mutex;
+using rgb_matrix::MutexLock;
+using rgb_matrix::Thread;
+using rgb_matrix::internal::Framebuffer;
+using rgb_matrix::internal::FrameSwap;
+using rgb_matrix::internal::PixelDesignatorMap;
+
+static int64_t NowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// The hand-off as it was before FrameSwap: the refresh thread takes a
+// mutex and signals a condition variable on every frame boundary.
+template <class Frame>
+class MutexSwap {
+public:
+  explicit MutexSwap(Frame *initial)
+    : current_(initial), next_(NULL), frame_count_(0), multiple_(1) {
+    pthread_cond_init(&frame_done_, NULL);
+  }
+
+  Frame *current() const { return current_; }
+
+  void FrameDone() {
+    {
+      MutexLock l(&sync_);
+      if (frame_count_ == multiple_ || frame_count_ % multiple_ == 0) {
+        frame_count_ = 0;
+        if (next_ != NULL) {
+          current_ = next_;
+          next_ = NULL;
+        }
+        pthread_cond_signal(&frame_done_);
+      }
+    }
+    ++frame_count_;
+  }
+
+  Frame *Swap(Frame *next, unsigned frame_multiple) {
+    MutexLock l(&sync_);
+    Frame *previous = current_;
+    next_ = next;
+    multiple_ = frame_multiple;
+    sync_.WaitOn(&frame_done_);
+    return previous;
+  }
+
+private:
+  Mutex sync_;
+  pthread_cond_t frame_done_;
+  Frame *current_;
+  Frame *next_;
+  unsigned frame_count_;
+  unsigned multiple_;
+};
+
+// Refresh loop of the update thread, recording the time between the start
+// of consecutive refreshes.
+template <class Swapper>
+class RefreshThread : public Thread {
+public:
+  RefreshThread(GPIO *io, Swapper *swapper, size_t max_samples)
+    : io_(io), swapper_(swapper), running_(true) {
+    periods_.reserve(max_samples);
+  }
+
+  void Stop() { running_.store(false); }
+
+  virtual void Run() {
+    int64_t last_start = -1;
+    while (running_.load(std::memory_order_relaxed)) {
+      const int64_t start = NowNanos();
+      swapper_->current()->DumpToMatrix(io_, 0);
+      swapper_->FrameDone();
+      if (last_start >= 0 && periods_.size() < periods_.capacity())
+        periods_.push_back(start - last_start);
+      last_start = start;
+    }
+  }
+
+  std::vector<int64_t> *periods() { return &periods_; }
+
+private:
+  GPIO *const io_;
+  Swapper *const swapper_;
+  std::atomic<bool> running_;
+  std::vector<int64_t> periods_;
+};
+
+static void PrintStats(const char *name, std::vector<int64_t> *samples) {
+  if (samples->empty()) return;
+  std::sort(samples->begin(), samples->end());
+  double sum = 0, sum_squares = 0;
+  for (size_t i = 0; i < samples->size(); ++i) {
+    sum += (*samples)[i];
+    sum_squares += (double)(*samples)[i] * (*samples)[i];
+  }
+  const size_t n = samples->size();
+  const double mean = sum / n;
+  const double stddev = sqrt(std::max(0.0, sum_squares / n - mean * mean));
+  printf("%-15s n=%-7zu min=%8.1f median=%8.1f p99=%8.1f max=%9.1f "
+         "mean=%8.1f stddev=%7.1f (usec)\n", name, n,
+         (*samples)[0] / 1e3, (*samples)[n / 2] / 1e3,
+         (*samples)[n * 99 / 100] / 1e3, (*samples)[n - 1] / 1e3,
+         mean / 1e3, stddev / 1e3);
+}
+
+template <class Swapper>
+static void RunBenchmark(GPIO *io, Framebuffer *a, Framebuffer *b,
+                         int swaps, int frame_fraction, int priority,
+                         uint32_t affinity) {
+  Swapper swapper(a);
+  RefreshThread<Swapper> refresh(io, &swapper, 1 << 20);
+  refresh.Start(priority, affinity);
+
+  std::vector<int64_t> latency;
+  latency.reserve(swaps);
+  Framebuffer *offscreen = b;
+  for (int i = 0; i < swaps; ++i) {
+    offscreen->SetPixel(i % offscreen->width(), 0, 255, i & 0xff, 0);
+    const int64_t start = NowNanos();
+    offscreen = swapper.Swap(offscreen, frame_fraction);
+    latency.push_back(NowNanos() - start);
+  }
+  refresh.Stop();
+  refresh.WaitStopped();
+
+  PrintStats("swap-latency", &latency);
+  PrintStats("refresh-period", refresh.periods());
+}
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [options]\n", progname);
+  fprintf(stderr, "Options:\n"
+          "\t-r <rows>     : Panel rows. Default 32\n"
+          "\t-c <columns>  : Total columns. Default 64\n"
+          "\t-P <parallel> : Parallel chains. Default 1\n"
+          "\t-n <swaps>    : Number of frame swaps. Default 2000\n"
+          "\t-f <fraction> : Frame fraction passed to the swap. Default 1\n"
+          "\t-p <prio>     : Realtime priority of refresh thread. "
+          "Default 0 (none)\n"
+          "\t-a <cpu>      : Pin refresh thread to this CPU.\n"
+          "\t-b            : Baseline: mutex + condition variable hand-off.\n");
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  int rows = 32, columns = 64, parallel = 1;
+  int swaps = 2000, frame_fraction = 1;
+  int priority = 0;
+  uint32_t affinity = 0;
+  bool baseline = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "r:c:P:n:f:p:a:b")) != -1) {
+    switch (opt) {
+    case 'r': rows = atoi(optarg); break;
+    case 'c': columns = atoi(optarg); break;
+    case 'P': parallel = atoi(optarg); break;
+    case 'n': swaps = atoi(optarg); break;
+    case 'f': frame_fraction = atoi(optarg); break;
+    case 'p': priority = atoi(optarg); break;
+    case 'a': affinity = 1u << atoi(optarg); break;
+    case 'b': baseline = true; break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (rows < 2 || columns < 1 || parallel < 1 || parallel > 6
+      || swaps < 1 || frame_fraction < 1) {
+    return usage(argv[0]);
+  }
+
+  GPIOTrace trace;
+  trace.set_keep_events(false);
+  GPIO io;
+  io.InitSoftware(&trace);
+  Framebuffer::InitHardwareMapping("regular");
+  Framebuffer::InitGPIO(&io, rows, parallel, false, 130, 0, 0);
+
+  PixelDesignatorMap *mapper = NULL;
+  Framebuffer a(rows, columns, parallel, 0, "RGB", false, &mapper);
+  Framebuffer b(rows, columns, parallel, 0, "RGB", false, &mapper);
+  a.Fill(40, 80, 120);
+  b.Fill(120, 80, 40);
+
+  printf("%s hand-off; %dx%d, %d parallel, %d swaps, frame fraction %d\n",
+         baseline ? "mutex+condvar" : "lock-free",
+         columns, rows, parallel, swaps, frame_fraction);
+  if (baseline) {
+    RunBenchmark<MutexSwap<Framebuffer> >(&io, &a, &b, swaps, frame_fraction,
+                                          priority, affinity);
+  } else {
+    RunBenchmark<FrameSwap<Framebuffer> >(&io, &a, &b, swaps, frame_fraction,
+                                          priority, affinity);
+  }
+  delete mapper;
+  return 0;
+}
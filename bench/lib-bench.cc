@@ -0,0 +1,410 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Microbenchmarks of the hot paths of the library: drawing into a
+// FrameCanvas, text, images, switching pixel mappers, reading streams and
+// the refresh itself (DumpToMatrix() writing to a software GPIO), for a
+// couple of panel configurations.
+//
+// Each benchmark is calibrated to run at least a given time and repeated;
+// the median and fastest repetition are reported. With -o csv or -o json
+// the output is machine readable to keep track of performance over time.
+
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "content-streamer.h"
+#include "framebuffer-internal.h"
+#include "gpio-trace.h"
+#include "gpio.h"
+#include "graphics.h"
+#include "led-matrix.h"
+
+using rgb_matrix::Canvas;
+using rgb_matrix::Color;
+using rgb_matrix::FrameCanvas;
+using rgb_matrix::GPIO;
+using rgb_matrix::GPIOTrace;
+using rgb_matrix::RGBMatrix;
+using rgb_matrix::RuntimeOptions;
+using rgb_matrix::internal::Framebuffer;
+using rgb_matrix::internal::PixelDesignatorMap;
+
+struct Config {
+  int rows, cols, chain, parallel, pwm_bits;
+};
+
+// Configurations measured by default: typical single panels, chains,
+// parallel chains, and reduced PWM bits.
+static const Config kDefaultConfigs[] = {
+  { 32, 32, 1, 1, 11 },
+  { 32, 64, 2, 1, 11 },
+  { 64, 64, 2, 3, 11 },
+  { 16, 32, 4, 2, 11 },
+  { 32, 64, 2, 1, 7 },
+};
+
+enum OutputFormat { TEXT, CSV, JSON };
+
+static OutputFormat output_format = TEXT;
+static double min_repetition_seconds = 0.05;
+static int repetitions = 5;
+static const char *benchmark_filter = NULL;
+
+static bool IsSelected(const char *name) {
+  return benchmark_filter == NULL || strstr(name, benchmark_filter) != NULL;
+}
+
+// The font that comes with the library, found relative to this binary, so
+// that the benchmark can be started from any directory.
+static std::string DefaultFontFile() {
+  static const char kFont[] = "../fonts/7x13.bdf";
+  char exe[PATH_MAX];
+  const ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+  if (len <= 0) return kFont;
+  exe[len] = '\0';
+  const char *const slash = strrchr(exe, '/');
+  return std::string(exe, slash ? slash + 1 - exe : 0) + kFont;
+}
+
+static double Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void PrintHeader() {
+  switch (output_format) {
+  case TEXT:
+    printf("%-21s %4s %4s %5s %3s %4s %-6s %12s %12s\n", "benchmark",
+           "rows", "cols", "chain", "par", "pwm", "unit", "median(ns)",
+           "min(ns)");
+    break;
+  case CSV:
+    printf("benchmark,rows,cols,chain,parallel,pwm_bits,unit,"
+           "median_ns,min_ns,iterations,repetitions\n");
+    break;
+  case JSON:
+    break;
+  }
+}
+
+static void PrintResult(const char *name, const Config &c, const char *unit,
+                        double median_ns, double min_ns, long iterations) {
+  switch (output_format) {
+  case TEXT:
+    printf("%-21s %4d %4d %5d %3d %4d %-6s %12.2f %12.2f\n", name,
+           c.rows, c.cols, c.chain, c.parallel, c.pwm_bits, unit,
+           median_ns, min_ns);
+    break;
+  case CSV:
+    printf("%s,%d,%d,%d,%d,%d,%s,%.3f,%.3f,%ld,%d\n", name,
+           c.rows, c.cols, c.chain, c.parallel, c.pwm_bits, unit,
+           median_ns, min_ns, iterations, repetitions);
+    break;
+  case JSON:
+    printf("{\"benchmark\":\"%s\",\"rows\":%d,\"cols\":%d,\"chain\":%d,"
+           "\"parallel\":%d,\"pwm_bits\":%d,\"unit\":\"%s\","
+           "\"median_ns\":%.3f,\"min_ns\":%.3f,\"iterations\":%ld,"
+           "\"repetitions\":%d}\n", name,
+           c.rows, c.cols, c.chain, c.parallel, c.pwm_bits, unit,
+           median_ns, min_ns, iterations, repetitions);
+    break;
+  }
+  fflush(stdout);
+}
+
+// Run "op(i)" with increasing i. It does "units" of work (e.g. pixels) each
+// time; reported is the time per unit.
+template <class Operation>
+static void Run(const char *name, const Config &config,
+                const char *unit, double units, Operation op) {
+  if (!IsSelected(name))
+    return;
+  long counter = 0;
+  op(counter++);  // Warm up caches and lazily initialized state.
+
+  // Calibrate the number of iterations to fill a repetition.
+  long iterations = 1;
+  for (;;) {
+    const double start = Now();
+    for (long i = 0; i < iterations; ++i) op(counter++);
+    const double elapsed = Now() - start;
+    if (elapsed >= min_repetition_seconds) break;
+    iterations = (elapsed < min_repetition_seconds / 16)
+      ? iterations * 16
+      : iterations * min_repetition_seconds / elapsed * 1.1 + 1;
+  }
+
+  std::vector<double> per_unit_ns;
+  for (int r = 0; r < repetitions; ++r) {
+    const double start = Now();
+    for (long i = 0; i < iterations; ++i) op(counter++);
+    per_unit_ns.push_back((Now() - start) * 1e9 / iterations / units);
+  }
+  std::sort(per_unit_ns.begin(), per_unit_ns.end());
+  PrintResult(name, config, unit, per_unit_ns[per_unit_ns.size() / 2],
+              per_unit_ns[0], iterations);
+}
+
+// Pseudo-random, but repeatable test data.
+static uint32_t Random() {
+  static uint32_t state = 0x12345678;
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+static void RunCanvasBenchmarks(const Config &c, const rgb_matrix::Font *font) {
+  RGBMatrix::Options options;
+  options.rows = c.rows;
+  options.cols = c.cols;
+  options.chain_length = c.chain;
+  options.parallel = c.parallel;
+  options.pwm_bits = c.pwm_bits;
+  RuntimeOptions runtime;
+  runtime.do_gpio_init = false;
+  runtime.daemon = 0;
+  runtime.drop_privileges = 0;
+  RGBMatrix *matrix = RGBMatrix::CreateFromOptions(options, runtime);
+  if (matrix == NULL) return;
+  FrameCanvas *canvas = matrix->CreateFrameCanvas();
+  FrameCanvas *other = matrix->CreateFrameCanvas();
+  const int width = canvas->width();
+  const int height = canvas->height();
+  const int pixels = width * height;
+
+  std::vector<Color> colors(pixels);
+  std::vector<uint8_t> rgb(3 * pixels);
+  for (int i = 0; i < pixels; ++i) {
+    const uint32_t r = Random();
+    colors[i] = Color(r, r >> 8, r >> 16);
+    rgb[3*i] = colors[i].r; rgb[3*i+1] = colors[i].g; rgb[3*i+2] = colors[i].b;
+  }
+  other->SetPixels(0, 0, width, height, &colors[0]);
+
+  Run("set-pixel", c, "pixel", pixels, [&](long n) {
+      for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+          canvas->SetPixel(x, y, x + n, y, x ^ y);
+        }
+      }
+    });
+  Run("set-pixels", c, "pixel", pixels, [&](long n) {
+      canvas->SetPixels(0, 0, width, height, &colors[0]);
+    });
+  Run("set-image", c, "pixel", pixels, [&](long n) {
+      rgb_matrix::SetImage(canvas, 0, 0, &rgb[0], rgb.size(),
+                           width, height, false);
+    });
+  Run("fill", c, "call", 1, [&](long n) {
+      canvas->Fill(n, 2 * n, 3 * n);
+    });
+  Run("clear", c, "call", 1, [&](long n) { canvas->Clear(); });
+  Run("copy-from", c, "call", 1, [&](long n) { canvas->CopyFrom(*other); });
+  Run("serialize", c, "call", 1, [&](long n) {
+      const char *data;
+      size_t len;
+      other->Serialize(&data, &len);
+      canvas->Deserialize(data, len);
+    });
+
+  if (font) {
+    const Color fg(255, 255, 0), bg(0, 0, 64);
+    Run("draw-text", c, "call", 1, [&](long n) {
+        rgb_matrix::DrawText(canvas, *font, n % 16 - 8, font->baseline(),
+                             fg, &bg, "Hello World 12:34");
+      });
+  }
+
+  // Switching mappers builds a new pixel map and re-arranges both canvases.
+  Run("pixel-mapper", c, "call", 1, [&](long n) {
+      matrix->SetPixelMapperConfig((n & 1) ? "Rotate:90" : "Rotate:180");
+    });
+  matrix->SetPixelMapperConfig("");
+
+  // A stream of frames that change a bit each time, like an animation.
+  rgb_matrix::MemStreamIO stream;
+  {
+    rgb_matrix::StreamWriter writer(&stream);
+    for (int frame = 0; frame < 32; ++frame) {
+      for (int i = 0; i < pixels / 8; ++i) {
+        other->SetPixel(Random() % width, Random() % height,
+                        Random(), Random(), Random());
+      }
+      writer.Stream(*other, 10000);
+    }
+  }
+  rgb_matrix::StreamReader reader(&stream);
+  Run("stream-read", c, "frame", 1, [&](long n) {
+      uint32_t hold_time;
+      if (!reader.GetNext(canvas, &hold_time)) {
+        reader.Rewind();
+        reader.GetNext(canvas, &hold_time);
+      }
+    });
+
+  delete matrix;
+}
+
+// The refresh of one frame. This uses the Framebuffer directly, writing to
+// a software GPIO that only counts the writes.
+static void RunRefreshBenchmark(const Config &c, GPIO *io) {
+  PixelDesignatorMap *mapper = NULL;
+  {
+    Framebuffer frame(c.rows, c.cols * c.chain, c.parallel, 0, "RGB", false,
+                      &mapper, c.pwm_bits);
+    for (int y = 0; y < frame.height(); ++y) {
+      for (int x = 0; x < frame.width(); ++x) {
+        const uint32_t r = Random();
+        frame.SetPixel(x, y, r, r >> 8, r >> 16);
+      }
+    }
+    // Done in SwapOnVSync(); leaves the frame ready for the refresh like
+    // after a swap. Random content has nothing to skip.
+    Run("plan-refresh", c, "frame", 1, [&](long n) {
+        frame.PlanRefresh();
+      });
+    Run("dump-to-matrix", c, "frame", 1, [&](long n) {
+        frame.DumpToMatrix(io, 0);
+      });
+
+    // Mostly black, like a text ticker: a dim line every 8 rows.
+    frame.Clear();
+    for (int y = 0; y < frame.height(); y += 8) {
+      for (int x = 0; x < frame.width(); ++x) {
+        frame.SetPixel(x, y, 40, 40, 40);
+      }
+    }
+    frame.PlanRefresh();
+    Run("dump-to-matrix-sparse", c, "frame", 1, [&](long n) {
+        frame.DumpToMatrix(io, 0);
+      });
+  }
+  delete mapper;
+}
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [options]\n", progname);
+  fprintf(stderr, "Without any of -r, -c, -C, -P, -b, a set of typical "
+          "configurations is measured.\n"
+          "Options:\n"
+          "\t-r <rows>     : Panel rows.\n"
+          "\t-c <cols>     : Panel columns.\n"
+          "\t-C <chain>    : Chain length.\n"
+          "\t-P <parallel> : Parallel chains.\n"
+          "\t-b <pwm-bits> : PWM bits.\n"
+          "\t-A <type>     : Row address type used for the refresh. "
+          "Default 0\n"
+          "\t-f <font>     : BDF font for text benchmark. "
+          "Default fonts/7x13.bdf of this library\n"
+          "\t-n <name>     : Only run benchmarks containing this name.\n"
+          "\t-t <millis>   : Minimum time of each repetition. Default 50\n"
+          "\t-R <count>    : Number of repetitions. Default 5\n"
+          "\t-o <format>   : Output format: text, csv or json (one object "
+          "per line). Default text\n");
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  Config single = { 32, 32, 1, 1, Framebuffer::kDefaultBitPlanes };
+  bool use_single = false;
+  const std::string default_font_file = DefaultFontFile();
+  const char *font_file = default_font_file.c_str();
+  int row_address_type = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "r:c:C:P:b:A:f:n:t:R:o:")) != -1) {
+    switch (opt) {
+    case 'r': single.rows = atoi(optarg); use_single = true; break;
+    case 'c': single.cols = atoi(optarg); use_single = true; break;
+    case 'C': single.chain = atoi(optarg); use_single = true; break;
+    case 'P': single.parallel = atoi(optarg); use_single = true; break;
+    case 'b': single.pwm_bits = atoi(optarg); use_single = true; break;
+    case 'A': row_address_type = atoi(optarg); break;
+    case 'f': font_file = optarg; break;
+    case 'n': benchmark_filter = optarg; break;
+    case 't': min_repetition_seconds = atoi(optarg) / 1000.0; break;
+    case 'R': repetitions = atoi(optarg); break;
+    case 'o':
+      if (strcmp(optarg, "text") == 0) output_format = TEXT;
+      else if (strcmp(optarg, "csv") == 0) output_format = CSV;
+      else if (strcmp(optarg, "json") == 0) output_format = JSON;
+      else return usage(argv[0]);
+      break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (repetitions < 1 || min_repetition_seconds <= 0
+      || row_address_type < 0 || row_address_type > 5)
+    return usage(argv[0]);
+
+  std::vector<Config> configs;
+  if (use_single) {
+    RGBMatrix::Options check;
+    check.rows = single.rows;
+    check.cols = single.cols;
+    check.chain_length = single.chain;
+    check.parallel = single.parallel;
+    check.pwm_bits = single.pwm_bits;
+    std::string err;
+    if (!check.Validate(&err)) {
+      fprintf(stderr, "%s", err.c_str());
+      return 1;
+    }
+    configs.push_back(single);
+  } else {
+    configs.assign(kDefaultConfigs, kDefaultConfigs
+                   + sizeof(kDefaultConfigs) / sizeof(kDefaultConfigs[0]));
+  }
+
+  // Results silently missing from the output would go unnoticed, so a
+  // missing font is an error unless the text benchmark is not selected.
+  rgb_matrix::Font font;
+  const bool have_font = IsSelected("draw-text") && font.LoadFont(font_file);
+  if (IsSelected("draw-text") && !have_font) {
+    fprintf(stderr, "Couldn't load font %s for the text benchmark. "
+            "Use -f to choose a font or -n to select other benchmarks.\n",
+            font_file);
+    return 1;
+  }
+
+  // The software GPIO is set up once for the largest configuration; the
+  // row address setter and output bits then cover all of them.
+  GPIOTrace trace;
+  trace.set_keep_events(false);
+  GPIO io;
+  io.InitSoftware(&trace);
+  Framebuffer::InitHardwareMapping("regular");
+  Framebuffer::InitGPIO(&io, 64, 3, false, 130, 0, row_address_type);
+
+  PrintHeader();
+  for (size_t i = 0; i < configs.size(); ++i) {
+    RunCanvasBenchmarks(configs[i], have_font ? &font : NULL);
+    RunRefreshBenchmark(configs[i], &io);
+  }
+  return 0;
+}
@@ -33,7 +33,7 @@ cdef class Canvas:
     @cython.boundscheck(False)
     @cython.wraparound(False)
     def SetPixelsPillow(self, int xstart, int ystart, int width, int height, image):
-        cdef cppinc.FrameCanvas* my_canvas = <cppinc.FrameCanvas*>self._getCanvas()
+        cdef cppinc.Canvas* my_canvas = self._getCanvas()
         cdef int frame_width = my_canvas.width()
         cdef int frame_height = my_canvas.height()
         cdef int row, col
@@ -44,6 +44,16 @@ cdef class Canvas:
         ptr_tmp = dict(image.im.unsafe_ptrs)['image32']
         image_ptr = (<uint32_t **>(<uintptr_t>ptr_tmp))
 
+        if isinstance(self, FrameCanvas):
+            # Bulk encode. Rows of a Pillow image are not necessarily
+            # adjacent in memory, so hand them over one at a time. Pixels
+            # are 4 bytes: R, G, B, unused.
+            for row in range(max(0, -ystart), min(height, frame_height - ystart)):
+                (<cppinc.FrameCanvas*>my_canvas).SetPixelData(
+                    xstart, ystart + row, width, 1,
+                    <const uint8_t*>image_ptr[row], 0, 4, 0, 1, 2)
+            return
+
         for col in range(max(0, -xstart), min(width, frame_width - xstart)):
             for row in range(max(0, -ystart), min(height, frame_height - ystart)):
                 pixel = image_ptr[row][col]
@@ -169,6 +179,18 @@ cdef class RGBMatrixOptions:
             self.__py_encoded_panel_type = value.encode('utf-8')
             self.__options.panel_type = self.__py_encoded_panel_type
 
+    property multiplex_definition:
+        def __get__(self): return self.__options.multiplex_definition
+        def __set__(self, value):
+            self.__py_encoded_multiplex_definition = value.encode('utf-8')
+            self.__options.multiplex_definition = self.__py_encoded_multiplex_definition
+
+    property metrics_shm_name:
+        def __get__(self): return self.__options.metrics_shm_name
+        def __set__(self, value):
+            self.__py_encoded_metrics_shm_name = value.encode('utf-8')
+            self.__options.metrics_shm_name = self.__py_encoded_metrics_shm_name
+
     property pwm_dither_bits:
         def __get__(self): return self.__options.pwm_dither_bits
         def __set__(self, uint8_t value): self.__options.pwm_dither_bits = value
@@ -255,6 +277,13 @@ cdef class RGBMatrix(Canvas):
     def SwapOnVSync(self, FrameCanvas newFrame, uint8_t framerate_fraction = 1):
         return __createFrameCanvas(self.__matrix.SwapOnVSync(newFrame.__canvas, framerate_fraction))
 
+    # Switch to other pixel mappers, e.g. "Rotate:90", while running. The
+    # content of all canvases is re-arranged accordingly. Returns False if
+    # the configuration could not be applied.
+    def SetPixelMapperConfig(self, pixel_mapper_config):
+        config = pixel_mapper_config.encode('utf-8')
+        return self.__matrix.SetPixelMapperConfig(config)
+
     property luminanceCorrect:
         def __get__(self): return self.__matrix.luminance_correct()
         def __set__(self, luminanceCorrect): self.__matrix.set_luminance_correct(luminanceCorrect)
@@ -267,6 +296,12 @@ cdef class RGBMatrix(Canvas):
         def __get__(self): return self.__matrix.brightness()
         def __set__(self, brightness): self.__matrix.SetBrightness(brightness)
 
+    # Brightness in percent applied while refreshing; dims whatever is
+    # shown without re-drawing.
+    property refresh_brightness:
+        def __get__(self): return self.__matrix.refresh_brightness()
+        def __set__(self, float percent): self.__matrix.SetRefreshBrightness(percent)
+
     property height:
         def __get__(self): return self.__matrix.height()
 
@@ -21,14 +21,19 @@ cdef extern from "led-matrix.h" namespace "rgb_matrix":
         bool luminance_correct()
         void SetBrightness(uint8_t)
         uint8_t brightness()
+        void SetRefreshBrightness(float)
+        float refresh_brightness()
         FrameCanvas *CreateFrameCanvas()
         FrameCanvas *SwapOnVSync(FrameCanvas*, uint8_t)
+        bool SetPixelMapperConfig(const char*)
 
     cdef cppclass FrameCanvas(Canvas):
         bool SetPWMBits(uint8_t)
         uint8_t pwmbits()
         void SetBrightness(uint8_t)
         uint8_t brightness()
+        void SetPixelData(int, int, int, int, const uint8_t*, int, int,
+                          int, int, int)
 
     struct RuntimeOptions:
       RuntimeOptions() except +
@@ -69,6 +74,8 @@ cdef extern from "led-matrix.h" namespace "rgb_matrix::RGBMatrix":
         const char *led_rgb_sequence
         const char *pixel_mapper_config
         const char *panel_type
+        const char *multiplex_definition
+        const char *metrics_shm_name
 
 cdef extern from "graphics.h" namespace "rgb_matrix":
     cdef struct Color:
@@ -20,10 +20,21 @@
 #include <sys/types.h>
 
 #include <string>
+#include <vector>
 
 namespace rgb_matrix {
 class FrameCanvas;
 
+namespace internal {
+// Entry of the optional frame index at the end of a stream.
+struct FrameIndexEntry {
+  uint64_t offset;         // Stream position of the frame.
+  uint64_t timestamp_us;   // Sum of hold times of all frames before.
+  uint32_t hold_time_us;
+  uint32_t keyframe;       // Frame number decoding needs to start at.
+};
+}
+
 // An abstraction of a data stream. Two implementations exist for files and
 // an in-memory representation, but this allows your own implementation, e.g.
 // reading from a socket.
@@ -41,6 +52,19 @@ public:
   // Write bytes from buffer. Similar to Posix behavior that allows short
   // writes.
   virtual ssize_t Append(const void *buf, size_t count) = 0;
+
+  // Random access, needed for StreamReader::SeekToFrame(). Streams that
+  // can't do that, e.g. sockets, keep these defaults.
+  // Size of the stream in bytes, or -1 if not known.
+  virtual int64_t Size() { return -1; }
+  // Set read position. Returns false if not possible.
+  virtual bool Seek(uint64_t position) { return false; }
+
+  // Like Read(), but for streams that live in memory anyway: instead of
+  // copying, return a pointer to the next "count" bytes, valid as long as
+  // this StreamIO exists. Returns NULL without consuming anything if not
+  // supported or if there are fewer bytes left.
+  virtual const char *ReadView(size_t count) { return NULL; }
 };
 
 class FileStreamIO : public StreamIO {
@@ -51,6 +75,8 @@ public:
   void Rewind() final;
   ssize_t Read(void *buf, size_t count) final;
   ssize_t Append(const void *buf, size_t count) final;
+  int64_t Size() final;
+  bool Seek(uint64_t position) final;
 
 private:
   const int fd_;
@@ -62,6 +88,10 @@ public:
   void Rewind() final;
   ssize_t Read(void *buf, size_t count) final;
   ssize_t Append(const void *buf, size_t count) final;
+  int64_t Size() final;
+  bool Seek(uint64_t position) final;
+  // Unlike for other StreamIOs, only valid until the next Append().
+  const char *ReadView(size_t count) final;
 
 private:
   std::string buffer_;  // super simplistic.
@@ -83,6 +113,10 @@ public:
   // No append, this is purely read-only.
   ssize_t Append(const void *buf, size_t count) final { return -1; }
 
+  int64_t Size() final;
+  bool Seek(uint64_t position) final;
+  const char *ReadView(size_t count) final;
+
 private:
   char *buffer_;
   char *end_;
@@ -91,18 +125,45 @@ private:
 
 class StreamWriter {
 public:
+  static constexpr int kDefaultKeyframeInterval = 64;
+
   // Does not take ownership of StreamIO
-  StreamWriter(StreamIO *io);
+  //
+  // Every "keyframe_interval" frames, a full (compressed) frame is written,
+  // in between only the compressed difference to the previous frame. This
+  // typically makes streams a lot smaller. A "keyframe_interval" of 0
+  // writes the older uncompressed format, which can also be read by older
+  // versions of this library.
+  StreamWriter(StreamIO *io,
+               int keyframe_interval = kDefaultKeyframeInterval);
+  ~StreamWriter();
 
   // Stream out given canvas at the given time. "hold_time_us" indicates
   // for how long this frame is to be shown in microseconds.
   bool Stream(const FrameCanvas &frame, uint32_t hold_time_us);
 
+  // Optionally, after the last frame, append an index of all frames. This
+  // allows readers to seek to arbitrary frames or times
+  // (StreamReader::SeekToFrame()). No more frames can be streamed after
+  // this. Readers not knowing about the index just see the end of stream.
+  bool AppendIndex();
+
 private:
   void WriteFileHeader(const FrameCanvas &frame, size_t len);
 
   StreamIO *const io_;
+  const int keyframe_interval_;
   bool header_written_;
+  bool index_written_;
+  size_t buf_size_;
+  uint32_t *previous_;    // Last frame, to compute deltas.
+  uint32_t *encoded_;     // Scratch buffer for the compressed frame.
+  uint64_t frame_count_;
+  uint64_t position_;         // Bytes written so far.
+  uint64_t keyframe_offset_;  // Position of last keyframe.
+  uint32_t keyframe_number_;  // Frame number of last keyframe.
+  uint64_t timestamp_us_;
+  std::vector<internal::FrameIndexEntry> index_;
 };
 
 class StreamReader {
@@ -116,7 +177,43 @@ public:
 
   // Get next frame and its timestamp. Returns 'false' if there is an error
   // or end of stream reached..
-  bool GetNext(FrameCanvas *frame, uint32_t* hold_time_us);
+  // Streams with more bitplanes than the frame, i.e. recorded with more
+  // PWM bits (old streams always have 11), are shown with their upper
+  // bitplanes. Streams with fewer can't be played.
+  // If "in_place" is not NULL, it is set to whether the frame shows the
+  // data in the stream directly (see set_zero_copy()) or a copy.
+  bool GetNext(FrameCanvas *frame, uint32_t* hold_time_us,
+               bool *in_place = NULL);
+
+  // Zero-copy playback. If enabled and the StreamIO supports ReadView()
+  // (such as MemMapViewInput or MemStreamIO), GetNext() makes the frame show
+  // the data in the stream directly (FrameCanvas::DeserializeView()), so the
+  // frame is only valid as long as the StreamIO is. Only uncompressed streams
+  // (written with keyframe interval 0) can be shown like that; compressed
+  // streams need decoding and are copied as usual, as are streams with
+  // more bitplanes than the frame.
+  // Note that StreamWriter compresses by default
+  // (kDefaultKeyframeInterval), so streams need to be written with an
+  // explicit keyframe interval of 0 for this to have any effect.
+  void set_zero_copy(bool on) { zero_copy_ = on; }
+  bool zero_copy() const { return zero_copy_; }
+
+  // Random access. Only possible if the stream was written with an index
+  // (StreamWriter::AppendIndex()) and the StreamIO supports Seek(); returns
+  // 'false' otherwise or if out of range.
+
+  // Number of frames and total duration of the stream.
+  bool GetStreamInfo(size_t *frame_count, uint64_t *duration_us);
+
+  // Position the stream so that the next GetNext() returns the frame with
+  // the given number (starting at 0). In compressed streams, this decodes
+  // forward from the preceding keyframe, so it costs at most the keyframe
+  // interval in frames; uncompressed streams seek directly.
+  bool SeekToFrame(size_t frame_number);
+
+  // Like SeekToFrame(), with the frame shown at the given time (sum of the
+  // hold times of all frames before) in microseconds.
+  bool SeekToTime(uint64_t time_us);
 
 private:
   enum State {
@@ -124,13 +221,33 @@ private:
     STREAM_READING,
     STREAM_ERROR,
   };
-  bool ReadFileHeader(const FrameCanvas &frame);
+  enum IndexState {
+    INDEX_UNKNOWN,
+    INDEX_LOADED,
+    INDEX_MISSING,
+  };
+  bool ReadFileHeader();
+  bool ReadFrame(const char **data, uint32_t *hold_time_us, bool *in_stream);
+  bool LoadIndex();
 
   StreamIO *io_;
   size_t frame_buf_size_;
   State state_;
+  uint32_t version_;
+  uint32_t width_;
+  uint32_t height_;
+  uint32_t bitplanes_;
 
   char *header_frame_buffer_;
+  uint32_t *reference_;   // Last decoded frame deltas are applied to.
+  bool have_reference_;
+
+  uint64_t position_;     // Stream position of the next frame.
+  size_t next_frame_;     // Frame number GetNext() will return.
+  IndexState index_state_;
+  std::vector<internal::FrameIndexEntry> index_;
+
+  bool zero_copy_;
 };
 }
 
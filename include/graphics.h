@@ -13,6 +13,7 @@
 #include <stddef.h>
 
 #include <map>
+#include <vector>
 
 namespace rgb_matrix {
 struct Color {
@@ -31,8 +32,18 @@ public:
   Font();
   ~Font();
 
+  // Load a font from a BDF file or a compiled font file written by
+  // WriteCompiledFont(). Compiled fonts are mapped into memory and glyphs are
+  // only read when used, so even huge fonts load instantly and only take
+  // memory for the glyphs actually drawn.
+  // Glyphs of subsequent calls are added to the font; there can only be one
+  // compiled font file though, and glyphs from BDF files take precedence.
   bool LoadFont(const char *path);
 
+  // Write all glyphs of this font as compiled font file to "path". The file
+  // is in the byte order of this machine. Returns false on error.
+  bool WriteCompiledFont(const char *path) const;
+
   // Return height of font in pixels. Returns -1 if font has not been loaded.
   int height() const { return font_height_; }
 
@@ -59,6 +70,16 @@ public:
   int DrawGlyph(Canvas *c, int x, int y, const Color &color,
                 uint32_t unicode_codepoint) const;
 
+  // Draws a whole UTF-8 string; see DrawText() and VerticalDrawText() below.
+  // For DrawText(), the glyph layout of recently drawn strings is cached, so
+  // redrawing the same text every frame only blits the pre-rasterized rows.
+  int DrawText(Canvas *c, int x, int y,
+               const Color &color, const Color *background_color,
+               const char *utf8_text, int extra_spacing) const;
+  int VerticalDrawText(Canvas *c, int x, int y,
+                       const Color &color, const Color *background_color,
+                       const char *utf8_text, int extra_spacing) const;
+
   // Create a new font derived from this font, which represents an outline
   // of the original font, essentially pixels tracing around the original
   // letter.
@@ -71,13 +92,31 @@ private:
   Font(const Font& x);  // No copy constructor. Use references or pointer instead.
 
   struct Glyph;
+  struct TextLayout;
+  class TextLayoutCache;
   typedef std::map<uint32_t, Glyph*> CodepointGlyphMap;
 
   const Glyph *FindGlyph(uint32_t codepoint) const;
+  const Glyph *FindCompiledGlyph(uint32_t codepoint) const;
+  void SetGlyph(uint32_t codepoint, Glyph *glyph);
+  void CollectGlyphs(std::map<uint32_t, const Glyph*> *result) const;
+  bool MapCompiledFont(const char *path, int fd);
+  void DrawGlyphSpans(Canvas *c, int x, int y, const Glyph *g,
+                      const Color &color, const Color *background_color) const;
 
   int font_height_;
   int base_line_;
   CodepointGlyphMap glyphs_;
+
+  // Flat lookup table for the basic multilingual plane: 256 pages of 256
+  // entries, only allocated for pages that contain glyphs.
+  std::vector<std::vector<const Glyph*> > bmp_pages_;
+
+  TextLayoutCache *const layout_cache_;
+
+  // Mapped compiled font file, if any.
+  const char *compiled_data_;
+  size_t compiled_size_;
 };
 
 // -- Some utility functions.
@@ -30,6 +30,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include "refresh-metrics.h"
 
 #ifdef  __cplusplus
 extern "C" {
@@ -83,7 +84,8 @@ struct RGBLedMatrixOptions {
 
   /* Set PWM bits used for output. Default is 11, but if you only deal with
    * limited comic-colors, 1 might be sufficient. Lower require less CPU and
-   * increases refresh-rate.
+   * increases refresh-rate. Up to 16 for low-light installations.
+   * It also sets how many bitplanes each canvas stores in memory.
    * Corresponding flag: --led-pwm-bits
    */
   int pwm_bits;
@@ -158,6 +160,16 @@ struct RGBLedMatrixOptions {
    * processes when waiting and renders single core boards more responsive.
    */
   bool disable_busy_waiting;     /* Corresponding flag: --led-busy-waiting */
+
+  /* Definition of a multiplex mapper for panels not covered by the
+   * built-in multiplexing types; see README. The flag reads it from a file.
+   */
+  const char *multiplex_definition;  /* Corresponding flag: --led-multiplex-file */
+
+  /* Keep the refresh metrics in the POSIX shared memory object of this
+   * name for external monitors; see refresh-metrics.h.
+   */
+  const char *metrics_shm_name;  /* Corresponding flag: --led-metrics-shm */
 };
 
 /**
@@ -359,6 +371,31 @@ struct LedCanvas *led_matrix_swap_on_vsync(struct RGBLedMatrix *matrix,
 uint8_t led_matrix_get_brightness(struct RGBLedMatrix *matrix);
 void led_matrix_set_brightness(struct RGBLedMatrix *matrix, uint8_t brightness);
 
+/**
+ * Brightness in percent (0..100) applied while refreshing: dims whatever
+ * is shown without re-drawing. See RGBMatrix::SetRefreshBrightness().
+ */
+float led_matrix_get_refresh_brightness(struct RGBLedMatrix *matrix);
+void led_matrix_set_refresh_brightness(struct RGBLedMatrix *matrix,
+                                       float percent);
+
+/**
+ * Switch to the pixel mappers in "pixel_mapper_config" (same format as
+ * the pixel_mapper_config option) while running; the content of all
+ * canvases is re-arranged accordingly. Returns 0 and leaves the current
+ * mapping if the configuration can not be applied, 1 on success.
+ */
+int led_matrix_set_pixel_mapper_config(struct RGBLedMatrix *matrix,
+                                       const char *pixel_mapper_config);
+
+/**
+ * Get a snapshot of the refresh metrics; see refresh-metrics.h.
+ * Returns 1 on success. Returns 0 and zeroes "metrics" if no consistent
+ * snapshot could be taken.
+ */
+int led_matrix_get_refresh_metrics(struct RGBLedMatrix *matrix,
+                                   struct RGBLedRefreshMetrics *metrics);
+
 // Utility function: set an image from the given buffer containting pixels.
 //
 // Draw image of size "image_width" and "image_height" from pixel at
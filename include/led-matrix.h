@@ -30,10 +30,12 @@
 #include "thread.h"
 #include "pixel-mapper.h"
 #include "graphics.h"
+#include "refresh-metrics.h"
 
 namespace rgb_matrix {
 class RGBMatrix;
 class FrameCanvas;   // Canvas for Double- and Multibuffering
+class StreamReader;
 struct RuntimeOptions;
 
 // The RGB matrix provides the framebuffer and the facilities to constantly
@@ -90,7 +92,10 @@ public:
 
     // Set PWM bits used for output. Default is 11, but if you only deal with
     // limited comic-colors, 1 might be sufficient. Lower require less CPU and
-    // increases refresh-rate.
+    // increases refresh-rate. Up to 16 for smooth dark colors in low-light
+    // installations; each bit above 11 doubles the refresh time.
+    // This also sets how many bitplanes each FrameCanvas stores, so lower
+    // values need less memory, and SetPWMBits() can't go above it later.
     // Flag: --led-pwm-bits
     int pwm_bits;
 
@@ -159,6 +164,16 @@ public:
     // Sleep instead of busy wait to free CPU cycles but get slightly less
     // accurate frame timing.
     bool disable_busy_waiting;   // Flag: --led-busy-waiting
+
+    // Definition of a multiplex mapper for panels not covered by the
+    // built-in "multiplexing" types, see README. Used instead of these.
+    // The flag reads the definition from a file.
+    const char *multiplex_definition;   // Flag: --led-multiplex-file
+
+    // If set, the refresh metrics (see GetRefreshMetrics()) are kept in the
+    // POSIX shared memory object of this name (/dev/shm/<name>) for
+    // external monitors to read.
+    const char *metrics_shm_name;   // Flag: --led-metrics-shm
   };
 
   // Factory to create a matrix. Additional functionality includes dropping
@@ -238,6 +253,20 @@ public:
   // time-correct animations.
   FrameCanvas *SwapOnVSync(FrameCanvas *other, unsigned framerate_fraction = 1);
 
+  // Sync mode for incremental updates with double-buffering. If enabled,
+  // the canvas returned by SwapOnVSync() is brought up to date with the
+  // canvas just put on display, so you can continue drawing only what
+  // changes instead of re-drawing everything or calling CopyFrom().
+  //
+  // Only the double rows that actually changed are copied, which saves a lot
+  // of memory bandwidth if only a small part (a clock, a ticker) changes
+  // with every frame.
+  //
+  // Default is off, as this overwrites the content of the returned canvas;
+  // not what you want if you swap between pre-rendered canvases.
+  void set_sync_on_swap(bool on);
+  bool sync_on_swap() const;
+
   // -- Setting shape and behavior of matrix.
 
   // Apply a pixel mapper. This is used to re-map pixels according to some
@@ -246,6 +275,26 @@ public:
   // Returns a boolean indicating if this was successful.
   bool ApplyPixelMapper(const PixelMapper *mapper);
 
+  // Switch to the pixel mappers given in "pixel_mapper_config", same
+  // format as Options::pixel_mapper_config, while the matrix keeps running.
+  // They replace the ones given in the options or the previous call. The
+  // panel layout itself (multiplexing) stays below them, and the mappers
+  // applied with ApplyPixelMapper() stay on top of them: what these did is
+  // recorded, so they don't need to be around anymore; but they only fit
+  // if the new mappers result in the same size as the ones they were
+  // applied to.
+  //
+  // The content of all FrameCanvases is re-arranged to the new mapping, so
+  // what is on display stays visible (e.g. just rotates) and is switched
+  // over at a frame boundary without going blank. Note that width() and
+  // height() change if the new mapping has a different size.
+  //
+  // Don't draw on any canvas or call SwapOnVSync() while this is running.
+  // Returns false, leaving the current mapping, if any of the mappers is
+  // unknown or can't be applied, or the ones from ApplyPixelMapper() don't
+  // fit.
+  bool SetPixelMapperConfig(const char *pixel_mapper_config);
+
   // Note, there used to be ApplyStaticTransformer(), which has been deprecated
   // since 2018 and changed to a compile-time option, then finally removed
   // in 2020. Use PixelMapper instead, which is simpler and more intuitive.
@@ -254,7 +303,8 @@ public:
   // limited comic-colors, 1 might be sufficient. Lower require less CPU and
   // increases refresh-rate.
   //
-  // Returns boolean to signify if value was within range.
+  // Returns boolean to signify if value was within range, which is 1 up to
+  // the Options::pwm_bits the matrix was created with.
   //
   // This sets the PWM bits for the current active FrameCanvas and future
   // ones that are created with CreateFrameCanvas().
@@ -270,6 +320,19 @@ public:
   void SetBrightness(uint8_t brightness);
   uint8_t brightness();
 
+  // Brightness in percent applied while refreshing. 0%..100%, default 100%.
+  // Unlike SetBrightness(), this dims whatever is shown from the next
+  // refreshed frame on, without re-drawing anything, so it is cheap to
+  // change every frame for fades or day/night dimming. Fractions of a
+  // percent are fine. Both brightness settings multiply.
+  //
+  // This shortens the output enable pulses. Those of the least significant
+  // bitplanes can get too short to be shown (or, without the hardware pulse
+  // generator, to be timed accurately), so at very low values the darkest
+  // colors lose some gradation.
+  void SetRefreshBrightness(float percent);
+  float refresh_brightness() const;
+
   //-- GPIO interaction.
   // This library uses the GPIO pins to drive the matrix; this is a safe way
   // to request the 'remaining' bits to be used for user purposes.
@@ -313,6 +376,14 @@ public:
   // Set the user-settable bits according to output bits.
   void OutputGPIO(uint64_t output_bits);
 
+  // Get a snapshot of the refresh metrics: histograms of refresh and swap
+  // timing and counters of problems, see refresh-metrics.h. Cheap enough
+  // to be polled to detect a degraded refresh, e.g. by watching
+  // rgb_histogram_percentile(&metrics.frame_time, 0.99).
+  // Returns false and zeroes "metrics" if no consistent snapshot could be
+  // taken because the refresh thread kept updating it.
+  bool GetRefreshMetrics(RGBLedRefreshMetrics *metrics) const;
+
   // Legacy way to set gpio pins. We're not doing this anymore but need to
   // be source-compatible with old calls of the form
   // matrix->gpio()->RequestInputs(...)
@@ -337,6 +408,22 @@ namespace internal {
 class Framebuffer;
 }
 
+// A video frame in Y'CbCr with subsampled chroma, as produced by most
+// video decoders. See FrameCanvas::SetYUVImage().
+struct YUVImage {
+  enum Format {
+    YUV420P,   // Three planes: Y, U (Cb), V (Cr); chroma half size.
+    NV12,      // Two planes: Y and interleaved UV; chroma half size.
+  };
+  Format format;
+  int width;                 // Size of the luma plane in pixels.
+  int height;
+  const uint8_t *planes[3];  // Y, U, V. For NV12 Y, UV and unused.
+  int strides[3];            // Bytes per row of each plane.
+  bool full_range;           // 0..255 ('JPEG' range) instead of 16..235.
+  bool bt709;                // BT.709 (HD) instead of BT.601 coefficients.
+};
+
 class FrameCanvas : public Canvas {
 public:
   // Set PWM bits used for this Frame.
@@ -346,6 +433,10 @@ public:
   bool SetPWMBits(uint8_t value);
   uint8_t pwmbits();
 
+  // Number of bitplanes this canvas stores, the upper limit for
+  // SetPWMBits(). That is the Options::pwm_bits the matrix was created with.
+  int bitplanes() const;
+
   // Map brightness of output linearly to input with CIE1931 profile.
   void set_luminance_correct(bool on);
   bool luminance_correct() const;
@@ -374,9 +465,34 @@ public:
   // This method should only be called if FrameCanvas is off-screen.
   bool Deserialize(const char *data, size_t len);
 
+  // Like Deserialize(), but without copying: the canvas shows "data"
+  // directly, e.g. a frame in a memory mapped stream file. The data needs
+  // to stay valid and unchanged as long as it is shown. It is never written
+  // to; drawing on the canvas afterwards first copies it to the canvas'
+  // own memory.
+  // Returns 'false' if size or alignment is unexpected.
+  // This method should only be called if FrameCanvas is off-screen.
+  bool DeserializeView(const char *data, size_t len);
+
   // Copy content from other FrameCanvas owned by the same RGBMatrix.
   void CopyFrom(const FrameCanvas &other);
 
+  // Draw a video frame, scaled to "width" x "height" pixels at position
+  // "x", "y". Color space conversion, scaling (area average) and encoding
+  // happen in one pass, without any full size intermediate image; much
+  // faster than converting to RGB first and then calling SetPixel().
+  void SetYUVImage(int x, int y, int width, int height,
+                   const YUVImage &image);
+
+  // Bulk SetPixel() for image data in memory: "width" x "height" pixels
+  // placed at "x", "y", clipped to the canvas. Each row starts "row_stride"
+  // bytes after the previous one; pixels are "pixel_stride" bytes apart,
+  // with red, green and blue at the given byte offsets within a pixel.
+  // E.g. packed RGB is (3, 0, 1, 2), BGR (3, 2, 1, 0), RGBA (4, 0, 1, 2).
+  void SetPixelData(int x, int y, int width, int height,
+                    const uint8_t *data, int row_stride, int pixel_stride,
+                    int red_offset, int green_offset, int blue_offset);
+
   // -- Canvas interface.
   virtual int width() const;
   virtual int height() const;
@@ -389,6 +505,7 @@ public:
 
 private:
   friend class RGBMatrix;
+  friend class StreamReader;
 
   FrameCanvas(internal::Framebuffer *frame) : frame_(frame){}
   virtual ~FrameCanvas();   // Any FrameCanvas is owned by RGBMatrix.
@@ -0,0 +1,174 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+ */
+
+/*
+ * Metrics of the refresh loop: how long refreshing frames and their
+ * bitplanes takes, how late output enable pulses finish and how long
+ * SwapOnVSync() waits.
+ *
+ * Get a snapshot with RGBMatrix::GetRefreshMetrics() (C:
+ * led_matrix_get_refresh_metrics()). With --led-metrics-shm=<name>, the
+ * metrics are kept in POSIX shared memory /dev/shm/<name> with exactly
+ * this layout, so that a separate monitoring process can read them with
+ * rgb_refresh_metrics_read() without disturbing the refresh.
+ *
+ * Plain C, so that it can be used in any monitor.
+ */
+#ifndef RPI_REFRESH_METRICS_H
+#define RPI_REFRESH_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#define RGB_REFRESH_METRICS_MAGIC     0x4d52474cu  /* "LGRM" in memory */
+#define RGB_REFRESH_METRICS_VERSION   2
+#define RGB_HISTOGRAM_BUCKETS         32
+#define RGB_REFRESH_METRICS_BITPLANES 16
+
+/*
+ * Histogram of durations in nanoseconds. Bucket 0 counts values below 2ns,
+ * bucket i values in [2^i, 2^(i+1)); the last bucket everything above.
+ */
+struct RGBLedHistogram {
+  uint64_t count;
+  uint64_t sum_ns;
+  uint64_t max_ns;
+  uint64_t bucket[RGB_HISTOGRAM_BUCKETS];
+};
+
+/*
+ * All counts are totals since the matrix was created.
+ *
+ * The two sections are written by different threads. Each is guarded by
+ * its sequence number which is odd while an update is in progress; see
+ * rgb_refresh_metrics_read().
+ */
+struct RGBLedRefreshMetrics {
+  uint32_t magic;     /* RGB_REFRESH_METRICS_MAGIC once initialized. */
+  uint32_t version;   /* RGB_REFRESH_METRICS_VERSION */
+  uint32_t size;      /* sizeof(struct RGBLedRefreshMetrics) */
+  uint32_t pid;       /* Process refreshing the matrix. */
+
+  /* -- Written by the refresh thread after each frame. */
+  uint32_t refresh_sequence;
+  uint32_t pwm_bits;          /* Bitplanes shown in the last frame. */
+  uint64_t frames;            /* Refreshed frames. */
+  uint64_t last_frame_ns;     /* CLOCK_MONOTONIC when the last one ended. */
+  struct RGBLedHistogram frame_time;   /* Full refresh cycle, incl. limit. */
+  struct RGBLedHistogram dump_time;    /* Sending the frame to the panels. */
+  /* Time spent on each bitplane per frame, summed over all rows: clocking
+   * in its data and waiting for the output enable pulse of the previous
+   * one. Bitplane b is shown 2^b times the shortest time. With up to 11
+   * PWM bits, index 10 is the most significant and the lowest ones stay
+   * empty; with more, index pwm_bits - 1. */
+  struct RGBLedHistogram bitplane_time[RGB_REFRESH_METRICS_BITPLANES];
+  /* How much longer than requested output enable pulses kept us waiting.
+   * Only recorded by pulse implementations that can measure it (hardware
+   * pulses or timer based with access to the 1Mhz timer). */
+  struct RGBLedHistogram pulse_overshoot;
+  /* Swaps that were served later than the frame boundary they were due
+   * at, counted in missed refreshes: the previous frame was shown longer
+   * than requested, e.g. as the refresh was stalled. A swap is due at the
+   * first boundary after SwapOnVSync() was called, so how often producers
+   * swap doesn't matter here. */
+  uint64_t dropped_swaps;
+
+  /* -- Written by SwapOnVSync() callers. */
+  uint32_t swap_sequence;
+  uint32_t reserved;
+  uint64_t swaps;
+  struct RGBLedHistogram swap_wait;    /* Time blocked in SwapOnVSync(). */
+};
+
+/*
+ * Copy one section of "shared" guarded by "sequence" into "snapshot".
+ * Retries while the writer is in the middle of an update; gives up
+ * and returns 0 if that doesn't finish (e.g. the writer died).
+ */
+static inline int rgb_refresh_metrics_read_section_(
+  const uint32_t *sequence, const void *src, void *dst, size_t len) {
+  int attempt;
+  for (attempt = 0; attempt < 100000; ++attempt) {
+    const uint32_t before = __atomic_load_n(sequence, __ATOMIC_ACQUIRE);
+    if (before & 1) continue;
+    memcpy(dst, src, len);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(sequence, __ATOMIC_RELAXED) == before) return 1;
+  }
+  return 0;
+}
+
+/*
+ * Take a consistent snapshot of "shared", which can be mapped from
+ * another process. Never blocks the writers. Returns 0 if "shared" is not
+ * initialized, of an incompatible version or could not be read.
+ */
+static inline int rgb_refresh_metrics_read(
+  const struct RGBLedRefreshMetrics *shared,
+  struct RGBLedRefreshMetrics *snapshot) {
+  const char *const src = (const char*) shared;
+  char *const dst = (char*) snapshot;
+  const size_t refresh_start = offsetof(struct RGBLedRefreshMetrics,
+                                        refresh_sequence);
+  const size_t swap_start = offsetof(struct RGBLedRefreshMetrics,
+                                     swap_sequence);
+  if (__atomic_load_n(&shared->magic, __ATOMIC_ACQUIRE)
+      != RGB_REFRESH_METRICS_MAGIC
+      || shared->version != RGB_REFRESH_METRICS_VERSION
+      || shared->size != sizeof(struct RGBLedRefreshMetrics)) {
+    return 0;
+  }
+  memcpy(dst, src, refresh_start);
+  return rgb_refresh_metrics_read_section_(
+    &shared->refresh_sequence, src + refresh_start, dst + refresh_start,
+    swap_start - refresh_start)
+    && rgb_refresh_metrics_read_section_(
+      &shared->swap_sequence, src + swap_start, dst + swap_start,
+      sizeof(struct RGBLedRefreshMetrics) - swap_start);
+}
+
+/*
+ * Estimate of the value below which the given "fraction" (0..1) of
+ * values in the histogram are: the upper bound of the bucket it falls
+ * into, capped at the largest value seen. 0 if empty.
+ */
+static inline uint64_t rgb_histogram_percentile(
+  const struct RGBLedHistogram *h, double fraction) {
+  const uint64_t wanted = (uint64_t)(fraction * h->count + 0.5);
+  uint64_t seen = 0;
+  int i;
+  if (h->count == 0) return 0;
+  for (i = 0; i < RGB_HISTOGRAM_BUCKETS - 1; ++i) {
+    seen += h->bucket[i];
+    if (seen >= wanted && seen > 0) break;
+  }
+  if (i == RGB_HISTOGRAM_BUCKETS - 1) return h->max_ns;
+  {
+    const uint64_t upper = ((uint64_t)2 << i) - 1;
+    return upper < h->max_ns ? upper : h->max_ns;
+  }
+}
+
+#ifdef  __cplusplus
+}  /* extern C */
+#endif
+
+#endif  /* RPI_REFRESH_METRICS_H */
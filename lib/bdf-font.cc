@@ -20,13 +20,22 @@
 #include <inttypes.h>
 
 #include "graphics.h"
+#include "led-matrix.h"
+#include "thread.h"
+#include "utf8-internal.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <algorithm>
 #include <bitset>
+#include <memory>
+#include <new>
+#include <string>
+#include <utility>
 #include <vector>
 
 // The little question-mark box "�" for unknown code.
@@ -38,13 +47,257 @@ namespace rgb_matrix {
 static constexpr int kMaxFontWidth = 196;
 typedef std::bitset<kMaxFontWidth> rowbitmap_t;
 
+// A horizontal run of set pixels in a glyph row.
+struct GlyphSpan {
+  uint8_t x;
+  uint8_t length;
+};
+
+// A glyph: its metrics, followed in memory by 'height + 1' row starts and
+// 'span_count' spans. Row "y" consists of the spans
+// spans()[row_start()[y]] .. spans()[row_start()[y+1] - 1], ordered by x.
+// Spans are not clipped to the device width, as the bitmap can be wider
+// than what is drawn.
+//
+// This is exactly how glyphs are stored in compiled font files, so these are
+// used right out of the mapped file.
 struct Font::Glyph {
-  int device_width, device_height;
-  int width, height;
-  int x_offset, y_offset;
-  std::vector<rowbitmap_t> bitmap;  // contains 'height' elements.
+  int16_t device_width, device_height;
+  int16_t width, height;
+  int16_t x_offset, y_offset;
+  uint16_t span_count;
+  uint16_t reserved;
+
+  const uint16_t *row_start() const {
+    return reinterpret_cast<const uint16_t*>(this + 1);
+  }
+  const GlyphSpan *spans() const {
+    return reinterpret_cast<const GlyphSpan*>(row_start() + height + 1);
+  }
+  size_t size() const {
+    return sizeof(Glyph) + (height + 1) * sizeof(uint16_t)
+      + span_count * sizeof(GlyphSpan);
+  }
+
+  // Create a glyph with the given metrics from its bitmap, which contains
+  // 'height' rows. Free with Delete().
+  static Glyph *Create(const Glyph &metrics,
+                       const std::vector<rowbitmap_t> &bitmap) {
+    static_assert(sizeof(Glyph) == 16, "Glyph layout is part of file format");
+    std::vector<uint16_t> row_start;
+    std::vector<GlyphSpan> spans;
+    for (int y = 0; y < metrics.height; ++y) {
+      row_start.push_back(spans.size());
+      const rowbitmap_t &row = bitmap[y];
+      int x = 0;
+      while (x < kMaxFontWidth) {
+        if (!row.test(kMaxFontWidth - 1 - x)) { ++x; continue; }
+        const int start = x;
+        while (x < kMaxFontWidth && row.test(kMaxFontWidth - 1 - x)) ++x;
+        const GlyphSpan span = { (uint8_t)start, (uint8_t)(x - start) };
+        spans.push_back(span);
+      }
+    }
+    row_start.push_back(spans.size());
+
+    Glyph header = metrics;
+    header.device_width = std::max(0, std::min<int>(metrics.device_width,
+                                                    kMaxFontWidth));
+    header.span_count = spans.size();
+    header.reserved = 0;
+    Glyph *g = new (::operator new(header.size())) Glyph(header);
+    memcpy(const_cast<uint16_t*>(g->row_start()), row_start.data(),
+           row_start.size() * sizeof(uint16_t));
+    memcpy(const_cast<GlyphSpan*>(g->spans()), spans.data(),
+           spans.size() * sizeof(GlyphSpan));
+    return g;
+  }
+
+  static void Delete(const Glyph *g) {
+    ::operator delete(const_cast<Glyph*>(g));
+  }
+
+  // Recreate the bitmap from the spans.
+  std::vector<rowbitmap_t> GetBitmap() const {
+    std::vector<rowbitmap_t> bitmap(height);
+    for (int y = 0; y < height; ++y) {
+      for (int s = row_start()[y]; s < row_start()[y+1]; ++s) {
+        const int end = std::min(spans()[s].x + spans()[s].length,
+                                 kMaxFontWidth);
+        for (int x = spans()[s].x; x < end; ++x)
+          bitmap[y].set(kMaxFontWidth - 1 - x);
+      }
+    }
+    return bitmap;
+  }
+};
+
+// Compiled font files, as written by Font::WriteCompiledFont(). Values are
+// in host byte order; offsets are relative to the start of the file. The
+// file consists of
+//   - the CompiledFontHeader.
+//   - an index of glyphs beyond the basic multilingual plane:
+//     'extra_count' CompiledGlyphEntry sorted by codepoint.
+//   - a table of 256 uint32_t glyph offsets for each page of the basic
+//     multilingual plane that contains glyphs, 0 for missing glyphs.
+//   - the glyphs, as in memory, starting at 4 byte aligned offsets.
+static constexpr uint32_t kCompiledFontMagic = 0x46424752;  // "RGBF"
+static constexpr uint32_t kCompiledFontVersion = 1;
+
+struct CompiledFontHeader {
+  uint32_t magic;
+  uint32_t version;
+  int32_t height;
+  int32_t baseline;
+  uint32_t extra_count;
+  uint32_t extra_offset;
+  uint32_t pages[256];     // Offset of page table, 0 if page is empty.
+};
+
+struct CompiledGlyphEntry {
+  uint32_t codepoint;
+  uint32_t offset;
 };
 
+// A horizontal run of pixels of a rasterized text row.
+struct TextRun {
+  int x;
+  int length;
+  bool foreground;  // Otherwise background.
+};
+
+// Positions of the glyphs of a string, as found by Font::DrawText(). Glyph
+// entries are NULL for characters that are not in the font.
+//
+// The horizontal text is also rasterized into runs per row, relative to the
+// start of the baseline, so that it can be blitted without looking at the
+// individual glyphs: once as it looks on a transparent background, and
+// once with background as drawn by subsequent DrawGlyph() calls, i.e. later
+// glyphs painting over earlier ones if they overlap.
+struct Font::TextLayout {
+  std::vector<const Glyph*> glyphs;
+  std::vector<int> x_offsets;
+  int width;
+
+  int top;            // Relative to baseline, of the first rasterized row.
+  int min_x, max_x;   // Horizontal extent of all runs.
+  std::vector<TextRun> runs[2];            // [with background]
+  std::vector<uint32_t> row_start[2];      // 'rows + 1' elements each.
+
+  void Rasterize() {
+    top = 0;
+    int bottom = 0;
+    min_x = 0;
+    max_x = 0;
+    for (size_t i = 0; i < glyphs.size(); ++i) {
+      const Glyph *g = glyphs[i];
+      if (g == NULL) continue;
+      top = std::min(top, -g->height - g->y_offset);
+      bottom = std::max(bottom, -g->y_offset);
+      min_x = std::min(min_x, x_offsets[i]);
+      max_x = std::max(max_x, x_offsets[i] + g->device_width);
+    }
+
+    enum { kNone, kBackground, kForeground };
+    std::vector<uint8_t> pixels[2];
+    for (int with_bg = 0; with_bg < 2; ++with_bg) {
+      runs[with_bg].clear();
+      row_start[with_bg].clear();
+      pixels[with_bg].resize(max_x - min_x);
+    }
+    for (int y = top; y < bottom; ++y) {
+      for (int with_bg = 0; with_bg < 2; ++with_bg)
+        std::fill(pixels[with_bg].begin(), pixels[with_bg].end(), kNone);
+      for (size_t i = 0; i < glyphs.size(); ++i) {
+        const Glyph *g = glyphs[i];
+        if (g == NULL) continue;
+        const int glyph_row = y + g->height + g->y_offset;
+        if (glyph_row < 0 || glyph_row >= g->height) continue;
+        const int x0 = x_offsets[i] - min_x;
+        std::fill(pixels[1].begin() + x0,
+                  pixels[1].begin() + x0 + g->device_width, kBackground);
+        for (int s = g->row_start()[glyph_row];
+             s < g->row_start()[glyph_row+1]; ++s) {
+          const GlyphSpan &span = g->spans()[s];
+          const int end = std::min<int>(span.x + span.length, g->device_width);
+          for (int x = span.x; x < end; ++x) {
+            pixels[0][x0 + x] = kForeground;
+            pixels[1][x0 + x] = kForeground;
+          }
+        }
+      }
+      for (int with_bg = 0; with_bg < 2; ++with_bg) {
+        const std::vector<uint8_t> &row = pixels[with_bg];
+        row_start[with_bg].push_back(runs[with_bg].size());
+        for (int x = 0; x < (int)row.size(); /**/) {
+          const uint8_t value = row[x];
+          const int start = x;
+          while (x < (int)row.size() && row[x] == value) ++x;
+          if (value == kNone) continue;
+          const TextRun run = { start + min_x, x - start,
+                                value == kForeground };
+          runs[with_bg].push_back(run);
+        }
+      }
+    }
+    for (int with_bg = 0; with_bg < 2; ++with_bg)
+      row_start[with_bg].push_back(runs[with_bg].size());
+  }
+};
+
+// Most recently used text layouts of a font. Keyed by text and extra
+// spacing; a ticker that redraws the same strings each frame hits the cache
+// every time.
+class Font::TextLayoutCache {
+public:
+  typedef std::shared_ptr<const TextLayout> LayoutPtr;
+
+  // Get the layout of "utf8_text" in "font", creating it if needed.
+  LayoutPtr Get(const Font &font, const char *utf8_text, int extra_spacing) {
+    const std::pair<int, std::string> key(extra_spacing, utf8_text);
+    {
+      MutexLock l(&mutex_);
+      LayoutMap::const_iterator found = layouts_.find(key);
+      if (found != layouts_.end()) return found->second;
+    }
+
+    TextLayout *layout = new TextLayout();
+    const Glyph *const replacement
+      = font.FindGlyph(kUnicodeReplacementCodepoint);
+    int advance = 0;
+    while (*utf8_text) {
+      const Glyph *g = font.FindGlyph(utf8_next_codepoint(utf8_text));
+      if (g == NULL) g = replacement;
+      layout->glyphs.push_back(g);
+      layout->x_offsets.push_back(advance);
+      advance += (g ? g->device_width : 0) + extra_spacing;
+    }
+    layout->width = advance;
+    layout->Rasterize();
+    LayoutPtr result(layout);
+
+    MutexLock l(&mutex_);
+    // Texts that change all the time (e.g. clocks) would fill the cache
+    // with strings never shown again. Simply start over once full.
+    if (layouts_.size() >= kMaxLayouts) layouts_.clear();
+    layouts_[key] = result;
+    return result;
+  }
+
+  void Clear() {
+    MutexLock l(&mutex_);
+    layouts_.clear();
+  }
+
+private:
+  static constexpr size_t kMaxLayouts = 64;
+  typedef std::map<std::pair<int, std::string>, LayoutPtr> LayoutMap;
+
+  Mutex mutex_;
+  LayoutMap layouts_;
+};
+
+
 static bool readNibble(char c, uint8_t* val) {
   if (c >= '0' && c <= '9') { *val = c - '0'; return true; }
   if (c >= 'a' && c <= 'f') { *val = c - 'a' + 0xa; return true; }
@@ -66,12 +319,29 @@ static bool parseBitmap(const char *buffer, rowbitmap_t* result) {
   return true;
 }
 
-Font::Font() : font_height_(-1), base_line_(0) {}
+Font::Font() : font_height_(-1), base_line_(0),
+               layout_cache_(new TextLayoutCache()),
+               compiled_data_(NULL), compiled_size_(0) {}
 Font::~Font() {
   for (CodepointGlyphMap::iterator it = glyphs_.begin();
        it != glyphs_.end(); ++it) {
-    delete it->second;
+    Glyph::Delete(it->second);
   }
+  delete layout_cache_;
+  if (compiled_data_) munmap((void*)compiled_data_, compiled_size_);
+}
+
+void Font::SetGlyph(uint32_t codepoint, Glyph *glyph) {
+  CodepointGlyphMap::iterator found = glyphs_.find(codepoint);
+  if (found != glyphs_.end()) Glyph::Delete(found->second);
+  glyphs_[codepoint] = glyph;
+  if (codepoint <= 0xFFFF) {
+    bmp_pages_.resize(256);
+    std::vector<const Glyph*> &page = bmp_pages_[codepoint >> 8];
+    page.resize(256, NULL);
+    page[codepoint & 0xFF] = glyph;
+  }
+  layout_cache_->Clear();
 }
 
 // TODO: that might not be working for all input files yet.
@@ -80,11 +350,24 @@ bool Font::LoadFont(const char *path) {
   FILE *f = fopen(path, "r");
   if (f == NULL)
     return false;
+  uint32_t magic = 0;
+  if (fread(&magic, sizeof(magic), 1, f) == 1
+      && (magic == kCompiledFontMagic
+          || magic == __builtin_bswap32(kCompiledFontMagic))) {
+    const bool success = MapCompiledFont(path, fileno(f));
+    fclose(f);
+    return success;
+  }
+  rewind(f);
+
   uint32_t codepoint;
   char buffer[1024];
   int dummy;
-  Glyph tmp;
-  Glyph *current_glyph = NULL;
+  int device_width = 0, device_height = 0;
+  int bbx_width, bbx_height, bbx_x_offset, bbx_y_offset;
+  Glyph current_glyph = Glyph();
+  std::vector<rowbitmap_t> bitmap;
+  bool in_glyph = false;
   int row = 0;
 
   while (fgets(buffer, sizeof(buffer), f)) {
@@ -95,32 +378,36 @@ bool Font::LoadFont(const char *path) {
     else if (sscanf(buffer, "ENCODING %ud", &codepoint) == 1) {
       // parsed.
     }
-    else if (sscanf(buffer, "DWIDTH %d %d", &tmp.device_width, &tmp.device_height
+    else if (sscanf(buffer, "DWIDTH %d %d", &device_width, &device_height
                     ) == 2) {
       // Limit to width we can actually display, limited by rowbitmap_t
-      tmp.device_width = std::min(tmp.device_width, kMaxFontWidth);
+      device_width = std::min(device_width, kMaxFontWidth);
       // parsed.
     }
-    else if (sscanf(buffer, "BBX %d %d %d %d", &tmp.width, &tmp.height,
-                    &tmp.x_offset, &tmp.y_offset) == 4) {
-      current_glyph = new Glyph();
-      *current_glyph = tmp;
-      current_glyph->bitmap.resize(tmp.height);
+    else if (sscanf(buffer, "BBX %d %d %d %d", &bbx_width, &bbx_height,
+                    &bbx_x_offset, &bbx_y_offset) == 4) {
+      current_glyph.device_width = device_width;
+      current_glyph.device_height = device_height;
+      current_glyph.width = bbx_width;
+      current_glyph.height = std::max(0, bbx_height);
+      current_glyph.x_offset = bbx_x_offset;
+      current_glyph.y_offset = bbx_y_offset;
+      bitmap.assign(current_glyph.height, rowbitmap_t());
+      in_glyph = true;
       row = -1;  // let's not start yet, wait for BITMAP
     }
     else if (strncmp(buffer, "BITMAP", strlen("BITMAP")) == 0) {
       row = 0;
     }
-    else if (current_glyph && row >= 0 && row < current_glyph->height
-             && parseBitmap(buffer, &current_glyph->bitmap[row])) {
-      current_glyph->bitmap[row] >>= current_glyph->x_offset;
+    else if (in_glyph && row >= 0 && row < current_glyph.height
+             && parseBitmap(buffer, &bitmap[row])) {
+      bitmap[row] >>= current_glyph.x_offset;
       row++;
     }
     else if (strncmp(buffer, "ENDCHAR", strlen("ENDCHAR")) == 0) {
-      if (current_glyph && row == current_glyph->height) {
-        delete glyphs_[codepoint];  // just in case there was one.
-        glyphs_[codepoint] = current_glyph;
-        current_glyph = NULL;
+      if (in_glyph && row == current_glyph.height) {
+        SetGlyph(codepoint, Glyph::Create(current_glyph, bitmap));
+        in_glyph = false;
       }
     }
   }
@@ -128,82 +415,333 @@ bool Font::LoadFont(const char *path) {
   return true;
 }
 
+bool Font::MapCompiledFont(const char *path, int fd) {
+  struct stat st;
+  if (fstat(fd, &st) != 0) return false;
+  if ((size_t)st.st_size < sizeof(CompiledFontHeader)) {
+    fprintf(stderr, "%s: compiled font file truncated.\n", path);
+    return false;
+  }
+  void *mapped = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (mapped == MAP_FAILED) {
+    perror("mmap() of compiled font");
+    return false;
+  }
+  const char *const data = (const char*) mapped;
+  const size_t size = st.st_size;
+  const CompiledFontHeader *header = (const CompiledFontHeader*) data;
+
+  // Glyphs are only looked at when used; check the tables leading to them.
+  const char *error = NULL;
+  if (header->magic != kCompiledFontMagic) {
+    error = "compiled on a machine with different byte order";
+  } else if (header->version != kCompiledFontVersion) {
+    error = "unsupported version";
+  } else if (header->extra_offset % 4 != 0
+             || header->extra_offset + (uint64_t)header->extra_count
+             * sizeof(CompiledGlyphEntry) > size) {
+    error = "invalid glyph index";
+  }
+  for (int i = 0; i < 256 && !error; ++i) {
+    if (header->pages[i] % 4 != 0
+        || header->pages[i] + (uint64_t)256 * sizeof(uint32_t) > size) {
+      error = "invalid page table";
+    }
+  }
+  if (error) {
+    fprintf(stderr, "%s: %s.\n", path, error);
+    munmap(mapped, size);
+    return false;
+  }
+
+  // There can only be one compiled font; glyphs loaded from BDF files stay
+  // and take precedence.
+  if (compiled_data_) munmap((void*)compiled_data_, compiled_size_);
+  compiled_data_ = data;
+  compiled_size_ = size;
+  font_height_ = header->height;
+  base_line_ = header->baseline;
+  layout_cache_->Clear();
+  return true;
+}
+
+const Font::Glyph *Font::FindCompiledGlyph(uint32_t codepoint) const {
+  const CompiledFontHeader *header
+    = (const CompiledFontHeader*) compiled_data_;
+  uint32_t offset;
+  if (codepoint <= 0xFFFF) {
+    const uint32_t page = header->pages[codepoint >> 8];
+    if (page == 0) return NULL;
+    offset = ((const uint32_t*)(compiled_data_ + page))[codepoint & 0xFF];
+  } else {
+    const CompiledGlyphEntry *begin
+      = (const CompiledGlyphEntry*)(compiled_data_ + header->extra_offset);
+    const CompiledGlyphEntry *end = begin + header->extra_count;
+    const CompiledGlyphEntry *found = std::lower_bound(
+      begin, end, codepoint,
+      [](const CompiledGlyphEntry &e, uint32_t c) { return e.codepoint < c; });
+    if (found == end || found->codepoint != codepoint) return NULL;
+    offset = found->offset;
+  }
+
+  // Make sure a broken file can't make us read outside the mapping.
+  if (offset == 0 || offset % 4 != 0
+      || offset + sizeof(Glyph) > compiled_size_) {
+    return NULL;
+  }
+  const Glyph *g = (const Glyph*)(compiled_data_ + offset);
+  if (g->height < 0 || g->device_width < 0 || g->device_width > kMaxFontWidth
+      || offset + g->size() > compiled_size_) {
+    return NULL;
+  }
+  const uint16_t *row_start = g->row_start();
+  for (int y = 0; y < g->height; ++y) {
+    if (row_start[y] > row_start[y+1]) return NULL;
+  }
+  if (row_start[g->height] != g->span_count) return NULL;
+  const GlyphSpan *spans = g->spans();
+  for (int s = 0; s < g->span_count; ++s) {
+    if (spans[s].length == 0 || spans[s].x + spans[s].length > kMaxFontWidth)
+      return NULL;
+  }
+  return g;
+}
+
+void Font::CollectGlyphs(std::map<uint32_t, const Glyph*> *result) const {
+  if (compiled_data_) {
+    const CompiledFontHeader *header
+      = (const CompiledFontHeader*) compiled_data_;
+    for (uint32_t page = 0; page < 256; ++page) {
+      if (header->pages[page] == 0) continue;
+      for (uint32_t i = 0; i < 256; ++i) {
+        const Glyph *g = FindCompiledGlyph(page << 8 | i);
+        if (g) (*result)[page << 8 | i] = g;
+      }
+    }
+    const CompiledGlyphEntry *entry
+      = (const CompiledGlyphEntry*)(compiled_data_ + header->extra_offset);
+    for (uint32_t i = 0; i < header->extra_count; ++i, ++entry) {
+      const Glyph *g = FindCompiledGlyph(entry->codepoint);
+      if (g) (*result)[entry->codepoint] = g;
+    }
+  }
+  for (CodepointGlyphMap::const_iterator it = glyphs_.begin();
+       it != glyphs_.end(); ++it) {
+    (*result)[it->first] = it->second;
+  }
+}
+
+bool Font::WriteCompiledFont(const char *path) const {
+  std::map<uint32_t, const Glyph*> glyphs;
+  CollectGlyphs(&glyphs);
+
+  CompiledFontHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = kCompiledFontMagic;
+  header.version = kCompiledFontVersion;
+  header.height = font_height_;
+  header.baseline = base_line_;
+  header.extra_offset = sizeof(header);
+  std::vector<CompiledGlyphEntry> extra;
+  std::vector<uint32_t> page_tables;
+  std::vector<char> glyph_data;
+
+  // Page tables and glyphs follow the index; but we only know the final
+  // offsets once we know the size of both tables. Collect relative first.
+  for (std::map<uint32_t, const Glyph*>::const_iterator it = glyphs.begin();
+       it != glyphs.end(); ++it) {
+    const uint32_t glyph_offset = glyph_data.size();
+    const Glyph *g = it->second;
+    glyph_data.insert(glyph_data.end(), (const char*)g,
+                      (const char*)g + g->size());
+    glyph_data.resize((glyph_data.size() + 3) & ~3);
+    if (it->first <= 0xFFFF) {
+      uint32_t &page = header.pages[it->first >> 8];
+      if (page == 0) {
+        page_tables.resize(page_tables.size() + 256);
+        page = page_tables.size();  // Relative end, fixed up below.
+      }
+      page_tables[page - 256 + (it->first & 0xFF)] = glyph_offset + 1;
+    } else {
+      const CompiledGlyphEntry entry = { it->first, glyph_offset };
+      extra.push_back(entry);
+    }
+  }
+  header.extra_count = extra.size();
+  const uint32_t pages_start = sizeof(header)
+    + extra.size() * sizeof(CompiledGlyphEntry);
+  const uint32_t glyphs_start = pages_start
+    + page_tables.size() * sizeof(uint32_t);
+  for (int i = 0; i < 256; ++i) {
+    if (header.pages[i] == 0) continue;
+    header.pages[i] = pages_start + (header.pages[i] - 256) * sizeof(uint32_t);
+  }
+  for (size_t i = 0; i < page_tables.size(); ++i) {
+    if (page_tables[i]) page_tables[i] += glyphs_start - 1;
+  }
+  for (size_t i = 0; i < extra.size(); ++i) {
+    extra[i].offset += glyphs_start;
+  }
+
+  FILE *out = fopen(path, "wb");
+  if (out == NULL) {
+    perror(path);
+    return false;
+  }
+  bool success = fwrite(&header, sizeof(header), 1, out) == 1;
+  if (!extra.empty()) {
+    success &= fwrite(extra.data(), sizeof(CompiledGlyphEntry), extra.size(),
+                      out) == extra.size();
+  }
+  if (!page_tables.empty()) {
+    success &= fwrite(page_tables.data(), sizeof(uint32_t), page_tables.size(),
+                      out) == page_tables.size();
+  }
+  if (!glyph_data.empty()) {
+    success &= fwrite(glyph_data.data(), 1, glyph_data.size(), out)
+      == glyph_data.size();
+  }
+  success &= (fclose(out) == 0);
+  if (!success) perror(path);
+  return success;
+}
+
 Font *Font::CreateOutlineFont() const {
   Font *r = new Font();
   const int kBorder = 1;
   r->font_height_ = font_height_ + 2*kBorder;
   r->base_line_ = base_line_ + kBorder;
-  for (CodepointGlyphMap::const_iterator it = glyphs_.begin();
-       it != glyphs_.end(); ++it) {
+  std::map<uint32_t, const Glyph*> glyphs;
+  CollectGlyphs(&glyphs);
+  for (std::map<uint32_t, const Glyph*>::const_iterator it = glyphs.begin();
+       it != glyphs.end(); ++it) {
     const Glyph *orig = it->second;
+    const std::vector<rowbitmap_t> orig_bitmaps = orig->GetBitmap();
     const int height = orig->height + 2 * kBorder;
-    Glyph *const tmp_glyph = new Glyph();
-    tmp_glyph->bitmap.resize(height);
-    tmp_glyph->width  = orig->width  + 2*kBorder;
-    tmp_glyph->height = height;
-    tmp_glyph->device_width  = orig->device_width + 2*kBorder;
-    tmp_glyph->device_height = height;
-    tmp_glyph->y_offset = orig->y_offset - kBorder;
+    Glyph metrics = Glyph();
+    std::vector<rowbitmap_t> bitmap(height);
+    metrics.width  = orig->width  + 2*kBorder;
+    metrics.height = height;
+    metrics.device_width  = orig->device_width + 2*kBorder;
+    metrics.device_height = height;
+    metrics.y_offset = orig->y_offset - kBorder;
     // TODO: we don't really need bounding box, right ?
     const rowbitmap_t fill_pattern = 0b111;
     const rowbitmap_t start_mask   = 0b010;
     // Fill the border
     for (int h = 0; h < orig->height; ++h) {
       rowbitmap_t fill = fill_pattern;
-      rowbitmap_t orig_bitmap = orig->bitmap[h] >> kBorder;
+      rowbitmap_t orig_bitmap = orig_bitmaps[h] >> kBorder;
       for (rowbitmap_t m = start_mask; m.any(); m <<= 1, fill <<= 1) {
         if ((orig_bitmap & m).any()) {
-          tmp_glyph->bitmap[h+kBorder-1] |= fill;
-          tmp_glyph->bitmap[h+kBorder+0] |= fill;
-          tmp_glyph->bitmap[h+kBorder+1] |= fill;
+          bitmap[h+kBorder-1] |= fill;
+          bitmap[h+kBorder+0] |= fill;
+          bitmap[h+kBorder+1] |= fill;
         }
       }
     }
     // Remove original font again.
     for (int h = 0; h < orig->height; ++h) {
-      rowbitmap_t orig_bitmap = orig->bitmap[h] >> kBorder;
-      tmp_glyph->bitmap[h+kBorder] &= ~orig_bitmap;
+      rowbitmap_t orig_bitmap = orig_bitmaps[h] >> kBorder;
+      bitmap[h+kBorder] &= ~orig_bitmap;
     }
-    r->glyphs_[it->first] = tmp_glyph;
+    r->SetGlyph(it->first, Glyph::Create(metrics, bitmap));
   }
   return r;
 }
 
 const Font::Glyph *Font::FindGlyph(uint32_t unicode_codepoint) const {
-  CodepointGlyphMap::const_iterator found = glyphs_.find(unicode_codepoint);
-  if (found == glyphs_.end())
-    return NULL;
-  return found->second;
+  const Glyph *g = NULL;
+  if (unicode_codepoint <= 0xFFFF) {
+    if (!bmp_pages_.empty()) {
+      const std::vector<const Glyph*> &page
+        = bmp_pages_[unicode_codepoint >> 8];
+      if (!page.empty()) g = page[unicode_codepoint & 0xFF];
+    }
+  } else {
+    CodepointGlyphMap::const_iterator found = glyphs_.find(unicode_codepoint);
+    if (found != glyphs_.end()) g = found->second;
+  }
+  if (g == NULL && compiled_data_) g = FindCompiledGlyph(unicode_codepoint);
+  return g;
 }
-
 int Font::CharacterWidth(uint32_t unicode_codepoint) const {
   const Glyph *g = FindGlyph(unicode_codepoint);
   return g ? g->device_width : -1;
 }
 
-int Font::DrawGlyph(Canvas *c, int x_pos, int y_pos,
-                    const Color &color, const Color *bgcolor,
-                    uint32_t unicode_codepoint) const {
-  const Glyph *g = FindGlyph(unicode_codepoint);
-  if (g == NULL) g = FindGlyph(kUnicodeReplacementCodepoint);
-  if (g == NULL) return 0;
-  y_pos = y_pos - g->height - g->y_offset;
+// Send pixels "start" .. "end" of a row to the canvas.
+static void BlitRow(FrameCanvas *frame, int x, int y, Color *row,
+                    int start, int end) {
+  // The bulk path only pays off beyond a couple of pixels.
+  static constexpr int kMinBulkPixels = 4;
+  if (end - start >= kMinBulkPixels) {
+    frame->SetPixels(x + start, y, end - start, 1, row + start);
+    return;
+  }
+  for (int i = start; i < end; ++i)
+    frame->SetPixel(x + i, y, row[i].r, row[i].g, row[i].b);
+}
 
+// Draw glyph "g" with its top left corner at "x_pos", "y_pos".
+void Font::DrawGlyphSpans(Canvas *c, int x_pos, int y_pos, const Glyph *g,
+                          const Color &color, const Color *bgcolor) const {
   if (x_pos + g->device_width < 0 || x_pos > c->width() ||
       y_pos + g->height < 0 || y_pos > c->height()) {
-    return g->device_width;  // Outside canvas border. Bail out early.
+    return;  // Outside canvas border. Bail out early.
   }
 
-  for (int y = 0; y < g->height; ++y) {
-    const rowbitmap_t& row = g->bitmap[y];
-    for (int x = 0; x < g->device_width; ++x) {
-      if (row.test(kMaxFontWidth - 1 - x)) {
-        c->SetPixel(x_pos + x, y_pos + y, color.r, color.g, color.b);
-      } else if (bgcolor) {
+  FrameCanvas *const frame = dynamic_cast<FrameCanvas*>(c);
+  if (frame == NULL) {
+    for (int y = 0; y < g->height; ++y) {
+      int x = 0;
+      for (int s = g->row_start()[y]; s < g->row_start()[y+1]; ++s) {
+        const GlyphSpan &span = g->spans()[s];
+        if (span.x >= g->device_width) break;
+        for (/**/; bgcolor && x < span.x; ++x) {
+          c->SetPixel(x_pos + x, y_pos + y, bgcolor->r, bgcolor->g,
+                      bgcolor->b);
+        }
+        const int end = std::min<int>(span.x + span.length, g->device_width);
+        for (x = span.x; x < end; ++x)
+          c->SetPixel(x_pos + x, y_pos + y, color.r, color.g, color.b);
+      }
+      for (/**/; bgcolor && x < g->device_width; ++x)
         c->SetPixel(x_pos + x, y_pos + y, bgcolor->r, bgcolor->g, bgcolor->b);
+    }
+    return;
+  }
+
+  Color row[kMaxFontWidth];
+  std::fill(row, row + g->device_width, color);
+  for (int y = 0; y < g->height; ++y) {
+    if (bgcolor) {
+      std::fill(row, row + g->device_width, *bgcolor);
+      for (int s = g->row_start()[y]; s < g->row_start()[y+1]; ++s) {
+        const GlyphSpan &span = g->spans()[s];
+        if (span.x >= g->device_width) break;
+        std::fill(row + span.x, row + std::min<int>(span.x + span.length,
+                                                    g->device_width), color);
+      }
+      BlitRow(frame, x_pos, y_pos + y, row, 0, g->device_width);
+    } else {
+      for (int s = g->row_start()[y]; s < g->row_start()[y+1]; ++s) {
+        const GlyphSpan &span = g->spans()[s];
+        if (span.x >= g->device_width) break;
+        BlitRow(frame, x_pos, y_pos + y, row, span.x,
+                std::min<int>(span.x + span.length, g->device_width));
       }
     }
   }
+}
+
+int Font::DrawGlyph(Canvas *c, int x_pos, int y_pos,
+                    const Color &color, const Color *bgcolor,
+                    uint32_t unicode_codepoint) const {
+  const Glyph *g = FindGlyph(unicode_codepoint);
+  if (g == NULL) g = FindGlyph(kUnicodeReplacementCodepoint);
+  if (g == NULL) return 0;
+  DrawGlyphSpans(c, x_pos, y_pos - g->height - g->y_offset, g, color, bgcolor);
   return g->device_width;
 }
 
@@ -212,4 +750,63 @@ int Font::DrawGlyph(Canvas *c, int x_pos, int y_pos, const Color &color,
   return DrawGlyph(c, x_pos, y_pos, color, NULL, unicode_codepoint);
 }
 
+int Font::DrawText(Canvas *c, int x, int y,
+                   const Color &color, const Color *background_color,
+                   const char *utf8_text, int extra_spacing) const {
+  const TextLayoutCache::LayoutPtr layout
+    = layout_cache_->Get(*this, utf8_text, extra_spacing);
+
+  // Other canvases might not clip the same way, so they get exactly the
+  // pixels they would get from drawing the glyphs one by one.
+  FrameCanvas *const frame = dynamic_cast<FrameCanvas*>(c);
+  if (frame == NULL) {
+    for (size_t i = 0; i < layout->glyphs.size(); ++i) {
+      const Glyph *g = layout->glyphs[i];
+      if (g == NULL) continue;
+      DrawGlyphSpans(c, x + layout->x_offsets[i], y - g->height - g->y_offset,
+                     g, color, background_color);
+    }
+    return layout->width;
+  }
+
+  // Adjacent runs are collected in "row" and sent in one go.
+  const int with_bg = (background_color != NULL);
+  const std::vector<TextRun> &runs = layout->runs[with_bg];
+  const std::vector<uint32_t> &row_start = layout->row_start[with_bg];
+  std::vector<Color> row(layout->max_x - layout->min_x);
+  Color *const row_origin = row.data() - layout->min_x;
+  const int rows = row_start.size() - 1;
+  for (int r = 0; r < rows; ++r) {
+    const int canvas_y = y + layout->top + r;
+    if (canvas_y < 0 || canvas_y >= frame->height()) continue;
+    int stretch_start = 0, stretch_end = 0;
+    for (uint32_t i = row_start[r]; i < row_start[r+1]; ++i) {
+      const TextRun &run = runs[i];
+      if (run.x != stretch_end) {
+        BlitRow(frame, x, canvas_y, row_origin, stretch_start, stretch_end);
+        stretch_start = run.x;
+      }
+      std::fill(row_origin + run.x, row_origin + run.x + run.length,
+                run.foreground ? color : *background_color);
+      stretch_end = run.x + run.length;
+    }
+    BlitRow(frame, x, canvas_y, row_origin, stretch_start, stretch_end);
+  }
+  return layout->width;
+}
+
+int Font::VerticalDrawText(Canvas *c, int x, int y,
+                           const Color &color, const Color *background_color,
+                           const char *utf8_text, int extra_spacing) const {
+  // The cached layouts are rasterized for horizontal text; vertical text
+  // draws glyph by glyph, so it doesn't evict them.
+  const int start_y = y;
+  while (*utf8_text) {
+    const uint32_t cp = utf8_next_codepoint(utf8_text);
+    DrawGlyph(c, x, y, color, background_color, cp);
+    y += height() + extra_spacing;
+  }
+  return y - start_y;
+}
+
 }  // namespace rgb_matrix
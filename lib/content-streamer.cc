@@ -14,6 +14,7 @@
 
 #include <algorithm>
 
+#include "framebuffer-internal.h"
 #include "gpio-bits.h"
 
 namespace rgb_matrix {
@@ -27,27 +28,154 @@ namespace {
 // the Raspberry Pi, but also x86; so it is possible to create streams easily
 // on a different x86 Linux PC.
 static const uint32_t kFileMagicValue = 0xED0C5A48;
+
+// Streams written before the header recorded the bitplanes always had 11.
+static const int kLegacyBitPlanes = 11;
+
+// Stream format versions. Fields that did not exist in earlier versions
+// were zero there.
+enum StreamVersion {
+  kVersionRawFrames = 0,     // Every frame is the raw Serialize() data.
+  kVersionDeltaFrames = 1,   // Keyframes and deltas, see FrameEncoding.
+};
+
 struct FileHeader {
   uint32_t magic;  // kFileMagicValue
   uint32_t buf_size;
   uint32_t width;
   uint32_t height;
-  uint64_t future_use1;
+  uint32_t version;             // StreamVersion
+  uint32_t keyframe_interval;   // kVersionDeltaFrames: frames per keyframe.
   uint64_t is_wide_gpio : 1;
-  uint64_t flags_future_use : 63;
+  uint64_t bitplanes : 5;       // 0 in old streams: kLegacyBitPlanes.
+  uint64_t flags_future_use : 58;
 };
 STATIC_ASSERT(file_header_size_changed, sizeof(FileHeader) == 32);
 
+// How the frame data following a FrameHeader is stored. All but
+// kEncodingRaw are sequences of 32-bit words compressed with EncodeRLE();
+// deltas are the XOR with the previous frame.
+enum FrameEncoding {
+  kEncodingRaw = 0,        // The Serialize() data. Always a keyframe.
+  kEncodingRLEKey = 1,     // Keyframe, RLE compressed.
+  kEncodingRLEDelta = 2,   // Delta to previous frame, RLE compressed.
+};
+
 static const uint32_t kFrameMagicValue = 0x12345678;
 struct FrameHeader {
   uint32_t magic;  // kFrameMagic
   uint32_t size;
   uint32_t hold_time_us;  // How long this frame lasts in usec.
-  uint32_t future_use1;
-  uint64_t future_use2;
-  uint64_t future_use3;
+  uint32_t encoding;         // FrameEncoding
+  uint64_t keyframe_offset;  // Stream position of keyframe this depends on.
+  uint64_t frame_number;     // Counting from 0.
 };
 STATIC_ASSERT(file_header_size_changed, sizeof(FrameHeader) == 32);
+
+// Optional index at the end of the stream, written by
+// StreamWriter::AppendIndex(): a FrameHeader with kIndexMagicValue whose
+// size covers the following internal::FrameIndexEntry for each frame,
+// then an IndexTrailer at the very end of the stream.
+// Readers that don't know about the index see a frame with unexpected
+// magic and stop there.
+static const uint32_t kIndexMagicValue = 0x1D3E5A48;
+static const uint32_t kIndexTrailerMagicValue = 0x1D3E5A49;
+struct IndexTrailer {
+  uint32_t magic;  // kIndexTrailerMagicValue
+  uint32_t frame_count;
+  uint64_t index_offset;  // Stream position of the index FrameHeader.
+};
+STATIC_ASSERT(index_trailer_size_changed, sizeof(IndexTrailer) == 16);
+STATIC_ASSERT(index_entry_size_changed,
+              sizeof(internal::FrameIndexEntry) == 24);
+
+// Run length encoding of 32-bit words, optionally XORed with a reference.
+// Each run starts with a token word: bit 31 set means the following word
+// is repeated (token & 0x7fffffff) times, otherwise that many literal
+// words follow. Unchanged parts of a delta are repeated zeros, which the
+// decoder can just skip.
+static const uint32_t kRepeatRun = 0x80000000;
+static const size_t kMaxRun = 0x7fffffff;
+
+// Encode "count" words of "in", each XORed with "reference" if not NULL.
+// Returns number of words written to "out", which has room for "count"
+// words, or 0 if the encoded data would not be smaller than that.
+static size_t EncodeRLE(const uint32_t *in, const uint32_t *reference,
+                        size_t count, uint32_t *out) {
+#define RLE_WORD(i) (reference ? in[i] ^ reference[i] : in[i])
+  size_t pos = 0;
+  size_t literal_start = 0;
+  size_t i = 0;
+  while (i <= count) {
+    // Find length of run of identical words at i.
+    size_t run = 0;
+    if (i < count) {
+      const uint32_t value = RLE_WORD(i);
+      run = 1;
+      while (i + run < count && run < kMaxRun && RLE_WORD(i + run) == value)
+        ++run;
+    }
+    // Runs of three or more are worth a repeat token; also flush literals
+    // at the end.
+    if (run >= 3 || i == count) {
+      const size_t literals = i - literal_start;
+      if (literals) {
+        if (pos + 1 + literals >= count) return 0;
+        out[pos++] = literals;
+        for (size_t j = literal_start; j < i; ++j) out[pos++] = RLE_WORD(j);
+      }
+      if (i == count) break;
+      if (pos + 2 >= count) return 0;
+      out[pos++] = kRepeatRun | run;
+      out[pos++] = RLE_WORD(i);
+      i += run;
+      literal_start = i;
+    } else {
+      i += run;
+      if (i - literal_start >= kMaxRun) {
+        if (pos + 1 + (i - literal_start) >= count) return 0;
+        out[pos++] = i - literal_start;
+        for (size_t j = literal_start; j < i; ++j) out[pos++] = RLE_WORD(j);
+        literal_start = i;
+      }
+    }
+  }
+#undef RLE_WORD
+  return pos;
+}
+
+// Decode "in_count" words of RLE data into "out" with "count" words. Deltas
+// are XORed into "out", keyframes overwrite it. Returns false if data
+// is corrupt.
+static bool DecodeRLE(const uint32_t *in, size_t in_count,
+                      uint32_t *out, size_t count, bool is_delta) {
+  const uint32_t *const in_end = in + in_count;
+  const uint32_t *const out_end = out + count;
+  while (in < in_end) {
+    const uint32_t token = *in++;
+    const size_t run = token & ~kRepeatRun;
+    if (run > (size_t)(out_end - out)) return false;
+    if (token & kRepeatRun) {
+      if (in == in_end) return false;
+      const uint32_t value = *in++;
+      if (!is_delta) {
+        std::fill(out, out + run, value);
+      } else if (value != 0) {
+        for (size_t i = 0; i < run; ++i) out[i] ^= value;
+      }
+    } else {
+      if (run > (size_t)(in_end - in)) return false;
+      if (is_delta) {
+        for (size_t i = 0; i < run; ++i) out[i] ^= in[i];
+      } else {
+        memcpy(out, in, run * sizeof(*in));
+      }
+      in += run;
+    }
+    out += run;
+  }
+  return out == out_end;
+}
 }
 
 FileStreamIO::FileStreamIO(int fd) : fd_(fd) {
@@ -65,6 +193,16 @@ ssize_t FileStreamIO::Append(const void *buf, const size_t count) {
   return write(fd_, buf, count);
 }
 
+int64_t FileStreamIO::Size() {
+  struct stat s;
+  if (fstat(fd_, &s) < 0) return -1;
+  return s.st_size;
+}
+
+bool FileStreamIO::Seek(uint64_t position) {
+  return lseek(fd_, position, SEEK_SET) == (off_t)position;
+}
+
 void MemStreamIO::Rewind() { pos_ = 0; }
 ssize_t MemStreamIO::Read(void *buf, size_t count) {
   const size_t amount = std::min(count, buffer_.size() - pos_);
@@ -76,6 +214,18 @@ ssize_t MemStreamIO::Append(const void *buf, size_t count) {
   buffer_.append((const char*)buf, count);
   return count;
 }
+int64_t MemStreamIO::Size() { return buffer_.size(); }
+bool MemStreamIO::Seek(uint64_t position) {
+  if (position > buffer_.size()) return false;
+  pos_ = position;
+  return true;
+}
+const char *MemStreamIO::ReadView(size_t count) {
+  if (count > buffer_.size() - pos_) return NULL;
+  const char *result = buffer_.data() + pos_;
+  pos_ += count;
+  return result;
+}
 
 MemMapViewInput::MemMapViewInput(int fd) : buffer_(nullptr) {
   struct stat s;
@@ -101,10 +251,23 @@ MemMapViewInput::MemMapViewInput(int fd) : buffer_(nullptr) {
 
 void MemMapViewInput::Rewind() { pos_ = buffer_; }
 ssize_t MemMapViewInput::Read(void *buf, size_t count) {
-  if (pos_ + count >= end_) return -1;
-  memcpy(buf, pos_, count);
+  const size_t amount = std::min(count, (size_t)(end_ - pos_));
+  memcpy(buf, pos_, amount);
+  pos_ += amount;
+  return amount;
+}
+int64_t MemMapViewInput::Size() { return end_ - buffer_; }
+bool MemMapViewInput::Seek(uint64_t position) {
+  if (position > (uint64_t)(end_ - buffer_)) return false;
+  pos_ = buffer_ + position;
+  return true;
+}
+
+const char *MemMapViewInput::ReadView(size_t count) {
+  if (count > (size_t)(end_ - pos_)) return NULL;
+  const char *result = pos_;
   pos_ += count;
-  return count;
+  return result;
 }
 
 MemMapViewInput::~MemMapViewInput() {
@@ -136,7 +299,17 @@ static bool FullAppend(StreamIO *io, const void *buf, const size_t count) {
   return remaining == 0;
 }
 
-StreamWriter::StreamWriter(StreamIO *io) : io_(io), header_written_(false) {}
+StreamWriter::StreamWriter(StreamIO *io, int keyframe_interval)
+  : io_(io), keyframe_interval_(std::max(0, keyframe_interval)),
+    header_written_(false), index_written_(false), buf_size_(0),
+    previous_(NULL), encoded_(NULL), frame_count_(0), position_(0),
+    keyframe_offset_(0), keyframe_number_(0), timestamp_us_(0) {}
+
+StreamWriter::~StreamWriter() {
+  delete [] previous_;
+  delete [] encoded_;
+}
+
 bool StreamWriter::Stream(const FrameCanvas &frame, uint32_t hold_time_us) {
   const char *data;
   size_t len;
@@ -145,12 +318,70 @@ bool StreamWriter::Stream(const FrameCanvas &frame, uint32_t hold_time_us) {
   if (!header_written_) {
     WriteFileHeader(frame, len);
   }
+  if (len != buf_size_) return false;  // Frames need to be all the same.
+  if (index_written_) return false;    // Index needs to be last.
+
   FrameHeader h = {};
   h.magic = kFrameMagicValue;
-  h.size = len;
   h.hold_time_us = hold_time_us;
-  FullAppend(io_, &h, sizeof(h));
-  return FullAppend(io_, data, len) == (ssize_t)len;
+  h.frame_number = frame_count_;
+  const char *payload = data;
+  size_t payload_len = len;
+  if (keyframe_interval_ == 0) {
+    h.encoding = kEncodingRaw;
+  } else {
+    // Serialized data is an array of gpio_bits_t, so well aligned.
+    const uint32_t *words = reinterpret_cast<const uint32_t*>(data);
+    const size_t word_count = len / sizeof(uint32_t);
+    const bool is_key = (frame_count_ % keyframe_interval_ == 0);
+    size_t encoded_count = 0;
+    if (!is_key) {
+      encoded_count = EncodeRLE(words, previous_, word_count, encoded_);
+      h.encoding = kEncodingRLEDelta;
+    }
+    if (encoded_count == 0) {  // keyframe, or delta didn't compress.
+      encoded_count = EncodeRLE(words, NULL, word_count, encoded_);
+      h.encoding = kEncodingRLEKey;
+    }
+    if (encoded_count > 0) {
+      payload = reinterpret_cast<const char*>(encoded_);
+      payload_len = encoded_count * sizeof(uint32_t);
+    } else {
+      h.encoding = kEncodingRaw;
+    }
+    memcpy(previous_, data, len);
+  }
+  if (h.encoding != kEncodingRLEDelta) {
+    keyframe_offset_ = position_;
+    keyframe_number_ = frame_count_;
+  }
+  h.keyframe_offset = keyframe_offset_;
+  h.size = payload_len;
+
+  const internal::FrameIndexEntry entry = { position_, timestamp_us_,
+                                            hold_time_us, keyframe_number_ };
+  index_.push_back(entry);
+  timestamp_us_ += hold_time_us;
+
+  ++frame_count_;
+  position_ += sizeof(h) + payload_len;
+  return (FullAppend(io_, &h, sizeof(h))
+          && FullAppend(io_, payload, payload_len));
+}
+
+bool StreamWriter::AppendIndex() {
+  if (!header_written_ || index_written_) return false;
+  FrameHeader h = {};
+  h.magic = kIndexMagicValue;
+  h.size = index_.size() * sizeof(internal::FrameIndexEntry);
+  IndexTrailer trailer = {};
+  trailer.magic = kIndexTrailerMagicValue;
+  trailer.frame_count = index_.size();
+  trailer.index_offset = position_;
+  index_written_ = true;
+  return (FullAppend(io_, &h, sizeof(h))
+          && FullAppend(io_, index_.data(), h.size)
+          && FullAppend(io_, &trailer, sizeof(trailer)));
 }
 
 void StreamWriter::WriteFileHeader(const FrameCanvas &frame, size_t len) {
@@ -160,32 +391,99 @@ void StreamWriter::WriteFileHeader(const FrameCanvas &frame, size_t len) {
   header.height = frame.height();
   header.buf_size = len;
   header.is_wide_gpio = (sizeof(gpio_bits_t) > 4);
+  header.bitplanes = frame.bitplanes();
+  if (keyframe_interval_ > 0) {
+    header.version = kVersionDeltaFrames;
+    header.keyframe_interval = keyframe_interval_;
+    previous_ = new uint32_t[len / sizeof(uint32_t)];
+    encoded_ = new uint32_t[len / sizeof(uint32_t)];
+  }
   FullAppend(io_, &header, sizeof(header));
   header_written_ = true;
+  buf_size_ = len;
+  position_ = sizeof(header);
 }
 
 StreamReader::StreamReader(StreamIO *io)
-  : io_(io), state_(STREAM_AT_BEGIN), header_frame_buffer_(NULL) {
+  : io_(io), state_(STREAM_AT_BEGIN), version_(kVersionRawFrames),
+    width_(0), height_(0), bitplanes_(0), header_frame_buffer_(NULL), reference_(NULL),
+    have_reference_(false), position_(0), next_frame_(0),
+    index_state_(INDEX_UNKNOWN), zero_copy_(false) {
   io_->Rewind();
 }
-StreamReader::~StreamReader() { delete [] header_frame_buffer_; }
+StreamReader::~StreamReader() {
+  delete [] header_frame_buffer_;
+  delete [] reference_;
+}
 
 void StreamReader::Rewind() {
   io_->Rewind();
   state_ = STREAM_AT_BEGIN;
+  have_reference_ = false;
+  position_ = 0;
+  next_frame_ = 0;
 }
 
-bool StreamReader::GetNext(FrameCanvas *frame, uint32_t* hold_time_us) {
-  if (state_ == STREAM_AT_BEGIN && !ReadFileHeader(*frame)) return false;
+bool StreamReader::GetNext(FrameCanvas *frame, uint32_t* hold_time_us,
+                           bool *in_place) {
+  if (in_place) *in_place = false;
+  if (state_ == STREAM_AT_BEGIN && !ReadFileHeader()) return false;
   if (state_ != STREAM_READING) return false;
 
-  // Read header and expected buffer size.
-  if (!FullRead(io_, header_frame_buffer_,
-                sizeof(FrameHeader) + frame_buf_size_)) {
+  if ((int)width_ != frame->width() || (int)height_ != frame->height()) {
+    fprintf(stderr, "This stream is for %dx%d, can't play on %dx%d. "
+            "Please use the same settings for record/replay\n",
+            width_, height_, frame->width(), frame->height());
+    state_ = STREAM_ERROR;
+    return false;
+  }
+  if ((int)bitplanes_ < frame->bitplanes()) {
+    fprintf(stderr, "This stream has %d bitplanes, can't play on %d. "
+            "Please use at most --led-pwm-bits=%d for replay\n",
+            bitplanes_, frame->bitplanes(), bitplanes_);
+    state_ = STREAM_ERROR;
     return false;
   }
 
-  const FrameHeader &h = *reinterpret_cast<FrameHeader*>(header_frame_buffer_);
+  const char *data;
+  bool in_stream;
+  if (!ReadFrame(&data, hold_time_us, &in_stream)) return false;
+  if ((int)bitplanes_ > frame->bitplanes()) {
+    return frame->framebuffer()->DeserializeUpperBitplanes(
+      data, frame_buf_size_, bitplanes_);
+  }
+  if (in_stream && frame->DeserializeView(data, frame_buf_size_)) {
+    if (in_place) *in_place = true;
+    return true;
+  }
+  return frame->Deserialize(data, frame_buf_size_);
+}
+
+bool StreamReader::ReadFrame(const char **data, uint32_t *hold_time_us,
+                             bool *in_stream) {
+  const FrameHeader *header =
+    reinterpret_cast<const FrameHeader*>(header_frame_buffer_);
+  const char *payload = header_frame_buffer_ + sizeof(FrameHeader);
+  *in_stream = false;
+
+  if (version_ == kVersionRawFrames) {
+    // Read header and expected buffer size in one go; if possible without
+    // copying.
+    const char *view = zero_copy_
+      ? io_->ReadView(sizeof(FrameHeader) + frame_buf_size_) : NULL;
+    if (view) {
+      header = reinterpret_cast<const FrameHeader*>(view);
+      payload = view + sizeof(FrameHeader);
+      *in_stream = true;
+    } else if (!FullRead(io_, header_frame_buffer_,
+                         sizeof(FrameHeader) + frame_buf_size_)) {
+      return false;
+    }
+  } else {
+    if (!FullRead(io_, header_frame_buffer_, sizeof(FrameHeader)))
+      return false;
+  }
+  const FrameHeader &h = *header;
 
   // TODO: we might allow for this to be a kFileMagicValue, to allow people
   // to just concatenate streams. In that case, we just would need to read
@@ -195,32 +493,66 @@ bool StreamReader::GetNext(FrameCanvas *frame, uint32_t* hold_time_us) {
     return false;
   }
 
-  // In the future, we might allow larger buffers (audio?), but never smaller.
-  // For now, we need to make sure to exactly match the size, as our assumption
-  // above is that we can read the full header + frame in one FullRead().
-  if (h.size != frame_buf_size_)
+  if (version_ == kVersionRawFrames) {
+    // In the future, we might allow larger buffers (audio?), but never
+    // smaller. For now, we need to make sure to exactly match the size, as
+    // our assumption above is that we can read the full header + frame in
+    // one FullRead().
+    if (h.size != frame_buf_size_)
+      return false;
+
+    position_ += sizeof(FrameHeader) + frame_buf_size_;
+    ++next_frame_;
+    if (hold_time_us) *hold_time_us = h.hold_time_us;
+    *data = payload;
+    return true;
+  }
+
+  // Encoded frames are never larger than the raw data.
+  if (h.size > frame_buf_size_ || h.size % sizeof(uint32_t) != 0
+      || !FullRead(io_, header_frame_buffer_ + sizeof(FrameHeader), h.size)) {
+    state_ = STREAM_ERROR;
     return false;
+  }
 
+  const uint32_t *const words = reinterpret_cast<const uint32_t*>(payload);
+  const size_t word_count = frame_buf_size_ / sizeof(uint32_t);
+  bool success = false;
+  switch (h.encoding) {
+  case kEncodingRaw:
+    success = (h.size == frame_buf_size_);
+    if (success) memcpy(reference_, payload, frame_buf_size_);
+    break;
+  case kEncodingRLEKey:
+    success = DecodeRLE(words, h.size / sizeof(uint32_t),
+                        reference_, word_count, false);
+    break;
+  case kEncodingRLEDelta:
+    success = have_reference_
+      && DecodeRLE(words, h.size / sizeof(uint32_t),
+                   reference_, word_count, true);
+    break;
+  }
+  have_reference_ = success;
+  if (!success) {
+    state_ = STREAM_ERROR;
+    return false;
+  }
+
+  position_ += sizeof(FrameHeader) + h.size;
+  ++next_frame_;
   if (hold_time_us) *hold_time_us = h.hold_time_us;
-  return frame->Deserialize(header_frame_buffer_ + sizeof(FrameHeader),
-                            frame_buf_size_);
+  *data = reinterpret_cast<const char*>(reference_);
+  return true;
 }
 
-bool StreamReader::ReadFileHeader(const FrameCanvas &frame) {
+bool StreamReader::ReadFileHeader() {
   FileHeader header;
   FullRead(io_, &header, sizeof(header));
   if (header.magic != kFileMagicValue) {
     state_ = STREAM_ERROR;
     return false;
   }
-  if ((int)header.width != frame.width()
-      || (int)header.height != frame.height()) {
-    fprintf(stderr, "This stream is for %dx%d, can't play on %dx%d. "
-            "Please use the same settings for record/replay\n",
-            header.width, header.height, frame.width(), frame.height());
-    state_ = STREAM_ERROR;
-    return false;
-  }
   if (header.is_wide_gpio != (sizeof(gpio_bits_t) == 8)) {
     fprintf(stderr, "This stream was written with %s GPIO width support but "
             "this library is compiled with %d bit GPIO width (see "
@@ -230,10 +562,117 @@ bool StreamReader::ReadFileHeader(const FrameCanvas &frame) {
     state_ = STREAM_ERROR;
     return false;
   }
+  if (header.version > kVersionDeltaFrames) {
+    fprintf(stderr, "Stream format version %u is not supported by this "
+            "library version.\n", header.version);
+    state_ = STREAM_ERROR;
+    return false;
+  }
   state_ = STREAM_READING;
+  version_ = header.version;
+  width_ = header.width;
+  height_ = header.height;
+  bitplanes_ = header.bitplanes ? header.bitplanes : kLegacyBitPlanes;
   frame_buf_size_ = header.buf_size;
+  position_ = sizeof(header);
+  next_frame_ = 0;
+  have_reference_ = false;
   if (!header_frame_buffer_)
     header_frame_buffer_ = new char [ sizeof(FrameHeader) + header.buf_size ];
+  if (version_ != kVersionRawFrames && !reference_)
+    reference_ = new uint32_t[header.buf_size / sizeof(uint32_t)];
+  return true;
+}
+
+bool StreamReader::LoadIndex() {
+  if (index_state_ != INDEX_UNKNOWN) return index_state_ == INDEX_LOADED;
+  index_state_ = INDEX_MISSING;
+
+  const int64_t size = io_->Size();
+  IndexTrailer trailer;
+  FrameHeader h;
+  bool success = (size >= (int64_t)(sizeof(FileHeader) + sizeof(h)
+                                    + sizeof(trailer))
+                  && io_->Seek(size - sizeof(trailer))
+                  && FullRead(io_, &trailer, sizeof(trailer))
+                  && trailer.magic == kIndexTrailerMagicValue
+                  && io_->Seek(trailer.index_offset)
+                  && FullRead(io_, &h, sizeof(h))
+                  && h.magic == kIndexMagicValue
+                  && h.size == (trailer.frame_count
+                                * sizeof(internal::FrameIndexEntry))
+                  && (trailer.index_offset + sizeof(h) + h.size
+                      + sizeof(trailer)) == (uint64_t)size);
+  if (success) {
+    index_.resize(trailer.frame_count);
+    success = FullRead(io_, index_.data(), h.size);
+  }
+  if (success) {
+    index_state_ = INDEX_LOADED;
+  } else {
+    index_.clear();
+  }
+
+  // Back to where we were.
+  if (state_ == STREAM_AT_BEGIN) {
+    io_->Rewind();
+  } else {
+    io_->Seek(position_);
+  }
+  return success;
+}
+
+bool StreamReader::GetStreamInfo(size_t *frame_count, uint64_t *duration_us) {
+  if (!LoadIndex()) return false;
+  *frame_count = index_.size();
+  *duration_us = index_.empty() ? 0 : (index_.back().timestamp_us
+                                       + index_.back().hold_time_us);
   return true;
 }
+
+bool StreamReader::SeekToFrame(size_t frame_number) {
+  if (state_ == STREAM_AT_BEGIN && !ReadFileHeader()) return false;
+  if (width_ == 0 || !LoadIndex() || frame_number >= index_.size())
+    return false;
+  state_ = STREAM_READING;  // Also recover from reaching the end.
+
+  // Deltas need to be decoded starting from their keyframe, unless we are
+  // already on the way there.
+  const size_t keyframe = index_[frame_number].keyframe;
+  const bool can_continue = (version_ != kVersionRawFrames && have_reference_
+                             && next_frame_ > keyframe
+                             && next_frame_ <= frame_number);
+  if (!can_continue) {
+    const size_t start = (version_ == kVersionRawFrames)
+      ? frame_number : keyframe;
+    if (!io_->Seek(index_[start].offset)) return false;
+    position_ = index_[start].offset;
+    next_frame_ = start;
+    have_reference_ = false;
+  }
+
+  const char *data;
+  bool in_stream;
+  while (next_frame_ < frame_number) {
+    if (!ReadFrame(&data, NULL, &in_stream)) return false;
+  }
+  return true;
+}
+
+bool StreamReader::SeekToTime(uint64_t time_us) {
+  if (!LoadIndex()) return false;
+  // First frame that starts after time_us; the one before is shown then.
+  size_t low = 0, high = index_.size();
+  while (low < high) {
+    const size_t mid = low + (high - low) / 2;
+    if (index_[mid].timestamp_us <= time_us)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  if (low == 0) return false;
+  const internal::FrameIndexEntry &e = index_[low - 1];
+  if (time_us >= e.timestamp_us + e.hold_time_us) return false;  // At end.
+  return SeekToFrame(low - 1);
+}
 }  // namespace rgb_matrix
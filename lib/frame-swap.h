@@ -0,0 +1,170 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Hand-off of frames between the thread producing them and the refresh
+// thread. The refresh thread runs on its own realtime core and must not
+// block or enter the kernel for this; only the producer ever sleeps.
+
+#ifndef RPI_FRAME_SWAP_H
+#define RPI_FRAME_SWAP_H
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#include "refresh-metrics-internal.h"
+#include "thread.h"
+
+namespace rgb_matrix {
+namespace internal {
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+              "futex word needs to be a plain 32 bit value");
+
+// Sleep while "*word" still contains "expected". If "timeout_ms" is >= 0,
+// wait at most that long. Returns false on timeout. Might return
+// spuriously, so callers re-check their condition.
+inline bool FutexWait(std::atomic<uint32_t> *word, uint32_t expected,
+                      long timeout_ms = -1) {
+  struct timespec timeout;
+  if (timeout_ms >= 0) {
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (timeout_ms % 1000) * 1000000;
+  }
+  const long r = syscall(SYS_futex, reinterpret_cast<uint32_t*>(word),
+                         FUTEX_WAIT_PRIVATE, expected,
+                         timeout_ms >= 0 ? &timeout : NULL, NULL, 0);
+  return !(r < 0 && errno == ETIMEDOUT);
+}
+
+// Wake all threads sleeping in FutexWait() on "word".
+inline void FutexWakeAll(std::atomic<uint32_t> *word) {
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word),
+          FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+// Mailbox protocol to exchange the currently displayed frame.
+//
+// The producer posts the next frame together with a ticket number and
+// sleeps until the refresh thread acknowledges that ticket. The refresh
+// thread calls FrameDone() after each refresh; at the requested frame
+// boundary it picks up the posted frame with a couple of atomic loads and
+// stores, and only does a wake-up syscall if a producer is actually asleep.
+//
+// Multiple producers are serialized with a mutex, which the refresh thread
+// never touches.
+template <class Frame>
+class FrameSwap {
+public:
+  explicit FrameSwap(Frame *initial)
+    : current_(initial), frame_count_(0), served_ticket_(0),
+      served_post_nanos_(0), requested_frame_multiple_(1), posted_ticket_(0),
+      next_(NULL), post_nanos_(0), acknowledged_ticket_(0),
+      producer_waiting_(false), last_ticket_(0) {}
+
+  // -- Refresh thread side.
+
+  // The frame to be shown.
+  Frame *current() const { return current_.load(std::memory_order_relaxed); }
+
+  // Frame multiple requested with the latest swap.
+  unsigned frame_multiple() const {
+    return requested_frame_multiple_.load(std::memory_order_relaxed);
+  }
+
+  // When the swap last served by FrameDone() was posted, in MonotonicNanos().
+  uint64_t served_post_nanos() const { return served_post_nanos_; }
+
+  // To be called after each refresh of the current frame. Never blocks.
+  // Returns true if a swap was served.
+  bool FrameDone() {
+    const unsigned multiple = frame_multiple();
+    bool served = false;
+    // Do fast equality test first (likely due to frame_count reset).
+    if (frame_count_ == multiple || frame_count_ % multiple == 0) {
+      // We reset to avoid frame hick-up every couple of weeks
+      // run-time iff the frame multiple is not a factor of 2^32.
+      frame_count_ = 0;
+      const uint32_t ticket = posted_ticket_.load(std::memory_order_acquire);
+      if (ticket != served_ticket_) {
+        if (next_ != NULL) current_.store(next_, std::memory_order_relaxed);
+        served_ticket_ = ticket;
+        served_post_nanos_ = post_nanos_;
+        acknowledged_ticket_.store(ticket, std::memory_order_seq_cst);
+        if (producer_waiting_.load(std::memory_order_seq_cst))
+          FutexWakeAll(&acknowledged_ticket_);
+        served = true;
+      }
+    }
+    ++frame_count_;
+    return served;
+  }
+
+  // -- Producer side.
+
+  // Have "next" shown at the next frame boundary that is a multiple of
+  // "frame_multiple" frames. "next" can be NULL to just wait for that
+  // boundary. Blocks until then and returns the frame that was shown
+  // before.
+  Frame *Swap(Frame *next, unsigned frame_multiple) {
+    MutexLock l(&producer_mutex_);
+    Frame *const previous = current_.load(std::memory_order_relaxed);
+    next_ = next;
+    requested_frame_multiple_.store(frame_multiple, std::memory_order_relaxed);
+    post_nanos_ = MonotonicNanos();
+    const uint32_t ticket = ++last_ticket_;
+    posted_ticket_.store(ticket, std::memory_order_release);
+
+    producer_waiting_.store(true, std::memory_order_seq_cst);
+    uint32_t seen;
+    while ((seen = acknowledged_ticket_.load(std::memory_order_seq_cst))
+           != ticket) {
+      FutexWait(&acknowledged_ticket_, seen);
+    }
+    producer_waiting_.store(false, std::memory_order_relaxed);
+    return previous;
+  }
+
+private:
+  // Refresh thread. Written only there, read by the producer once the
+  // ticket it posted was acknowledged, so it is stable while it looks.
+  std::atomic<Frame*> current_;
+  unsigned frame_count_;
+  uint32_t served_ticket_;
+  uint64_t served_post_nanos_;
+
+  // Producer -> refresh thread. next_ and post_nanos_ are published by
+  // posted_ticket_.
+  std::atomic<unsigned> requested_frame_multiple_;
+  std::atomic<uint32_t> posted_ticket_;
+  Frame *next_;
+  uint64_t post_nanos_;
+
+  // Refresh thread -> producer. Futex word the producer sleeps on.
+  std::atomic<uint32_t> acknowledged_ticket_;
+  std::atomic<bool> producer_waiting_;
+
+  Mutex producer_mutex_;
+  uint32_t last_ticket_;
+};
+}  // namespace internal
+}  // namespace rgb_matrix
+
+#endif  // RPI_FRAME_SWAP_H
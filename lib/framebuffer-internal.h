@@ -18,14 +18,21 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <atomic>
+#include <vector>
+
 #include "hardware-mapping.h"
 #include "../include/graphics.h"
 
+struct RGBLedHistogram;
+
 namespace rgb_matrix {
 class GPIO;
 class PinPulser;
+struct YUVImage;
 namespace internal {
 class RowAddressSetter;
+struct ColorLookup;
 
 // An opaque type used within the framebuffer that can be used
 // to copy between PixelMappers.
@@ -38,26 +45,68 @@ struct PixelDesignator {
   gpio_bits_t mask;
 };
 
+// Maps each pixel to its PixelDesignator.
+//
+// There are only a few distinct combinations of color bits (one per
+// sub-panel of each parallel chain), so instead of a full PixelDesignator,
+// each pixel is stored as a 32 bit Entry: the gpio_word offset together
+// with an index into a small table of these combinations. Even large
+// setups stay cache friendly that way.
 class PixelDesignatorMap {
 public:
+  typedef uint32_t Entry;
+  static constexpr Entry kUnused = ~(Entry)0;  // Pixel not used.
+
   PixelDesignatorMap(int width, int height, const PixelDesignator &fill_bits);
+  PixelDesignatorMap(const PixelDesignatorMap &other);
   ~PixelDesignatorMap();
 
-  // Get a writable version of the PixelDesignator. Outside Framebuffer used
-  // by the RGBMatrix to re-assign mappings to new PixelDesignatorMappers.
-  PixelDesignator *get(int x, int y);
+  // Get the PixelDesignator of a pixel. Returns false if it is outside the
+  // map or not used.
+  bool Get(int x, int y, PixelDesignator *result) const;
+
+  // Set the PixelDesignator of a pixel. Used by the Framebuffer to set up
+  // the physical layout, and by the RGBMatrix to re-arrange them for
+  // PixelMappers. Call Finish() once all pixels are set.
+  void Set(int x, int y, const PixelDesignator &designator);
+  void Finish();
 
   inline int width() const { return width_; }
   inline int height() const { return height_; }
 
   // All bits that set red/green/blue pixels; used for Fill().
-  const PixelDesignator &GetFillColorBits() { return fill_bits_; }
+  const PixelDesignator &GetFillColorBits() const { return fill_bits_; }
+
+  // -- Fast access for the Framebuffer.
+
+  // The "width" entries of row "y".
+  inline const Entry *row(int y) const { return entries_ + y * width_; }
+
+  // If true, row "y" is laid out linearly: all pixels are used, have the
+  // same color bits and are in consecutive gpio_words. This is the case for
+  // the plain panel layout and many PixelMappers; bulk writes can then
+  // handle the row as one run without looking at individual entries.
+  inline bool is_row_linear(int y) const { return row_linear_[y]; }
+
+  // Entry "n" pixels further in a linear run starting at "e".
+  static inline Entry Advance(Entry e, int n) { return e + (n << kColorBits); }
+
+  // Fill "result" with what "e" (must not be kUnused) designates.
+  inline void Decode(Entry e, PixelDesignator *result) const {
+    *result = color_bits_[e & kColorMask];
+    result->gpio_word = e >> kColorBits;
+  }
 
 private:
+  static constexpr int kColorBits = 5;
+  static constexpr Entry kColorMask = (1 << kColorBits) - 1;
+
   const int width_;
   const int height_;
   const PixelDesignator fill_bits_;  // Precalculated for fill.
-  PixelDesignator *const buffer_;
+  Entry *const entries_;
+  std::vector<bool> row_linear_;
+  std::vector<PixelDesignator> color_bits_;  // gpio_word not used.
 };
 
 // Internal representation of the frame-buffer that as well can
@@ -66,28 +115,24 @@ private:
 // written out.
 class Framebuffer {
 public:
-  // Maximum usable bitplanes.
-  //
-  // 11 bits seems to be a sweet spot in which we still get somewhat useful
-  // refresh rate and have good color richness. This is the default setting
-  // However, in low-light situations, we want to be able to scale down
-  // brightness more, having more bits at the bottom.
-  // TODO(hzeller): make the default 15 bit or so, but slide the use of
-  //  timing to lower bits if fewer bits requested to not affect the overall
-  //  refresh in that case.
-  //  This needs to be balanced to not create too agressive timing however.
-  //  To be explored in a separete commit.
+  // Number of bitplanes a framebuffer stores, chosen at construction: the
+  // most PWM bits it can show. Memory and copying scale with it.
   //
-  // For now, if someone needs very low level of light, change this to
-  // say 13 and recompile. Run with --led-pwm-bits=13. Also, consider
-  // --led-pwm-dither-bits=2 to have the refresh rate not suffer too much.
-  static constexpr int kBitPlanes = 11;
+  // Bitplane b is shown for 2^b times the shortest time. 11 bits seems to
+  // be a sweet spot in which we still get somewhat useful refresh rate and
+  // have good color richness, so that is the default. With fewer, the
+  // framebuffer stores only the most significant of these 11, so the
+  // timing and brightness stays the same and only the darkest shades are
+  // lost. More add bits at the bottom for low-light situations, at the
+  // expense of refresh rate (consider --led-pwm-dither-bits=2).
   static constexpr int kDefaultBitPlanes = 11;
+  static constexpr int kMaxBitPlanes = 16;
 
   Framebuffer(int rows, int columns, int parallel,
               int scan_mode,
               const char* led_sequence, bool inverse_color,
-              PixelDesignatorMap **mapper);
+              PixelDesignatorMap **mapper,
+              int bitplanes = kDefaultBitPlanes);
   ~Framebuffer();
 
   // Initialize GPIO bits for output. Only call once.
@@ -99,35 +144,110 @@ public:
                        int row_address_type);
   static void InitializePanels(GPIO *io, const char *panel_type, int columns);
 
+  // Record the overshoot of output enable pulses in "histogram" (see
+  // PinPulser::set_overshoot_histogram()). Call after InitGPIO().
+  static void SetPulseOvershootHistogram(RGBLedHistogram *histogram);
+
+  // Dim the output by making output enable pulses "scale" (0..1) times
+  // as long (see PinPulser::SetPulseScale()). Call between refreshes.
+  static void SetPulseScale(float scale);
+
+  // The hardware mapping chosen in InitHardwareMapping().
+  static const struct HardwareMapping *hardware_mapping() {
+    return hardware_mapping_;
+  }
+
   // Set PWM bits used for output. Default is 11, but if you only deal with
   // simple comic-colors, 1 might be sufficient. Lower require less CPU.
-  // Returns boolean to signify if value was within range.
+  // Returns boolean to signify if value was within range, which is up to
+  // bitplanes().
   bool SetPWMBits(uint8_t value);
   uint8_t pwmbits() { return pwm_bits_; }
 
+  // The bitplanes stored: bits [end_bitplane() - bitplanes(), end_bitplane())
+  // of the color values, each shown 2^bit times the shortest time.
+  int bitplanes() const { return bitplanes_; }
+  int end_bitplane() const { return end_bitplane_; }
+
   // Map brightness of output linearly to input with CIE1931 profile.
-  void set_luminance_correct(bool on) { do_luminance_correct_ = on; }
+  void set_luminance_correct(bool on) {
+    if (on != do_luminance_correct_) color_lookup_ = NULL;
+    do_luminance_correct_ = on;
+  }
   bool luminance_correct() const { return do_luminance_correct_; }
 
   // Set brightness in percent; range=1..100
   // This will only affect newly set pixels.
   void SetBrightness(uint8_t b) {
-    brightness_ = (b <= 100 ? (b != 0 ? b : 1) : 100);
+    b = (b <= 100 ? (b != 0 ? b : 1) : 100);
+    if (b != brightness_) color_lookup_ = NULL;
+    brightness_ = b;
   }
   uint8_t brightness() { return brightness_; }
 
-  void DumpToMatrix(GPIO *io, int pwm_bits_to_show);
+  // If "bitplane_nanos" is not NULL, the time spent on each bitplane shown
+  // is added to bitplane_nanos[bitplane].
+  void DumpToMatrix(GPIO *io, int pwm_bits_to_show,
+                    uint64_t *bitplane_nanos = NULL);
+
+  // Find the bitplanes that are the same as the one shown right before
+  // them. The shift registers then already hold their data, so
+  // DumpToMatrix() only latches and shows them instead of clocking it in
+  // again. This is the case for black areas, solid fills and the upper
+  // bitplanes of dim content.
+  // Holds until the next write to this framebuffer, so call it when the
+  // content is final, i.e. when swapping it in.
+  void PlanRefresh();
 
   void Serialize(const char **data, size_t *len) const;
   bool Deserialize(const char *data, size_t len);
   void CopyFrom(const Framebuffer *other);
 
+  // Like Deserialize(), but for "data" serialized with "bitplanes" of at
+  // least bitplanes(), e.g. with more PWM bits. Its lowest bitplanes are
+  // dropped, so colors are shown with less depth but the same brightness.
+  bool DeserializeUpperBitplanes(const char *data, size_t len, int bitplanes);
+
+  // Like Deserialize(), but show "data" in place instead of copying it.
+  // The data needs to stay unchanged while shown. Anything writing to this
+  // framebuffer afterwards goes back to the own buffer first.
+  // Returns false if size or alignment don't fit.
+  bool SetView(const char *data, size_t len);
+  bool is_view() const { return bitplane_buffer_ != own_buffer_; }
+
+  // Change tracking. Everything writing to the framebuffer marks the double
+  // rows it touched as dirty; they stay dirty until ClearDirtyRows().
+  // Bit n of a RowMask represents double row n.
+  typedef uint64_t RowMask;
+  int double_rows() const { return double_rows_; }
+  RowMask all_rows() const {
+    return double_rows_ >= 64 ? ~(RowMask)0 : ((RowMask)1 << double_rows_) - 1;
+  }
+  RowMask dirty_rows() const { return dirty_rows_; }
+  void ClearDirtyRows() { dirty_rows_ = 0; }
+
+  // Like CopyFrom(), but only copy the given double rows.
+  void CopyRowsFrom(const Framebuffer *other, RowMask rows);
+
+  // Replace the content with that of "other", laid out for another pixel
+  // mapping: each pixel "other" shows at (x, y) with "from_map" is placed
+  // where (x, y) is with "to_map". Pixels not covered by "from_map" are
+  // black. The bitplanes are moved as they are, so this is exact.
+  void CopyRemapped(const Framebuffer *other,
+                    const PixelDesignatorMap &from_map,
+                    const PixelDesignatorMap &to_map);
+
   // Canvas-inspired methods, but we're not implementing this interface to not
   // have an unnecessary vtable.
   int width() const;
   int height() const;
   void SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue);
   void SetPixels(int x, int y, int width, int height, Color *colors);
+  void SetYUVImage(int x, int y, int width, int height,
+                   const YUVImage &image);
+  void SetPixelData(int x, int y, int width, int height,
+                    const uint8_t *data, int row_stride, int pixel_stride,
+                    int red_offset, int green_offset, int blue_offset);
   void Clear();
   void Fill(uint8_t red, uint8_t green, uint8_t blue);
 
@@ -135,6 +255,14 @@ private:
   static const struct HardwareMapping *hardware_mapping_;
   static RowAddressSetter *row_setter_;
 
+  // DumpToMatrix() for a particular type of row_setter_, chosen in
+  // InitGPIO(). Refresh<RowAddressSetter> works with any.
+  template <class RowSetter>
+  void Refresh(GPIO *io, int pwm_low_bit, uint64_t *bitplane_nanos);
+  typedef void (Framebuffer::*RefreshKernel)(GPIO *io, int pwm_low_bit,
+                                             uint64_t *bitplane_nanos);
+  static RefreshKernel refresh_kernel_;
+
   // This returns the gpio-bit for given color (one of 'R', 'G', 'B'). This is
   // returning the right value in case "led_sequence" is _not_ "RGB"
   static gpio_bits_t GetGpioFromLedSequence(char col, const char *led_sequence,
@@ -146,6 +274,18 @@ private:
                              PixelDesignator *designator);
   inline void  MapColors(uint8_t r, uint8_t g, uint8_t b,
                          uint16_t *red, uint16_t *green, uint16_t *blue);
+  // Color mapping for the current brightness and luminance correction.
+  // Looked up again after any of these changed.
+  inline const ColorLookup *color_lookup();
+
+  // Bulk encoding used by SetPixels(). SetPixelRow() splits a row of pixels
+  // into runs that land in consecutive columns of the same double row
+  // with the same color bits; each of these is written by EncodeRun() one
+  // bitplane at a time.
+  void SetPixelRow(int x, int y, int count, const Color *colors);
+  void EncodeRun(const PixelDesignator &designator, int count,
+                 const uint16_t *red, const uint16_t *green,
+                 const uint16_t *blue);
   const int rows_;     // Number of rows. 16 or 32.
   const int parallel_; // Parallel rows of chains. 1 or 2.
   const int height_;   // rows * parallel
@@ -154,6 +294,15 @@ private:
   const int scan_mode_;
   const bool inverse_color_;
 
+  const int bitplanes_;
+  const int end_bitplane_;     // One above the most significant bitplane.
+  const int lowest_bitplane_;  // end_bitplane_ - bitplanes_
+
+  // Fixed for the refresh: the GPIO bits written while clocking in a
+  // column, and the double rows in the order they are shown.
+  gpio_bits_t color_clk_mask_;
+  uint8_t row_sequence_[64];
+
   uint8_t pwm_bits_;   // PWM bits to display.
   bool do_luminance_correct_;
   uint8_t brightness_;
@@ -163,13 +312,54 @@ private:
 
   // The frame-buffer is organized in bitplanes.
   // Highest level (slowest to cycle through) are double rows.
-  // For each double-row, we store pwm-bits columns of a bitplane.
+  // For each double-row, we store bitplanes_ times columns of a bitplane.
   // Each bitplane-column is pre-filled IoBits, of which the colors are set.
   // Of course, that means that we store unrelated bits in the frame-buffer,
   // but it allows easy access in the critical section.
   gpio_bits_t *bitplane_buffer_;
   inline gpio_bits_t *ValueAt(int double_row, int column, int bit);
 
+  // Storage owned by us. bitplane_buffer_ points here, unless it shows
+  // external data set with SetView(), which we never write to.
+  gpio_bits_t *own_buffer_;
+  inline void PrepareWrite(bool keep_content) {
+    if (__builtin_expect(is_view(), 0)) LeaveView(keep_content);
+  }
+  void LeaveView(bool keep_content);
+
+  // Bits in the buffer per double row, and its reciprocal to quickly find
+  // the double row a gpio_word offset belongs to.
+  const size_t row_stride_;
+  const uint64_t row_reciprocal_;
+  inline RowMask RowOf(long gpio_word) const {
+    return (RowMask)1 << ((gpio_word * row_reciprocal_) >> 40);
+  }
+  RowMask dirty_rows_;
+  // Call before changing the content, so that the refresh stops relying on
+  // the plan before it gets outdated: the fence keeps the writes that follow
+  // from becoming visible before the cleared flag. Only the first write
+  // after planning pays for it.
+  inline void MarkDirty(RowMask rows) {
+    dirty_rows_ |= rows;
+    if (refresh_planned_.load(std::memory_order_relaxed)) {
+      refresh_planned_.store(false, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+  }
+
+  // Set by PlanRefresh(), cleared by any write. Bit b of
+  // same_as_previous_[d] is set if bitplane b of double row d is the same
+  // as bitplane b - 1; of same_as_row_before_[d] if it is the same as the
+  // most significant bitplane of the double row shown before d.
+  // The refresh thread reads these while the frame is shown, which might
+  // be while it is planned again or drawn on; refresh_planned_ publishes
+  // the masks.
+  std::atomic<bool> refresh_planned_;
+  std::atomic<uint16_t> same_as_previous_[64];
+  std::atomic<uint16_t> same_as_row_before_[64];
+
+  const ColorLookup *color_lookup_;  // Shared; NULL until needed.
+
   PixelDesignatorMap **shared_mapper_;  // Storage in RGBMatrix.
 };
 }  // namespace internal
@@ -28,9 +28,21 @@
 #include <string.h>
 
 #include <algorithm>
+#include <atomic>
+#include <vector>
+
+#if !defined(ENABLE_WIDE_GPIO_COMPUTE_MODULE) && defined(__ARM_NEON)
+#  include <arm_neon.h>
+#  define FRAMEBUFFER_SIMD_NEON 1
+#elif !defined(ENABLE_WIDE_GPIO_COMPUTE_MODULE) && defined(__SSE2__)
+#  include <emmintrin.h>
+#  define FRAMEBUFFER_SIMD_SSE2 1
+#endif
 
 #include "gpio.h"
+#include "thread.h"
 #include "../include/graphics.h"
+#include "../include/led-matrix.h"
 
 namespace rgb_matrix {
 namespace internal {
@@ -44,20 +56,70 @@ static PinPulser *sOutputEnablePulser = NULL;
 #  define SUB_PANELS_ 2
 #endif
 
-PixelDesignator *PixelDesignatorMap::get(int x, int y) {
-  if (x < 0 || y < 0 || x >= width_ || y >= height_)
-    return NULL;
-  return buffer_ + (y*width_) + x;
-}
-
 PixelDesignatorMap::PixelDesignatorMap(int width, int height,
                                        const PixelDesignator &fill_bits)
   : width_(width), height_(height), fill_bits_(fill_bits),
-    buffer_(new PixelDesignator[width * height]) {
+    entries_(new Entry[width * height]), row_linear_(height, false) {
+  std::fill(entries_, entries_ + width * height, kUnused);
+}
+
+PixelDesignatorMap::PixelDesignatorMap(const PixelDesignatorMap &other)
+  : width_(other.width_), height_(other.height_), fill_bits_(other.fill_bits_),
+    entries_(new Entry[width_ * height_]), row_linear_(other.row_linear_),
+    color_bits_(other.color_bits_) {
+  std::copy(other.entries_, other.entries_ + width_ * height_, entries_);
 }
 
 PixelDesignatorMap::~PixelDesignatorMap() {
-  delete [] buffer_;
+  delete [] entries_;
+}
+
+bool PixelDesignatorMap::Get(int x, int y, PixelDesignator *result) const {
+  if (x < 0 || y < 0 || x >= width_ || y >= height_)
+    return false;
+  const Entry e = entries_[y * width_ + x];
+  if (e == kUnused) return false;
+  Decode(e, result);
+  return true;
+}
+
+void PixelDesignatorMap::Set(int x, int y, const PixelDesignator &d) {
+  assert(x >= 0 && y >= 0 && x < width_ && y < height_);
+  Entry *const entry = &entries_[y * width_ + x];
+  if (d.gpio_word < 0) {
+    *entry = kUnused;
+    return;
+  }
+  assert(d.gpio_word < ((long)1 << (32 - kColorBits)) - 1);
+  size_t index = 0;
+  while (index < color_bits_.size()
+         && !(color_bits_[index].r_bit == d.r_bit
+              && color_bits_[index].g_bit == d.g_bit
+              && color_bits_[index].b_bit == d.b_bit
+              && color_bits_[index].mask == d.mask)) {
+    ++index;
+  }
+  if (index == color_bits_.size()) {
+    if (index > kColorMask) {
+      fprintf(stderr, "Too many distinct color bit combinations in "
+              "pixel mapping.\n");
+      abort();
+    }
+    color_bits_.push_back(d);
+    color_bits_.back().gpio_word = -1;
+  }
+  *entry = (Entry)d.gpio_word << kColorBits | index;
+}
+
+void PixelDesignatorMap::Finish() {
+  for (int y = 0; y < height_; ++y) {
+    const Entry *const r = row(y);
+    bool linear = (r[0] != kUnused);
+    for (int x = 1; linear && x < width_; ++x) {
+      linear = (r[x] == Advance(r[0], x));
+    }
+    row_linear_[y] = linear;
+  }
 }
 
 // Different panel types use different techniques to set the row address.
@@ -73,7 +135,7 @@ namespace {
 
 // The default DirectRowAddressSetter just sets the address in parallel
 // output lines ABCDE with A the LSB and E the MSB.
-class DirectRowAddressSetter : public RowAddressSetter {
+class DirectRowAddressSetter final : public RowAddressSetter {
 public:
   DirectRowAddressSetter(int double_rows, const HardwareMapping &h)
     : row_mask_(0), last_row_(-1) {
@@ -119,7 +181,7 @@ private:
 // same time (if they have the same content), but that isn't implemented here.
 // BK, DIN and DCK are the designations on the SM5266P datasheet.
 // BK = Enable Input, DIN = Serial In, DCK = Clock
-class SM5266RowAddressSetter : public RowAddressSetter {
+class SM5266RowAddressSetter final : public RowAddressSetter {
 public:
   SM5266RowAddressSetter(int double_rows, const HardwareMapping &h)
     : row_mask_(h.a | h.b | h.c),
@@ -169,7 +231,7 @@ private:
   gpio_bits_t row_lookup_[32];
 };
 
-class B707ShiftRegisterRowAddressSetter : public RowAddressSetter {
+class B707ShiftRegisterRowAddressSetter final : public RowAddressSetter {
 public:
   B707ShiftRegisterRowAddressSetter(int double_rows, const HardwareMapping &h)
     : row_mask_(h.a | h.b | h.c),
@@ -206,7 +268,7 @@ private:
 };
 
 
-class ShiftRegisterRowAddressSetter : public RowAddressSetter {
+class ShiftRegisterRowAddressSetter final : public RowAddressSetter {
 public:
   ShiftRegisterRowAddressSetter(int double_rows, const HardwareMapping &h)
     : double_rows_(double_rows),
@@ -242,7 +304,7 @@ private:
 // Issue #823
 // An shift register row address setter that does not use B but C for the
 // data. Clock is inverted.
-class ABCShiftRegisterRowAddressSetter : public RowAddressSetter {
+class ABCShiftRegisterRowAddressSetter final : public RowAddressSetter {
 public:
   ABCShiftRegisterRowAddressSetter(int double_rows, const HardwareMapping &h)
     : double_rows_(double_rows),
@@ -287,7 +349,7 @@ private:
 // Line B  | 1 | 0 | 1 | 1
 // Line C  | 1 | 1 | 0 | 1
 // Line D  | 1 | 1 | 1 | 0
-class DirectABCDLineRowAddressSetter : public RowAddressSetter {
+class DirectABCDLineRowAddressSetter final : public RowAddressSetter {
 public:
   DirectABCDLineRowAddressSetter(int double_rows, const HardwareMapping &h)
     : last_row_(-1) {
@@ -320,20 +382,52 @@ private:
 
 const struct HardwareMapping *Framebuffer::hardware_mapping_ = NULL;
 RowAddressSetter *Framebuffer::row_setter_ = NULL;
+Framebuffer::RefreshKernel Framebuffer::refresh_kernel_
+  = &Framebuffer::Refresh<RowAddressSetter>;
+
+// All color bits of the used parallel chains and the clock.
+static gpio_bits_t ColorClockMask(const HardwareMapping &h, int parallel) {
+  gpio_bits_t mask = h.clock;
+  mask |= h.p0_r1 | h.p0_g1 | h.p0_b1 | h.p0_r2 | h.p0_g2 | h.p0_b2;
+  if (parallel >= 2) {
+    mask |= h.p1_r1 | h.p1_g1 | h.p1_b1 | h.p1_r2 | h.p1_g2 | h.p1_b2;
+  }
+  if (parallel >= 3) {
+    mask |= h.p2_r1 | h.p2_g1 | h.p2_b1 | h.p2_r2 | h.p2_g2 | h.p2_b2;
+  }
+  if (parallel >= 4) {
+    mask |= h.p3_r1 | h.p3_g1 | h.p3_b1 | h.p3_r2 | h.p3_g2 | h.p3_b2;
+  }
+  if (parallel >= 5) {
+    mask |= h.p4_r1 | h.p4_g1 | h.p4_b1 | h.p4_r2 | h.p4_g2 | h.p4_b2;
+  }
+  if (parallel >= 6) {
+    mask |= h.p5_r1 | h.p5_g1 | h.p5_b1 | h.p5_r2 | h.p5_g2 | h.p5_b2;
+  }
+  return mask;
+}
 
 Framebuffer::Framebuffer(int rows, int columns, int parallel,
                          int scan_mode,
                          const char *led_sequence, bool inverse_color,
-                         PixelDesignatorMap **mapper)
+                         PixelDesignatorMap **mapper, int bitplanes)
   : rows_(rows),
     parallel_(parallel),
     height_(rows * parallel),
     columns_(columns),
     scan_mode_(scan_mode),
     inverse_color_(inverse_color),
-    pwm_bits_(kBitPlanes), do_luminance_correct_(true), brightness_(100),
+    bitplanes_(bitplanes),
+    end_bitplane_(std::max(bitplanes, (int)kDefaultBitPlanes)),
+    lowest_bitplane_(end_bitplane_ - bitplanes),
+    pwm_bits_(bitplanes), do_luminance_correct_(true), brightness_(100),
     double_rows_(rows / SUB_PANELS_),
-    buffer_size_(double_rows_ * columns_ * kBitPlanes * sizeof(gpio_bits_t)),
+    buffer_size_(double_rows_ * columns_ * bitplanes_ * sizeof(gpio_bits_t)),
+    row_stride_(columns_ * bitplanes_),
+    // Rounded up, this is exact for offsets up to 2^40 / row_stride_.
+    row_reciprocal_(((uint64_t(1) << 40) + row_stride_ - 1) / row_stride_),
+    dirty_rows_(0), refresh_planned_(false),
+    color_lookup_(NULL),
     shared_mapper_(mapper) {
   assert(hardware_mapping_ != NULL);   // Called InitHardwareMapping() ?
   assert(shared_mapper_ != NULL);  // Storage should be provided by RGBMatrix.
@@ -346,8 +440,27 @@ Framebuffer::Framebuffer(int rows, int columns, int parallel,
     abort();
   }
   assert(parallel >= 1 && parallel <= 6);
+  assert(double_rows_ <= 64);  // Fits in RowMask
+  assert(bitplanes_ >= 1 && bitplanes_ <= kMaxBitPlanes);
+  color_clk_mask_ = ColorClockMask(*hardware_mapping_, parallel);
+
+  bitplane_buffer_ = new gpio_bits_t[double_rows_ * columns_ * bitplanes_];
+  own_buffer_ = bitplane_buffer_;
 
-  bitplane_buffer_ = new gpio_bits_t[double_rows_ * columns_ * kBitPlanes];
+  const int half_double = double_rows_ / 2;
+  for (int row_loop = 0; row_loop < double_rows_; ++row_loop) {
+    switch (scan_mode_) {
+    case 0:  // progressive
+    default:
+      row_sequence_[row_loop] = row_loop;
+      break;
+
+    case 1:  // interlaced
+      row_sequence_[row_loop] = ((row_loop < half_double)
+                                 ? (row_loop << 1)
+                                 : ((row_loop - half_double) << 1) + 1);
+    }
+  }
 
   // If we're the first Framebuffer created, the shared PixelMapper is
   // still NULL, so create one.
@@ -372,16 +485,19 @@ Framebuffer::Framebuffer(int rows, int columns, int parallel,
     *shared_mapper_ = new PixelDesignatorMap(columns_, height_, fill_bits);
     for (int y = 0; y < height_; ++y) {
       for (int x = 0; x < columns_; ++x) {
-        InitDefaultDesignator(x, y, led_sequence, (*shared_mapper_)->get(x, y));
+        PixelDesignator designator;
+        InitDefaultDesignator(x, y, led_sequence, &designator);
+        (*shared_mapper_)->Set(x, y, designator);
       }
     }
+    (*shared_mapper_)->Finish();
   }
 
   Clear();
 }
 
 Framebuffer::~Framebuffer() {
-  delete [] bitplane_buffer_;
+  delete [] own_buffer_;
 }
 
 // TODO: this should also be parsed from some special formatted string, e.g.
@@ -461,24 +577,32 @@ Framebuffer::~Framebuffer() {
   }
 
   const int double_rows = rows / SUB_PANELS_;
+  // The refresh is specialized for the row address setter, so that setting
+  // the address is inlined.
   switch (row_address_type) {
   case 0:
     row_setter_ = new DirectRowAddressSetter(double_rows, h);
+    refresh_kernel_ = &Framebuffer::Refresh<DirectRowAddressSetter>;
     break;
   case 1:
     row_setter_ = new ShiftRegisterRowAddressSetter(double_rows, h);
+    refresh_kernel_ = &Framebuffer::Refresh<ShiftRegisterRowAddressSetter>;
     break;
   case 2:
     row_setter_ = new DirectABCDLineRowAddressSetter(double_rows, h);
+    refresh_kernel_ = &Framebuffer::Refresh<DirectABCDLineRowAddressSetter>;
     break;
   case 3:
     row_setter_ = new ABCShiftRegisterRowAddressSetter(double_rows, h);
+    refresh_kernel_ = &Framebuffer::Refresh<ABCShiftRegisterRowAddressSetter>;
     break;
   case 4:
     row_setter_ = new SM5266RowAddressSetter(double_rows, h);
+    refresh_kernel_ = &Framebuffer::Refresh<SM5266RowAddressSetter>;
     break;
   case 5:
     row_setter_ = new B707ShiftRegisterRowAddressSetter(double_rows, h);
+    refresh_kernel_ = &Framebuffer::Refresh<B707ShiftRegisterRowAddressSetter>;
     break;
 
 
@@ -496,9 +620,10 @@ Framebuffer::~Framebuffer() {
                                              is_some_adafruit_hat);
   assert(result == all_used_bits);  // Impl: all bits declared in gpio.cc ?
 
+  // Timings for any bitplane a framebuffer can have.
   std::vector<int> bitplane_timings;
   uint32_t timing_ns = pwm_lsb_nanoseconds;
-  for (int b = 0; b < kBitPlanes; ++b) {
+  for (int b = 0; b < kMaxBitPlanes; ++b) {
     bitplane_timings.push_back(timing_ns);
     if (b >= dither_bits) timing_ns *= 2;
   }
@@ -592,6 +717,17 @@ static void InitFM6127(GPIO *io, const struct HardwareMapping &h, int columns) {
   io->ClearBits(h.strobe);
 }
 
+/*static*/ void Framebuffer::SetPulseOvershootHistogram(
+  RGBLedHistogram *histogram) {
+  if (sOutputEnablePulser)
+    sOutputEnablePulser->set_overshoot_histogram(histogram);
+}
+
+/*static*/ void Framebuffer::SetPulseScale(float scale) {
+  if (sOutputEnablePulser)
+    sOutputEnablePulser->SetPulseScale(scale);
+}
+
 /*static*/ void Framebuffer::InitializePanels(GPIO *io,
                                               const char *panel_type,
                                               int columns) {
@@ -609,89 +745,130 @@ static void InitFM6127(GPIO *io, const struct HardwareMapping &h, int columns) {
 }
 
 bool Framebuffer::SetPWMBits(uint8_t value) {
-  if (value < 1 || value > kBitPlanes)
+  if (value < 1 || value > bitplanes_)
     return false;
   pwm_bits_ = value;
   return true;
 }
 
 inline gpio_bits_t *Framebuffer::ValueAt(int double_row, int column, int bit) {
-  return &bitplane_buffer_[ double_row * (columns_ * kBitPlanes)
-                            + bit * columns_
+  return &bitplane_buffer_[ double_row * row_stride_
+                            + (bit - lowest_bitplane_) * columns_
                             + column ];
 }
 
 void Framebuffer::Clear() {
+  PrepareWrite(false);
   if (inverse_color_) {
     Fill(0, 0, 0);
   } else  {
     // Cheaper.
-    memset(bitplane_buffer_, 0,
-           sizeof(*bitplane_buffer_) * double_rows_ * columns_ * kBitPlanes);
+    MarkDirty(all_rows());
+    memset(bitplane_buffer_, 0, buffer_size_);
   }
 }
 
-// Do CIE1931 luminance correction and scale to output bitplanes
-static uint16_t luminance_cie1931(uint8_t c, uint8_t brightness) {
-  float out_factor = ((1 << internal::Framebuffer::kBitPlanes) - 1);
+// Do CIE1931 luminance correction and scale to "bits" output bitplanes
+static uint16_t luminance_cie1931(uint8_t c, uint8_t brightness, int bits) {
+  float out_factor = ((1 << bits) - 1);
   float v = (float) c * brightness / 255.0;
   return roundf(out_factor * ((v <= 8) ? v / 902.3 : pow((v + 16) / 116.0, 3)));
 }
 
-struct ColorLookup {
-  uint16_t color[256];
-};
-static ColorLookup *CreateLuminanceCIE1931LookupTable() {
-  ColorLookup *for_brightness = new ColorLookup[100];
-  for (int c = 0; c < 256; ++c)
-    for (int b = 0; b < 100; ++b)
-      for_brightness[b].color[c] = luminance_cie1931(c, b + 1);
-
-  return for_brightness;
-}
-
-static inline uint16_t CIEMapColor(uint8_t brightness, uint8_t c) {
-  static ColorLookup *luminance_lookup = CreateLuminanceCIE1931LookupTable();
-  return luminance_lookup[brightness - 1].color[c];
-}
-
 // Non luminance correction. TODO: consider getting rid of this.
-static inline uint16_t DirectMapColor(uint8_t brightness, uint8_t c) {
+static inline uint16_t DirectMapColor(uint8_t brightness, uint8_t c,
+                                      int bits) {
   // simple scale down the color value
   c = c * brightness / 100;
 
   // shift to be left aligned with top-most bits.
-  constexpr int shift = internal::Framebuffer::kBitPlanes - 8;
+  const int shift = bits - 8;
   return (shift > 0) ? (c << shift) : (c >> -shift);
 }
 
-inline void Framebuffer::MapColors(
-  uint8_t r, uint8_t g, uint8_t b,
-  uint16_t *red, uint16_t *green, uint16_t *blue) {
+// Each bitplane gets three bits in ColorLookup::spread, so that the spread
+// values of red, green and blue (shifted by 0, 1 and 2) can be combined
+// into one word that has the color index of each plane in consecutive
+// 3-bit groups.
+static_assert(3 * Framebuffer::kMaxBitPlanes <= 64, "Too many bitplanes");
 
-  if (do_luminance_correct_) {
-    *red   = CIEMapColor(brightness_, r);
-    *green = CIEMapColor(brightness_, g);
-    *blue  = CIEMapColor(brightness_, b);
-  } else {
-    *red   = DirectMapColor(brightness_, r);
-    *green = DirectMapColor(brightness_, g);
-    *blue  = DirectMapColor(brightness_, b);
+struct ColorLookup {
+  uint16_t value[256];   // Mapped value; bit n is shown in bitplane n.
+  uint64_t spread[256];  // Bit n of value moved to bit 3*n.
+};
+
+// Color values have "bits" bits, the end_bitplane() of the framebuffers
+// using them.
+static ColorLookup *CreateColorLookup(uint8_t brightness,
+                                      bool luminance_correct, bool inverse,
+                                      int bits) {
+  ColorLookup *lookup = new ColorLookup();
+  for (int c = 0; c < 256; ++c) {
+    uint16_t value = luminance_correct
+      ? luminance_cie1931(c, brightness, bits)
+      : DirectMapColor(brightness, c, bits);
+    if (inverse) value = ~value;
+    lookup->value[c] = value;
+    uint64_t spread = 0;
+    for (int b = 0; b < bits; ++b) {
+      if (value & (1 << b)) spread |= uint64_t(1) << (3 * b);
+    }
+    lookup->spread[c] = spread;
   }
+  return lookup;
+}
 
-  if (inverse_color_) {
-    *red = ~(*red);
-    *green = ~(*green);
-    *blue = ~(*blue);
+// Lookups are shared between all framebuffers. Once created, they are kept,
+// so switching between brightness levels (e.g. for fading) is cheap after
+// the first round.
+static const ColorLookup *GetColorLookup(uint8_t brightness,
+                                         bool luminance_correct,
+                                         bool inverse, int bits) {
+  static constexpr int kBitVariants
+    = Framebuffer::kMaxBitPlanes - Framebuffer::kDefaultBitPlanes + 1;
+  static std::atomic<const ColorLookup*> cache[kBitVariants][2][2][100];
+  static Mutex create_mutex;
+  std::atomic<const ColorLookup*> &slot
+    = cache[bits - Framebuffer::kDefaultBitPlanes][luminance_correct][inverse]
+           [brightness - 1];
+  const ColorLookup *result = slot.load(std::memory_order_acquire);
+  if (result == NULL) {
+    MutexLock l(&create_mutex);
+    result = slot.load(std::memory_order_relaxed);
+    if (result == NULL) {
+      result = CreateColorLookup(brightness, luminance_correct, inverse,
+                                 bits);
+      slot.store(result, std::memory_order_release);
+    }
+  }
+  return result;
+}
+
+inline const ColorLookup *Framebuffer::color_lookup() {
+  if (color_lookup_ == NULL) {
+    color_lookup_ = GetColorLookup(brightness_, do_luminance_correct_,
+                                   inverse_color_, end_bitplane_);
   }
+  return color_lookup_;
+}
+
+inline void Framebuffer::MapColors(
+  uint8_t r, uint8_t g, uint8_t b,
+  uint16_t *red, uint16_t *green, uint16_t *blue) {
+  const ColorLookup *const lookup = color_lookup();
+  *red   = lookup->value[r];
+  *green = lookup->value[g];
+  *blue  = lookup->value[b];
 }
 
 void Framebuffer::Fill(uint8_t r, uint8_t g, uint8_t b) {
   uint16_t red, green, blue;
   MapColors(r, g, b, &red, &green, &blue);
   const PixelDesignator &fill = (*shared_mapper_)->GetFillColorBits();
+  PrepareWrite(pwm_bits_ < bitplanes_);  // Keep planes we don't fill.
+  MarkDirty(all_rows());
 
-  for (int bits = kBitPlanes - pwm_bits_; bits < kBitPlanes; ++bits) {
+  for (int bits = end_bitplane_ - pwm_bits_; bits < end_bitplane_; ++bits) {
     uint16_t mask = 1 << bits;
     gpio_bits_t plane_bits = 0;
     plane_bits |= ((red & mask) == mask)   ? fill.r_bit : 0;
@@ -711,39 +888,329 @@ int Framebuffer::width() const { return (*shared_mapper_)->width(); }
 int Framebuffer::height() const { return (*shared_mapper_)->height(); }
 
 void Framebuffer::SetPixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
-  const PixelDesignator *designator = (*shared_mapper_)->get(x, y);
-  if (designator == NULL) return;
+  const PixelDesignatorMap *const map = *shared_mapper_;
+  if (x < 0 || y < 0 || x >= map->width() || y >= map->height()) return;
+  const PixelDesignatorMap::Entry entry = map->row(y)[x];
+  if (entry == PixelDesignatorMap::kUnused) return;
+  PixelDesignator d;
+  map->Decode(entry, &d);
+  const PixelDesignator *const designator = &d;
   const long pos = designator->gpio_word;
-  if (pos < 0) return;  // non-used pixel marker.
 
-  uint16_t red, green, blue;
-  MapColors(r, g, b, &red, &green, &blue);
+  PrepareWrite(true);
+  MarkDirty(RowOf(pos));
+
+  // For each bitplane, a 3-bit index into the possible color bits.
+  const ColorLookup *const lookup = color_lookup();
+  const int min_bit_plane = end_bitplane_ - pwm_bits_;
+  uint64_t planes = (lookup->spread[r]
+                     | lookup->spread[g] << 1
+                     | lookup->spread[b] << 2) >> (3 * min_bit_plane);
 
-  gpio_bits_t *bits = bitplane_buffer_ + pos;
-  const int min_bit_plane = kBitPlanes - pwm_bits_;
-  bits += (columns_ * min_bit_plane);
   const gpio_bits_t r_bits = designator->r_bit;
   const gpio_bits_t g_bits = designator->g_bit;
   const gpio_bits_t b_bits = designator->b_bit;
+  const gpio_bits_t color_bits[8] = {
+    0,      r_bits,          g_bits,          r_bits | g_bits,
+    b_bits, r_bits | b_bits, g_bits | b_bits, r_bits | g_bits | b_bits
+  };
   const gpio_bits_t designator_mask = designator->mask;
-  for (uint16_t mask = 1<<min_bit_plane; mask != 1<<kBitPlanes; mask <<=1 ) {
-    gpio_bits_t color_bits = 0;
-    if (red & mask)   color_bits |= r_bits;
-    if (green & mask) color_bits |= g_bits;
-    if (blue & mask)  color_bits |= b_bits;
-    *bits = (*bits & designator_mask) | color_bits;
+
+  gpio_bits_t *bits = bitplane_buffer_ + pos
+    + columns_ * (min_bit_plane - lowest_bitplane_);
+  for (int plane = min_bit_plane; plane < end_bitplane_; ++plane) {
+    *bits = (*bits & designator_mask) | color_bits[planes & 7];
+    planes >>= 3;
     bits += columns_;
   }
 }
 
 void Framebuffer::SetPixels(int x, int y, int width, int height, Color *colors) {
-  for (int iy = 0; iy < height; ++iy) {
-    for (int ix = 0; ix < width; ++ix) {
-      SetPixel(x + ix, y + iy, colors->r, colors->g, colors->b);
-      ++colors;
+  const PixelDesignatorMap *const map = *shared_mapper_;
+  PrepareWrite(true);
+  // Clip to the visible area; what remains of each row is handed to the
+  // bulk encoder.
+  const int skip_start = std::max(0, -x);
+  const int row_end = std::min(width, map->width() - x);
+  if (row_end <= skip_start) return;
+  for (int iy = 0; iy < height; ++iy, colors += width) {
+    if (y + iy < 0 || y + iy >= map->height()) continue;
+    SetPixelRow(x + skip_start, y + iy, row_end - skip_start,
+                colors + skip_start);
+  }
+}
+
+void Framebuffer::SetPixelData(int x, int y, int width, int height,
+                               const uint8_t *data, int row_stride,
+                               int pixel_stride, int red_offset,
+                               int green_offset, int blue_offset) {
+  const PixelDesignatorMap *const map = *shared_mapper_;
+  const int skip_start = std::max(0, -x);
+  const int row_end = std::min(width, map->width() - x);
+  if (row_end <= skip_start) return;
+  const int count = row_end - skip_start;
+  PrepareWrite(true);
+
+  // Packed RGB has the memory layout of Color already.
+  static_assert(sizeof(Color) == 3, "Color expected to be packed RGB");
+  const bool is_color_array = (pixel_stride == 3 && red_offset == 0
+                               && green_offset == 1 && blue_offset == 2);
+  std::vector<Color> colors(is_color_array ? 0 : count);
+  for (int iy = std::max(0, -y); iy < height; ++iy) {
+    if (y + iy >= map->height()) break;
+    const uint8_t *pixel = data + (long)iy * row_stride
+      + (long)skip_start * pixel_stride;
+    if (is_color_array) {
+      SetPixelRow(x + skip_start, y + iy, count,
+                  reinterpret_cast<const Color*>(pixel));
+      continue;
     }
+    for (int i = 0; i < count; ++i, pixel += pixel_stride) {
+      colors[i].r = pixel[red_offset];
+      colors[i].g = pixel[green_offset];
+      colors[i].b = pixel[blue_offset];
+    }
+    SetPixelRow(x + skip_start, y + iy, count, colors.data());
   }
 }
+
+// Fixed point Y'CbCr to RGB conversion factors, 8 bit fraction.
+struct YUVCoefficients {
+  int y_offset;
+  int y, rv, gu, gv, bu;
+};
+static const YUVCoefficients kYUVCoefficients[2][2] = {
+  // BT.601: video range, full range.
+  { { 16, 298, 409, 100, 208, 516 }, { 0, 256, 359, 88, 183, 454 } },
+  // BT.709
+  { { 16, 298, 459,  55, 136, 541 }, { 0, 256, 403, 48, 120, 475 } },
+};
+
+static inline uint8_t ClampColor(int v) {
+  return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+// Range of source pixels [*begin, *end) that destination pixel "i" of
+// "count" covers if "source" pixels are scaled to "count". At least one.
+static inline void SourceBox(int i, int count, int source,
+                             int *begin, int *end) {
+  *begin = (int64_t)i * source / count;
+  *end = std::max(*begin + 1, (int)((int64_t)(i + 1) * source / count));
+}
+
+// Add a row of 8 bit samples, every "step" bytes, to "sums". Simple
+// enough loop for the compiler to vectorize.
+static inline void AccumulateRow(const uint8_t *row, int step,
+                                 int begin, int end, uint32_t *sums) {
+  if (step == 1) {
+    for (int i = begin; i < end; ++i) sums[i] += row[i];
+  } else {
+    for (int i = begin; i < end; ++i) sums[i] += row[i * step];
+  }
+}
+
+static inline int BoxAverage(const uint32_t *sums, int begin, int end,
+                             int rows) {
+  uint32_t total = 0;
+  for (int i = begin; i < end; ++i) total += sums[i];
+  const uint32_t n = (end - begin) * rows;
+  return (total + n / 2) / n;
+}
+
+void Framebuffer::SetYUVImage(int x, int y, int width, int height,
+                              const YUVImage &image) {
+  if (width <= 0 || height <= 0 || image.width <= 0 || image.height <= 0)
+    return;
+  const PixelDesignatorMap *const map = *shared_mapper_;
+  // Only the visible part of the destination is computed.
+  const int dx_start = std::max(0, -x);
+  const int dx_end = std::min(width, map->width() - x);
+  const int dy_start = std::max(0, -y);
+  const int dy_end = std::min(height, map->height() - y);
+  if (dx_end <= dx_start || dy_end <= dy_start) return;
+  PrepareWrite(true);
+
+  const YUVCoefficients &k = kYUVCoefficients[image.bt709][image.full_range];
+  const bool nv12 = (image.format == YUVImage::NV12);
+  const int chroma_width = (image.width + 1) / 2;
+  const int chroma_height = (image.height + 1) / 2;
+  const int count = dx_end - dx_start;
+
+  // Source box of each destination column, for luma and chroma.
+  std::vector<int> luma_x(count), luma_x_end(count);
+  std::vector<int> chroma_x(count), chroma_x_end(count);
+  for (int i = 0; i < count; ++i) {
+    SourceBox(dx_start + i, width, image.width, &luma_x[i], &luma_x_end[i]);
+    chroma_x[i] = luma_x[i] / 2;
+    chroma_x_end[i] = std::min(chroma_width,
+                               std::max(chroma_x[i] + 1,
+                                        (luma_x_end[i] + 1) / 2));
+  }
+  const int luma_begin = luma_x[0], luma_end = luma_x_end[count - 1];
+  const int chroma_begin = chroma_x[0], chroma_end = chroma_x_end[count - 1];
+
+  // Column sums of the rows covered by one destination row.
+  std::vector<uint32_t> y_sums(image.width);
+  std::vector<uint32_t> u_sums(chroma_width), v_sums(chroma_width);
+  std::vector<Color> colors(count);
+  for (int dy = dy_start; dy < dy_end; ++dy) {
+    int row_begin, row_end;
+    SourceBox(dy, height, image.height, &row_begin, &row_end);
+    const int chroma_row_begin = row_begin / 2;
+    const int chroma_row_end = std::min(chroma_height,
+                                        std::max(chroma_row_begin + 1,
+                                                 (row_end + 1) / 2));
+
+    std::fill(y_sums.begin() + luma_begin, y_sums.begin() + luma_end, 0);
+    std::fill(u_sums.begin() + chroma_begin, u_sums.begin() + chroma_end, 0);
+    std::fill(v_sums.begin() + chroma_begin, v_sums.begin() + chroma_end, 0);
+    for (int r = row_begin; r < row_end; ++r) {
+      AccumulateRow(image.planes[0] + r * image.strides[0], 1,
+                    luma_begin, luma_end, y_sums.data());
+    }
+    for (int r = chroma_row_begin; r < chroma_row_end; ++r) {
+      if (nv12) {
+        const uint8_t *uv = image.planes[1] + r * image.strides[1];
+        AccumulateRow(uv, 2, chroma_begin, chroma_end, u_sums.data());
+        AccumulateRow(uv + 1, 2, chroma_begin, chroma_end, v_sums.data());
+      } else {
+        AccumulateRow(image.planes[1] + r * image.strides[1], 1,
+                      chroma_begin, chroma_end, u_sums.data());
+        AccumulateRow(image.planes[2] + r * image.strides[2], 1,
+                      chroma_begin, chroma_end, v_sums.data());
+      }
+    }
+
+    const int luma_rows = row_end - row_begin;
+    const int chroma_rows = chroma_row_end - chroma_row_begin;
+    for (int i = 0; i < count; ++i) {
+      const int c = k.y * (BoxAverage(y_sums.data(), luma_x[i], luma_x_end[i],
+                                      luma_rows) - k.y_offset) + 128;
+      const int d = BoxAverage(u_sums.data(), chroma_x[i], chroma_x_end[i],
+                               chroma_rows) - 128;
+      const int e = BoxAverage(v_sums.data(), chroma_x[i], chroma_x_end[i],
+                               chroma_rows) - 128;
+      colors[i].r = ClampColor((c + k.rv * e) >> 8);
+      colors[i].g = ClampColor((c - k.gu * d - k.gv * e) >> 8);
+      colors[i].b = ClampColor((c + k.bu * d) >> 8);
+    }
+    SetPixelRow(x + dx_start, y + dy, count, colors.data());
+  }
+}
+
+// The same operation as the scalar loop in EncodeRun(), but a vector at a
+// time: for each pixel, test the bit of the current plane in each color and
+// turn it into the corresponding gpio bits. This transposes the pixel-major
+// color values into plane-major gpio words.
+// Returns number of pixels handled, the remainder is left to the caller.
+static inline int EncodePlaneSIMD(gpio_bits_t *out, int count, uint16_t bit,
+                                  const uint16_t *red, const uint16_t *green,
+                                  const uint16_t *blue,
+                                  const PixelDesignator &d) {
+  int i = 0;
+#if defined(FRAMEBUFFER_SIMD_NEON)
+  const uint32x4_t plane_bit = vdupq_n_u32(bit);
+  const uint32x4_t r_bits = vdupq_n_u32(d.r_bit);
+  const uint32x4_t g_bits = vdupq_n_u32(d.g_bit);
+  const uint32x4_t b_bits = vdupq_n_u32(d.b_bit);
+  const uint32x4_t keep = vdupq_n_u32(d.mask);
+  for (/**/; i + 4 <= count; i += 4) {
+    const uint32x4_t r = vmovl_u16(vld1_u16(red + i));
+    const uint32x4_t g = vmovl_u16(vld1_u16(green + i));
+    const uint32x4_t b = vmovl_u16(vld1_u16(blue + i));
+    uint32x4_t color = vandq_u32(vtstq_u32(r, plane_bit), r_bits);
+    color = vorrq_u32(color, vandq_u32(vtstq_u32(g, plane_bit), g_bits));
+    color = vorrq_u32(color, vandq_u32(vtstq_u32(b, plane_bit), b_bits));
+    const uint32x4_t old = vld1q_u32(out + i);
+    vst1q_u32(out + i, vorrq_u32(vandq_u32(old, keep), color));
+  }
+#elif defined(FRAMEBUFFER_SIMD_SSE2)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i plane_bit = _mm_set1_epi32(bit);
+  const __m128i r_bits = _mm_set1_epi32(d.r_bit);
+  const __m128i g_bits = _mm_set1_epi32(d.g_bit);
+  const __m128i b_bits = _mm_set1_epi32(d.b_bit);
+  const __m128i keep = _mm_set1_epi32(d.mask);
+  for (/**/; i + 4 <= count; i += 4) {
+    const __m128i r = _mm_unpacklo_epi16(
+      _mm_loadl_epi64((const __m128i*)(red + i)), zero);
+    const __m128i g = _mm_unpacklo_epi16(
+      _mm_loadl_epi64((const __m128i*)(green + i)), zero);
+    const __m128i b = _mm_unpacklo_epi16(
+      _mm_loadl_epi64((const __m128i*)(blue + i)), zero);
+    __m128i color = _mm_and_si128(
+      _mm_cmpeq_epi32(_mm_and_si128(r, plane_bit), plane_bit), r_bits);
+    color = _mm_or_si128(color, _mm_and_si128(
+      _mm_cmpeq_epi32(_mm_and_si128(g, plane_bit), plane_bit), g_bits));
+    color = _mm_or_si128(color, _mm_and_si128(
+      _mm_cmpeq_epi32(_mm_and_si128(b, plane_bit), plane_bit), b_bits));
+    const __m128i old = _mm_loadu_si128((const __m128i*)(out + i));
+    _mm_storeu_si128((__m128i*)(out + i),
+                     _mm_or_si128(_mm_and_si128(old, keep), color));
+  }
+#endif
+  return i;
+}
+
+void Framebuffer::EncodeRun(const PixelDesignator &d, int count,
+                            const uint16_t *red, const uint16_t *green,
+                            const uint16_t *blue) {
+  MarkDirty(RowOf(d.gpio_word));  // A run never spans double rows.
+  const int min_bit_plane = end_bitplane_ - pwm_bits_;
+  gpio_bits_t *plane = bitplane_buffer_ + d.gpio_word
+    + columns_ * (min_bit_plane - lowest_bitplane_);
+  for (int b = min_bit_plane; b < end_bitplane_; ++b, plane += columns_) {
+    const uint16_t mask = 1 << b;
+    // Scalar reference path; does the same as SetPixel(). Also handles
+    // everything the vector implementation left over.
+    for (int i = EncodePlaneSIMD(plane, count, mask, red, green, blue, d);
+         i < count; ++i) {
+      gpio_bits_t color_bits = 0;
+      if (red[i] & mask)   color_bits |= d.r_bit;
+      if (green[i] & mask) color_bits |= d.g_bit;
+      if (blue[i] & mask)  color_bits |= d.b_bit;
+      plane[i] = (plane[i] & d.mask) | color_bits;
+    }
+  }
+}
+
+void Framebuffer::SetPixelRow(int x, int y, int count, const Color *colors) {
+  // Colors of one run are mapped into these before encoding.
+  static constexpr int kMaxRun = 64;
+  uint16_t red[kMaxRun], green[kMaxRun], blue[kMaxRun];
+
+  const PixelDesignatorMap *const map = *shared_mapper_;
+  const PixelDesignatorMap::Entry *entry = map->row(y) + x;
+  const bool linear = map->is_row_linear(y);
+  PixelDesignator first;
+  int i = 0;
+  while (i < count) {
+    if (entry[i] == PixelDesignatorMap::kUnused) {
+      ++i;
+      continue;
+    }
+    // In linear rows, any stretch of pixels is a run.
+    int run = 0;
+    if (linear) {
+      run = std::min(kMaxRun, count - i);
+      for (int j = 0; j < run; ++j) {
+        const Color &c = colors[i + j];
+        MapColors(c.r, c.g, c.b, &red[j], &green[j], &blue[j]);
+      }
+    } else {
+      do {
+        const Color &c = colors[i + run];
+        MapColors(c.r, c.g, c.b, &red[run], &green[run], &blue[run]);
+        ++run;
+      } while (run < kMaxRun && i + run < count
+               && entry[i + run] == PixelDesignatorMap::Advance(entry[i], run));
+    }
+    map->Decode(entry[i], &first);
+    EncodeRun(first, run, red, green, blue);
+    i += run;
+  }
+}
+
 // Strange LED-mappings such as RBG or so are handled here.
 gpio_bits_t Framebuffer::GetGpioFromLedSequence(char col,
                                                 const char *led_sequence,
@@ -768,7 +1235,7 @@ gpio_bits_t Framebuffer::GetGpioFromLedSequence(char col,
 void Framebuffer::InitDefaultDesignator(int x, int y, const char *seq,
                                         PixelDesignator *d) {
   const struct HardwareMapping &h = *hardware_mapping_;
-  gpio_bits_t *bits = ValueAt(y % double_rows_, x, 0);
+  gpio_bits_t *bits = ValueAt(y % double_rows_, x, lowest_bitplane_);
   d->gpio_word = bits - bitplane_buffer_;
   d->r_bit = d->g_bit = d->b_bit = 0;
   if (y < rows_) {
@@ -849,79 +1316,192 @@ void Framebuffer::Serialize(const char **data, size_t *len) const {
 
 bool Framebuffer::Deserialize(const char *data, size_t len) {
   if (len != buffer_size_) return false;
+  PrepareWrite(false);
+  MarkDirty(all_rows());
   memcpy(bitplane_buffer_, data, len);
   return true;
 }
 
+bool Framebuffer::DeserializeUpperBitplanes(const char *data, size_t len,
+                                            int bitplanes) {
+  if (bitplanes < bitplanes_) return false;
+  const size_t data_row_stride = columns_ * bitplanes;
+  if (len != double_rows_ * data_row_stride * sizeof(gpio_bits_t))
+    return false;
+  PrepareWrite(false);
+  MarkDirty(all_rows());
+  // Per double row, the bitplanes are stored lowest first.
+  const size_t skip = (bitplanes - bitplanes_) * columns_;
+  const gpio_bits_t *src = reinterpret_cast<const gpio_bits_t*>(data);
+  for (int row = 0; row < double_rows_; ++row) {
+    memcpy(bitplane_buffer_ + row * row_stride_,
+           src + row * data_row_stride + skip,
+           row_stride_ * sizeof(gpio_bits_t));
+  }
+  return true;
+}
+
+bool Framebuffer::SetView(const char *data, size_t len) {
+  if (len != buffer_size_) return false;
+  if (reinterpret_cast<uintptr_t>(data) % alignof(gpio_bits_t) != 0)
+    return false;
+  MarkDirty(all_rows());
+  bitplane_buffer_ = reinterpret_cast<gpio_bits_t*>(const_cast<char*>(data));
+  return true;
+}
+
+void Framebuffer::LeaveView(bool keep_content) {
+  MarkDirty(all_rows());
+  if (keep_content) memcpy(own_buffer_, bitplane_buffer_, buffer_size_);
+  bitplane_buffer_ = own_buffer_;
+}
+
 void Framebuffer::CopyFrom(const Framebuffer *other) {
   if (other == this) return;
+  PrepareWrite(false);
+  MarkDirty(all_rows());
   memcpy(bitplane_buffer_, other->bitplane_buffer_, buffer_size_);
 }
 
-void Framebuffer::DumpToMatrix(GPIO *io, int pwm_low_bit) {
-  const struct HardwareMapping &h = *hardware_mapping_;
-  gpio_bits_t color_clk_mask = 0;  // Mask of bits while clocking in.
-  color_clk_mask |= h.p0_r1 | h.p0_g1 | h.p0_b1 | h.p0_r2 | h.p0_g2 | h.p0_b2;
-  if (parallel_ >= 2) {
-    color_clk_mask |= h.p1_r1 | h.p1_g1 | h.p1_b1 | h.p1_r2 | h.p1_g2 | h.p1_b2;
-  }
-  if (parallel_ >= 3) {
-    color_clk_mask |= h.p2_r1 | h.p2_g1 | h.p2_b1 | h.p2_r2 | h.p2_g2 | h.p2_b2;
-  }
-  if (parallel_ >= 4) {
-    color_clk_mask |= h.p3_r1 | h.p3_g1 | h.p3_b1 | h.p3_r2 | h.p3_g2 | h.p3_b2;
-  }
-  if (parallel_ >= 5) {
-    color_clk_mask |= h.p4_r1 | h.p4_g1 | h.p4_b1 | h.p4_r2 | h.p4_g2 | h.p4_b2;
+void Framebuffer::CopyRowsFrom(const Framebuffer *other, RowMask rows) {
+  if (other == this) return;
+  assert(other->buffer_size_ == buffer_size_);
+  PrepareWrite(true);
+  rows &= all_rows();
+  MarkDirty(rows);
+  // Adjacent rows are copied with one memcpy().
+  int row = 0;
+  while (row < double_rows_ && (rows >> row) != 0) {
+    while (((rows >> row) & 1) == 0) ++row;
+    const int first = row;
+    while (row < double_rows_ && ((rows >> row) & 1)) ++row;
+    memcpy(bitplane_buffer_ + first * row_stride_,
+           other->bitplane_buffer_ + first * row_stride_,
+           (row - first) * row_stride_ * sizeof(gpio_bits_t));
   }
-  if (parallel_ >= 6) {
-    color_clk_mask |= h.p5_r1 | h.p5_g1 | h.p5_b1 | h.p5_r2 | h.p5_g2 | h.p5_b2;
+}
+
+void Framebuffer::CopyRemapped(const Framebuffer *other,
+                               const PixelDesignatorMap &from_map,
+                               const PixelDesignatorMap &to_map) {
+  assert(other != this && other->buffer_size_ == buffer_size_);
+  Clear();
+  const int width = std::min(from_map.width(), to_map.width());
+  const int height = std::min(from_map.height(), to_map.height());
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      PixelDesignator from, to;
+      if (!from_map.Get(x, y, &from) || !to_map.Get(x, y, &to))
+        continue;
+      const gpio_bits_t *src = other->bitplane_buffer_ + from.gpio_word;
+      gpio_bits_t *dst = bitplane_buffer_ + to.gpio_word;
+      for (int plane = 0; plane < bitplanes_; ++plane) {
+        const gpio_bits_t bits = *src;
+        *dst = (*dst & to.mask)
+          | ((bits & from.r_bit) ? to.r_bit : 0)
+          | ((bits & from.g_bit) ? to.g_bit : 0)
+          | ((bits & from.b_bit) ? to.b_bit : 0);
+        src += columns_;
+        dst += columns_;
+      }
+    }
   }
+}
 
-  color_clk_mask |= h.clock;
+void Framebuffer::PlanRefresh() {
+  const size_t plane_bytes = columns_ * sizeof(gpio_bits_t);
+  const int min_plane = end_bitplane_ - pwm_bits_;
+  // Dithering starts up to two bitplanes higher (see UpdateThread).
+  const int max_first_plane = std::min(std::max(min_plane, 2),
+                                       end_bitplane_ - 1);
+  for (int row_loop = 0; row_loop < double_rows_; ++row_loop) {
+    const int d_row = row_sequence_[row_loop];
+    uint16_t same = 0;
+    for (int b = min_plane + 1; b < end_bitplane_; ++b) {
+      if (memcmp(ValueAt(d_row, 0, b), ValueAt(d_row, 0, b - 1),
+                 plane_bytes) == 0) {
+        same |= 1 << b;
+      }
+    }
+    same_as_previous_[d_row].store(same, std::memory_order_relaxed);
+
+    same = 0;
+    if (row_loop > 0) {
+      const gpio_bits_t *const last_shown =
+        ValueAt(row_sequence_[row_loop - 1], 0, end_bitplane_ - 1);
+      for (int b = min_plane; b <= max_first_plane; ++b) {
+        if (memcmp(ValueAt(d_row, 0, b), last_shown, plane_bytes) == 0)
+          same |= 1 << b;
+      }
+    }
+    same_as_row_before_[d_row].store(same, std::memory_order_relaxed);
+  }
+  refresh_planned_.store(true, std::memory_order_release);
+}
 
-  // Depending if we do dithering, we might not always show the lowest bits.
-  const int start_bit = std::max(pwm_low_bit, kBitPlanes - pwm_bits_);
+void Framebuffer::DumpToMatrix(GPIO *io, int pwm_low_bit,
+                               uint64_t *bitplane_nanos) {
+  (this->*refresh_kernel_)(io, pwm_low_bit, bitplane_nanos);
+}
 
-  const uint8_t half_double = double_rows_/2;
-  for (uint8_t row_loop = 0; row_loop < double_rows_; ++row_loop) {
-    uint8_t d_row;
-    switch (scan_mode_) {
-    case 0:  // progressive
-    default:
-      d_row = row_loop;
-      break;
+template <class RowSetter>
+void Framebuffer::Refresh(GPIO *io, int pwm_low_bit,
+                          uint64_t *bitplane_nanos) {
+  RowSetter *const row_setter = static_cast<RowSetter*>(row_setter_);
+  const gpio_bits_t clock = hardware_mapping_->clock;
+  const gpio_bits_t strobe = hardware_mapping_->strobe;
 
-    case 1:  // interlaced
-      d_row = ((row_loop < half_double)
-               ? (row_loop << 1)
-               : ((row_loop - half_double) << 1) + 1);
+  // Depending if we do dithering, we might not always show the lowest bits.
+  const int start_bit = std::max(pwm_low_bit, end_bitplane_ - pwm_bits_);
+  const uint16_t first_plane = 1 << start_bit;
+
+  uint64_t bitplane_start = bitplane_nanos ? MonotonicNanos() : 0;
+
+  for (int row_loop = 0; row_loop < double_rows_; ++row_loop) {
+    const int d_row = row_sequence_[row_loop];
+
+    // Bitplanes the shift registers already hold. The first one of the
+    // frame follows whatever was shown before, so is always clocked in.
+    // Checked per row, so that drawing on the frame while it is shown
+    // stops the skipping right away.
+    uint16_t unchanged = 0;
+    if (refresh_planned_.load(std::memory_order_acquire)) {
+      unchanged = same_as_previous_[d_row].load(std::memory_order_relaxed)
+        & ~first_plane;
+      if (row_loop > 0) {
+        unchanged |= same_as_row_before_[d_row].load(std::memory_order_relaxed)
+          & first_plane;
+      }
     }
 
     // Rows can't be switched very quickly without ghosting, so we do the
     // full PWM of one row before switching rows.
-    for (int b = start_bit; b < kBitPlanes; ++b) {
-      gpio_bits_t *row_data = ValueAt(d_row, 0, b);
+    for (int b = start_bit; b < end_bitplane_; ++b) {
       // While the output enable is still on, we can already clock in the next
       // data.
-      for (int col = 0; col < columns_; ++col) {
-        const gpio_bits_t &out = *row_data++;
-        io->WriteMaskedBits(out, color_clk_mask);  // col + reset clock
-        io->SetBits(h.clock);               // Rising edge: clock color in.
+      if (!(unchanged & (1 << b))) {
+        io->ClockOutWords(ValueAt(d_row, 0, b), columns_, color_clk_mask_,
+                          clock);
+        io->ClearBits(color_clk_mask_);    // clock back to normal.
       }
-      io->ClearBits(color_clk_mask);    // clock back to normal.
 
       // OE of the previous row-data must be finished before strobe.
       sOutputEnablePulser->WaitPulseFinished();
 
       // Setting address and strobing needs to happen in dark time.
-      row_setter_->SetRowAddress(io, d_row);
+      row_setter->SetRowAddress(io, d_row);
 
-      io->SetBits(h.strobe);   // Strobe in the previously clocked in row.
-      io->ClearBits(h.strobe);
+      io->SetBits(strobe);   // Strobe in the previously clocked in row.
+      io->ClearBits(strobe);
 
       // Now switch on for the sleep time necessary for that bit-plane.
       sOutputEnablePulser->SendPulse(b);
+
+      if (bitplane_nanos) {
+        const uint64_t now = MonotonicNanos();
+        bitplane_nanos[b] += now - bitplane_start;
+        bitplane_start = now;
+      }
     }
   }
 }
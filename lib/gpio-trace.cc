@@ -0,0 +1,206 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "gpio-trace.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+#ifdef ONLY_SINGLE_SUB_PANEL
+#  define SUB_PANELS_ 1
+#else
+#  define SUB_PANELS_ 2
+#endif
+
+namespace rgb_matrix {
+void GPIOTrace::Clear() {
+  events_.clear();
+  write_count_ = 0;
+  pulse_count_ = 0;
+}
+
+PanelDecoder::PanelDecoder(const HardwareMapping &h,
+                           int rows, int columns, int parallel,
+                           int row_address_type)
+  : h_(h), rows_(rows), columns_(columns), parallel_(parallel),
+    double_rows_(rows / SUB_PANELS_), row_address_type_(row_address_type),
+    state_(0), shift_register_(columns, 0), shift_pos_(0),
+    latched_(columns, 0),
+    address_clocks_(0), active_address_clock_(-1), shift_register_row_(0),
+    sm5266_bits_(0),
+    on_time_(columns * rows * parallel),
+    row_enabled_nanos_(rows * parallel) {
+  assert(parallel >= 1 && parallel <= 6);
+  const gpio_bits_t bits[6][2][3] = {
+    { { h.p0_r1, h.p0_g1, h.p0_b1 }, { h.p0_r2, h.p0_g2, h.p0_b2 } },
+    { { h.p1_r1, h.p1_g1, h.p1_b1 }, { h.p1_r2, h.p1_g2, h.p1_b2 } },
+    { { h.p2_r1, h.p2_g1, h.p2_b1 }, { h.p2_r2, h.p2_g2, h.p2_b2 } },
+    { { h.p3_r1, h.p3_g1, h.p3_b1 }, { h.p3_r2, h.p3_g2, h.p3_b2 } },
+    { { h.p4_r1, h.p4_g1, h.p4_b1 }, { h.p4_r2, h.p4_g2, h.p4_b2 } },
+    { { h.p5_r1, h.p5_g1, h.p5_b1 }, { h.p5_r2, h.p5_g2, h.p5_b2 } },
+  };
+  memcpy(color_bits_, bits, sizeof(color_bits_));
+  ResetImage();
+}
+
+void PanelDecoder::ResetImage() {
+  const OnTime off = { 0, 0, 0 };
+  std::fill(on_time_.begin(), on_time_.end(), off);
+  std::fill(row_enabled_nanos_.begin(), row_enabled_nanos_.end(), 0);
+}
+
+bool PanelDecoder::Decode(const GPIOTrace &trace) {
+  if (row_address_type_ < 0 || row_address_type_ > 5) {
+    fprintf(stderr, "PanelDecoder: row address type %d not supported\n",
+            row_address_type_);
+    return false;
+  }
+  const bool has_address_shift_register = (row_address_type_ != 0 &&
+                                           row_address_type_ != 2);
+  const std::vector<GPIOTrace::Event> &events = trace.events();
+  for (size_t i = 0; i < events.size(); ++i) {
+    const GPIOTrace::Event &e = events[i];
+    const gpio_bits_t before = state_;
+    switch (e.op) {
+    case GPIOTrace::SET_BITS:
+      state_ |= e.bits;
+      break;
+    case GPIOTrace::CLEAR_BITS:
+      state_ &= ~e.bits;
+      break;
+    case GPIOTrace::PULSE:
+      ShowLatched(CurrentRow(state_), e.pulse_nanos);
+      break;
+    }
+    const gpio_bits_t rising = ~before & state_;
+    if (rising & h_.clock) ClockRisingEdge(state_);
+    if (rising & h_.strobe) Strobe();
+    if (has_address_shift_register && (rising & h_.a))
+      AddressClockRisingEdge(state_);
+  }
+  return true;
+}
+
+void PanelDecoder::ClockRisingEdge(gpio_bits_t state) {
+  shift_register_[shift_pos_] = state;
+  shift_pos_ = (shift_pos_ + 1) % columns_;
+}
+
+void PanelDecoder::Strobe() {
+  // The first value clocked in ends up furthest down the chain, which is
+  // column 0 in our coordinate system.
+  for (int c = 0; c < columns_; ++c) {
+    latched_[c] = shift_register_[(shift_pos_ + c) % columns_];
+  }
+  address_clocks_ = 0;
+  active_address_clock_ = -1;
+}
+
+void PanelDecoder::AddressClockRisingEdge(gpio_bits_t state) {
+  switch (row_address_type_) {
+  case 4:  // Shift in B while C enables the input; a high bit marks the row.
+    if (state & h_.c) sm5266_bits_ = (sm5266_bits_ << 1) | !!(state & h_.b);
+    return;
+  case 5:  // A high bit on C while B enables the input selects row 0,
+           // every further clock the next row.
+    if (state & h_.b) {
+      shift_register_row_ = (state & h_.c)
+        ? 0 : (shift_register_row_ + 1) % double_rows_;
+    }
+    return;
+  }
+  // Type 1 clocks in a low bit on B for the active row; type 3 a high
+  // bit on C. Both send a full sequence of double_rows bits.
+  const bool active = (row_address_type_ == 1)
+    ? (state & h_.b) == 0
+    : (state & h_.c) != 0;
+  if (active && address_clocks_ < double_rows_)
+    active_address_clock_ = address_clocks_;
+  ++address_clocks_;
+  if (address_clocks_ == double_rows_ && active_address_clock_ >= 0) {
+    shift_register_row_ = double_rows_ - 1 - active_address_clock_;
+  }
+}
+
+int PanelDecoder::CurrentRow(gpio_bits_t state) const {
+  switch (row_address_type_) {
+  case 0: {
+    int row = 0;
+    if (state & h_.a) row |= 0x01;
+    if (state & h_.b) row |= 0x02;
+    if (state & h_.c) row |= 0x04;
+    if (state & h_.d) row |= 0x08;
+    if (state & h_.e) row |= 0x10;
+    return row % double_rows_;
+  }
+  case 2:  // The one line that is low selects the row.
+    if ((state & h_.a) == 0) return 0;
+    if ((state & h_.b) == 0) return 1;
+    if ((state & h_.c) == 0) return 2;
+    return 3;
+  case 4: {  // DE select a group of 8 rows, the shifter the row in it.
+    int row = 0;
+    for (int r = 0; r < 8; ++r) {
+      if (sm5266_bits_ & (1 << r)) row = r;
+    }
+    if (state & h_.d) row |= 0x08;
+    if (state & h_.e) row |= 0x10;
+    return row % double_rows_;
+  }
+  default:
+    return shift_register_row_;
+  }
+}
+
+void PanelDecoder::ShowLatched(int row, uint32_t nanos) {
+  for (int p = 0; p < parallel_; ++p) {
+    for (int s = 0; s < SUB_PANELS_; ++s) {
+      const gpio_bits_t *bits = color_bits_[p][s];
+      const int y = p * rows_ + s * double_rows_ + row;
+      row_enabled_nanos_[y] += nanos;
+      OnTime *out = &on_time_[y * columns_];
+      for (int c = 0; c < columns_; ++c, ++out) {
+        const gpio_bits_t word = latched_[c];
+        if (word & bits[0]) out->r += nanos;
+        if (word & bits[1]) out->g += nanos;
+        if (word & bits[2]) out->b += nanos;
+      }
+    }
+  }
+}
+
+void PanelDecoder::GetOnTime(int x, int y, uint64_t *red, uint64_t *green,
+                             uint64_t *blue) const {
+  const OnTime &t = on_time_[y * columns_ + x];
+  *red = t.r;
+  *green = t.g;
+  *blue = t.b;
+}
+
+void PanelDecoder::GetImage(uint8_t *rgb_out) const {
+  for (int y = 0; y < height(); ++y) {
+    const uint64_t total = row_enabled_nanos_[y];
+    for (int x = 0; x < width(); ++x) {
+      const OnTime &t = on_time_[y * columns_ + x];
+      *rgb_out++ = total ? (255 * t.r + total / 2) / total : 0;
+      *rgb_out++ = total ? (255 * t.g + total / 2) / total : 0;
+      *rgb_out++ = total ? (255 * t.b + total / 2) / total : 0;
+    }
+  }
+}
+}  // namespace rgb_matrix
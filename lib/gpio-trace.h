@@ -0,0 +1,170 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Software GPIO support: a GPIO that is initialized with InitSoftware()
+// records everything it is asked to output in a GPIOTrace instead of
+// writing to the hardware. The PanelDecoder replays such a trace the way a
+// chain of HUB75 panels would see it and rebuilds the image shown.
+//
+// This allows to exercise, benchmark and regression-test the refresh code
+// on any Linux machine, no Raspberry Pi needed.
+
+#ifndef RPI_GPIO_TRACE_H
+#define RPI_GPIO_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "gpio-bits.h"
+#include "hardware-mapping.h"
+
+namespace rgb_matrix {
+class GPIOTrace {
+public:
+  enum Operation {
+    SET_BITS,     // Bits set high.
+    CLEAR_BITS,   // Bits set low.
+    PULSE,        // Output enable pulse sent by the PinPulser.
+  };
+
+  struct Event {
+    Operation op;
+    gpio_bits_t bits;         // Affected bits; output enable pin for PULSE
+    int16_t time_spec;        // PULSE only: index of requested timing
+    uint32_t pulse_nanos;     // PULSE only: requested length.
+  };
+
+  GPIOTrace() : state_(0), write_count_(0), pulse_count_(0),
+                keep_events_(true) {}
+
+  // Recording. Called by the software GPIO and its PinPulser.
+  void SetBits(gpio_bits_t bits) {
+    state_ |= bits;
+    ++write_count_;
+    if (keep_events_) Record(SET_BITS, bits, -1, 0);
+  }
+  void ClearBits(gpio_bits_t bits) {
+    state_ &= ~bits;
+    ++write_count_;
+    if (keep_events_) Record(CLEAR_BITS, bits, -1, 0);
+  }
+  void Pulse(gpio_bits_t bits, int time_spec, uint32_t nanos) {
+    ++pulse_count_;
+    if (keep_events_) Record(PULSE, bits, time_spec, nanos);
+  }
+
+  // If set to false, only counts writes but doesn't keep the events. Useful
+  // for long running benchmarks that don't want to grow memory.
+  void set_keep_events(bool keep) { keep_events_ = keep; }
+
+  // Forget all recorded events and reset counters. The current output
+  // state stays, as it would with real hardware.
+  void Clear();
+
+  // Current level of all output bits.
+  gpio_bits_t state() const { return state_; }
+
+  const std::vector<Event> &events() const { return events_; }
+  uint64_t write_count() const { return write_count_; }
+  uint64_t pulse_count() const { return pulse_count_; }
+
+private:
+  void Record(Operation op, gpio_bits_t bits, int time_spec, uint32_t nanos) {
+    const Event e = { op, bits, (int16_t)time_spec, nanos };
+    events_.push_back(e);
+  }
+
+  gpio_bits_t state_;
+  uint64_t write_count_;
+  uint64_t pulse_count_;
+  bool keep_events_;
+  std::vector<Event> events_;
+};
+
+// Emulates the shift registers, latches and row addressing of
+// "parallel" chains of panels with "rows" rows and "columns" total columns
+// (panel columns times chain length) and replays a GPIOTrace.
+//
+// For each pixel, the time its red, green and blue LEDs are switched on
+// is accumulated. Coordinates are the ones of the underlying hardware
+// layout, i.e. before any pixel mapper or multiplexer is applied; this is
+// the same layout a Framebuffer uses without mappers.
+class PanelDecoder {
+public:
+  // Supports all "row_address_type"s of the library: 0 (direct), 1 (AB
+  // shift register), 2 (direct ABCD line), 3 (ABC shift register),
+  // 4 (SM5266 ABC shifter + DE direct) and 5 (B707 shift register).
+  PanelDecoder(const HardwareMapping &h, int rows, int columns, int parallel,
+               int row_address_type);
+
+  // Replay all events of the trace, accumulating on top of what has been
+  // decoded before. Returns false if the row address type is not supported.
+  bool Decode(const GPIOTrace &trace);
+
+  // Forget the accumulated on-times (but keep the state of shift
+  // registers and latches).
+  void ResetImage();
+
+  int width() const { return columns_; }
+  int height() const { return rows_ * parallel_; }
+
+  // Accumulated on-time in nanoseconds of the given pixel.
+  void GetOnTime(int x, int y, uint64_t *red, uint64_t *green,
+                 uint64_t *blue) const;
+
+  // The image as linear intensity: on-time of each LED relative to the
+  // total time output was enabled on that row, scaled to 0..255.
+  // "rgb_out" needs to have space for 3 * width() * height() bytes.
+  void GetImage(uint8_t *rgb_out) const;
+
+private:
+  struct OnTime { uint64_t r, g, b; };
+
+  void ClockRisingEdge(gpio_bits_t state);
+  void Strobe();
+  void AddressClockRisingEdge(gpio_bits_t state);
+  int CurrentRow(gpio_bits_t state) const;
+  void ShowLatched(int row, uint32_t nanos);
+
+  const HardwareMapping &h_;
+  const int rows_;
+  const int columns_;
+  const int parallel_;
+  const int double_rows_;
+  const int row_address_type_;
+
+  gpio_bits_t state_;
+  // The full GPIO word at each of the last "columns" clock edges. Only the
+  // color bits are of interest.
+  std::vector<gpio_bits_t> shift_register_;
+  size_t shift_pos_;             // Next position in the ring.
+  std::vector<gpio_bits_t> latched_;
+  gpio_bits_t color_bits_[6][2][3];  // [chain][sub-panel][r, g, b]
+
+  // Shift register row address types: the row is selected by clocking a
+  // single active bit into the address shift register.
+  int address_clocks_;       // Address clock edges since last strobe.
+  int active_address_clock_; // Edge at which the active bit was clocked in.
+  int shift_register_row_;
+  uint8_t sm5266_bits_;      // Type 4: content of the 8 bit row shifter.
+
+  std::vector<OnTime> on_time_;
+  std::vector<uint64_t> row_enabled_nanos_;
+};
+}  // namespace rgb_matrix
+
+#endif  // RPI_GPIO_TRACE_H
@@ -17,6 +17,7 @@
 #include <inttypes.h>
 
 #include "gpio.h"
+#include "gpio-trace.h"
 
 #include <assert.h>
 #include <fcntl.h>
@@ -34,7 +35,10 @@
  * we substract this value whenever we do nanosleep(); the remaining time
  * we then busy wait to get a good accurate result.
  *
- * You can measure the overhead using DEBUG_SLEEP_JITTER below.
+ * You can measure the overhead with the pulse_overshoot histogram of the
+ * refresh metrics (see include/refresh-metrics.h) when using the hardware
+ * pin-pulser: it shows how much longer than requested we slept. (That is
+ * shifted by this value; to see the full OS overhead, set it to 0 first.)
  *
  * Note: A higher value here will result in more CPU use because of more busy
  * waiting inching towards the real value (for all the cases that nanosleep()
@@ -52,15 +56,6 @@
  */
 #define MINIMUM_NANOSLEEP_TIME_US 5
 
-/* In order to determine useful values for above, set this to 1 and use the
- * hardware pin-pulser.
- * It will output a histogram atexit() of how much how often we were over
- * the requested time.
- * (The full histogram will be shifted by the EMPIRICAL_NANOSLEEP_OVERHEAD_US
- *  value above. To get a full histogram of OS overhead, set it to 0 first).
- */
-#define DEBUG_SLEEP_JITTER 0
-
 // Raspberry 1 and 2 have different base addresses for the periphery
 #define BCM2708_PERI_BASE        0x20000000
 #define BCM2709_PERI_BASE        0x3F000000
@@ -144,7 +139,7 @@ static bool LinuxHasModuleLoaded(const char *name) {
 #define GPIO_BIT(x) (1ull << x)
 
 GPIO::GPIO() : output_bits_(0), input_bits_(0), reserved_bits_(0),
-               slowdown_(1)
+               slowdown_(1), trace_(NULL)
 #ifdef ENABLE_WIDE_GPIO_COMPUTE_MODULE
              , uses_64_bit_(false)
 #endif
@@ -153,6 +148,11 @@ GPIO::GPIO() : output_bits_(0), input_bits_(0), reserved_bits_(0),
 
 gpio_bits_t GPIO::InitOutputs(gpio_bits_t outputs,
                               bool adafruit_pwm_transition_hack_needed) {
+  if (trace_) {  // Software GPIO: no pinmux to set up.
+    outputs &= ~(output_bits_ | input_bits_ | reserved_bits_);
+    output_bits_ |= outputs;
+    return outputs;
+  }
   if (s_GPIO_registers == NULL) {
     fprintf(stderr, "Attempt to init outputs but not yet Init()-ialized.\n");
     return 0;
@@ -204,6 +204,11 @@ gpio_bits_t GPIO::InitOutputs(gpio_bits_t outputs,
 }
 
 gpio_bits_t GPIO::RequestInputs(gpio_bits_t inputs) {
+  if (trace_) {
+    inputs &= ~(output_bits_ | input_bits_ | reserved_bits_);
+    input_bits_ |= inputs;
+    return inputs;
+  }
   if (s_GPIO_registers == NULL) {
     fprintf(stderr, "Attempt to init inputs but not yet Init()-ialized.\n");
     return 0;
@@ -425,6 +430,27 @@ bool GPIO::Init(int slowdown) {
   return true;
 }
 
+bool GPIO::InitSoftware(GPIOTrace *trace) {
+  assert(trace != NULL);
+  // Reads and the slowdown-writes go to a dummy register; all the actual
+  // output goes to the trace.
+  static volatile uint32_t s_software_register = 0;
+  slowdown_ = 0;
+  trace_ = trace;
+  gpio_set_bits_low_ = &s_software_register;
+  gpio_clr_bits_low_ = &s_software_register;
+  gpio_read_bits_low_ = &s_software_register;
+#ifdef ENABLE_WIDE_GPIO_COMPUTE_MODULE
+  gpio_set_bits_high_ = &s_software_register;
+  gpio_clr_bits_high_ = &s_software_register;
+  gpio_read_bits_high_ = &s_software_register;
+#endif
+  return true;
+}
+
+void GPIO::RecordSetBits(gpio_bits_t value) { trace_->SetBits(value); }
+void GPIO::RecordClrBits(gpio_bits_t value) { trace_->ClearBits(value); }
+
 bool GPIO::IsPi4() {
   return GetPiModel() == PI_MODEL_4;
 }
@@ -441,7 +467,9 @@ namespace {
 class Timers {
 public:
   static bool Init();
-  static void sleep_nanos(long t);
+  // Returns how many nanoseconds longer than requested this took if that
+  // could be measured, -1 otherwise.
+  static long sleep_nanos(long t);
 };
 
 // Simplest of PinPulsers. Uses somewhat jittery and manual timers
@@ -450,7 +478,7 @@ class TimerBasedPinPulser : public PinPulser {
 public:
   TimerBasedPinPulser(GPIO *io, gpio_bits_t bits,
                       const std::vector<int> &nano_specs)
-    : io_(io), bits_(bits), nano_specs_(nano_specs) {
+    : io_(io), bits_(bits), specs_(nano_specs), nano_specs_(nano_specs) {
     if (!s_Timer1Mhz) {
       fprintf(stderr, "FYI: not running as root which means we can't properly "
               "control timing unless this is a real-time kernel. Expect color "
@@ -459,15 +487,51 @@ public:
   }
 
   virtual void SendPulse(int time_spec_number) {
+    const int nanos = nano_specs_[time_spec_number];
+    if (nanos == 0) return;
     io_->ClearBits(bits_);
-    Timers::sleep_nanos(nano_specs_[time_spec_number]);
+    const long overshoot = Timers::sleep_nanos(nanos);
     io_->SetBits(bits_);
+    if (overshoot >= 0) RecordOvershoot(overshoot);
+  }
+
+  virtual void SetPulseScale(float scale) {
+    for (size_t i = 0; i < specs_.size(); ++i)
+      nano_specs_[i] = specs_[i] * scale + 0.5f;
   }
 
 private:
   GPIO *const io_;
   const gpio_bits_t bits_;
-  const std::vector<int> nano_specs_;
+  const std::vector<int> specs_;
+  std::vector<int> nano_specs_;   // Scaled
+};
+
+// PinPulser for the software GPIO. Doesn't wait, just records the pulse
+// with its intended length.
+class TracePinPulser : public PinPulser {
+public:
+  TracePinPulser(GPIOTrace *trace, gpio_bits_t bits,
+                 const std::vector<int> &nano_specs)
+    : trace_(trace), bits_(bits),
+      specs_(nano_specs), nano_specs_(nano_specs) {}
+
+  virtual void SendPulse(int time_spec_number) {
+    const int nanos = nano_specs_[time_spec_number];
+    if (nanos == 0) return;
+    trace_->Pulse(bits_, time_spec_number, nanos);
+  }
+
+  virtual void SetPulseScale(float scale) {
+    for (size_t i = 0; i < specs_.size(); ++i)
+      nano_specs_[i] = specs_[i] * scale + 0.5f;
+  }
+
+private:
+  GPIOTrace *const trace_;
+  const gpio_bits_t bits_;
+  const std::vector<int> specs_;
+  std::vector<int> nano_specs_;   // Scaled
 };
 
 // Check that 3 shows up in isolcpus
@@ -544,7 +608,7 @@ static uint32_t JitterAllowanceMicroseconds() {
   return EMPIRICAL_NANOSLEEP_OVERHEAD_US;
 }
 
-void Timers::sleep_nanos(long nanos) {
+long Timers::sleep_nanos(long nanos) {
   // For smaller durations, we go straight to busy wait.
 
   // For larger duration, we use nanosleep() to give the operating system
@@ -564,9 +628,11 @@ void Timers::sleep_nanos(long nanos) {
       const uint32_t after = *s_Timer1Mhz;
       const long nanoseconds_passed = 1000 * (uint32_t)(after - before);
       if (nanoseconds_passed > nanos) {
-        return;  // darn, missed it.
+        return nanoseconds_passed - nanos;  // darn, missed it.
       } else {
         nanos -= nanoseconds_passed; // remaining time with busy-loop
+        busy_wait_impl(nanos);
+        return 0;
       }
     }
   } else {
@@ -576,11 +642,12 @@ void Timers::sleep_nanos(long nanos) {
       struct timespec sleep_time
         = { 0, nanos - EMPIRICAL_NANOSLEEP_OVERHEAD_US*1000 };
       nanosleep(&sleep_time, NULL);
-      return;
+      return -1;
     }
   }
 
   busy_wait_impl(nanos);  // Use model-specific busy-loop for remaining time.
+  return -1;
 }
 
 static void busy_wait_nanos_rpi_1(long nanos) {
@@ -614,26 +681,6 @@ static void busy_wait_nanos_rpi_4(long nanos) {
   }
 }
 
-#if DEBUG_SLEEP_JITTER
-static int overshoot_histogram_us[256] = {0};
-static void print_overshoot_histogram() {
-  fprintf(stderr, "Overshoot histogram >= empirical overhead of %dus\n"
-          "%6s | %7s | %7s\n",
-          JitterAllowanceMicroseconds(), "usec", "count", "accum");
-  int total_count = 0;
-  for (int i = 0; i < 256; ++i) total_count += overshoot_histogram_us[i];
-  int running_count = 0;
-  for (int us = 0; us < 256; ++us) {
-    const int count = overshoot_histogram_us[us];
-    if (count > 0) {
-      running_count += count;
-      fprintf(stderr, "%s%3dus: %8d %7.3f%%\n", (us == 0) ? "<=" : " +",
-              us, count, 100.0 * running_count / total_count);
-    }
-  }
-}
-#endif
-
 // A PinPulser that uses the PWM hardware to create accurate pulses.
 // It only works on GPIO-12 or 18 though.
 class HardwarePinPulser : public PinPulser {
@@ -662,14 +709,10 @@ public:
   }
 
   HardwarePinPulser(gpio_bits_t pins, const std::vector<int> &specs)
-    : triggered_(false) {
+    : specs_(specs), base_(specs[0]), triggered_(false) {
     assert(CanHandle(pins));
     assert(s_CLK_registers && s_PWM_registers && s_Timer1Mhz);
 
-#if DEBUG_SLEEP_JITTER
-    atexit(print_overshoot_histogram);
-#endif
-
     if (LinuxHasModuleLoaded("snd_bcm2835")) {
       fprintf(stderr,
               "\n%s=== snd_bcm2835: found that the Pi sound module is loaded. ===%s\n"
@@ -683,12 +726,6 @@ public:
       exit(1);
     }
 
-    for (size_t i = 0; i < specs.size(); ++i) {
-      // Hints how long to nanosleep, already corrected for system overhead.
-      sleep_hints_us_.push_back(specs[i]/1000 - JitterAllowanceMicroseconds());
-    }
-
-    const int base = specs[0];
     // Get relevant registers
     fifo_ = s_PWM_registers + PWM_FIFO;
 
@@ -701,32 +738,19 @@ public:
     } else {
       assert(false); // should've been caught by CanHandle()
     }
-    InitPWMDivider((base/2) / PWM_BASE_TIME_NS);
-    for (size_t i = 0; i < specs.size(); ++i) {
-      pwm_range_.push_back(2 * specs[i] / base);
-    }
+    InitPWMDivider((base_/2) / PWM_BASE_TIME_NS);
+    sleep_hints_us_.resize(specs.size());
+    pulse_lengths_us_.resize(specs.size());
+    pulses_.resize(specs.size());
+    SetPulseScale(1.0f);
   }
 
   virtual void SendPulse(int c) {
-    if (pwm_range_[c] < 16) {
-      s_PWM_registers[PWM_RNG1] = pwm_range_[c];
-
-      *fifo_ = pwm_range_[c];
-    } else {
-      // Keep the actual range as short as possible, as we have to
-      // wait for one full period of these in the zero phase.
-      // The hardware can't deal with values < 2, so only do this when
-      // have enough of these.
-      s_PWM_registers[PWM_RNG1] = pwm_range_[c] / 8;
-
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
+    const HardwarePulse &pulse = pulses_[c];
+    if (pulse.count == 0) return;  // Too short to send.
+    s_PWM_registers[PWM_RNG1] = pulse.range;
+    for (int i = 0; i < pulse.count; ++i) {
+      *fifo_ = pulse.words[i];
     }
 
     /*
@@ -747,6 +771,7 @@ public:
     *fifo_ = 0;
 
     sleep_hint_us_ = sleep_hints_us_[c];
+    pulse_us_ = pulse_lengths_us_[c];
     start_time_ = *s_Timer1Mhz;
     triggered_ = true;
     s_PWM_registers[PWM_CTL] = PWM_CTL_USEF1 | PWM_CTL_PWEN1 | PWM_CTL_POLA1;
@@ -768,18 +793,9 @@ public:
         struct timespec sleep_time = { 0, 1000 * to_sleep_us };
         nanosleep(&sleep_time, NULL);
 
-#if DEBUG_SLEEP_JITTER
-        {
-          // Record histogram of realtime jitter how much longer we actually
-          // took.
-          const int total_us = *s_Timer1Mhz - start_time_;
-          const int nanoslept_us = total_us - already_elapsed_usec;
-          int overshoot = nanoslept_us - (to_sleep_us + JitterAllowanceMicroseconds());
-          if (overshoot < 0) overshoot = 0;
-          if (overshoot > 255) overshoot = 255;
-          overshoot_histogram_us[overshoot]++;
-        }
-#endif
+        // Realtime jitter: how much longer than the pulse we slept.
+        const int total_us = *s_Timer1Mhz - start_time_;
+        RecordOvershoot(1000L * (total_us - pulse_us_));
       }
     }
 
@@ -790,6 +806,19 @@ public:
     triggered_ = false;
   }
 
+  virtual void SetPulseScale(float scale) {
+    static const int jitter_allowance_us = JitterAllowanceMicroseconds();
+    for (size_t i = 0; i < specs_.size(); ++i) {
+      const int nanos = specs_[i] * scale + 0.5f;
+      // Hints how long to nanosleep, already corrected for system overhead.
+      sleep_hints_us_[i] = nanos/1000 - jitter_allowance_us;
+      pulse_lengths_us_[i] = nanos/1000;
+      if (!GetHardwarePulse(nanos, base_, &pulses_[i])) {
+        pulses_[i].count = 0;
+      }
+    }
+  }
+
 private:
   void SetGPIOMode(volatile uint32_t *gpioReg, unsigned gpio, unsigned mode) {
     const int reg = gpio / 10;
@@ -818,20 +847,53 @@ private:
   }
 
 private:
-  std::vector<uint32_t> pwm_range_;
+  const std::vector<int> specs_;
+  const int base_;
+  std::vector<HardwarePulse> pulses_;  // Scaled, like the following.
   std::vector<int> sleep_hints_us_;
+  std::vector<int> pulse_lengths_us_;
   volatile uint32_t *fifo_;
   uint32_t start_time_;
   int sleep_hint_us_;
+  int pulse_us_;
   bool triggered_;
 };
 
 } // end anonymous namespace
 
+bool GetHardwarePulse(int nanos, int base_nanos, HardwarePulse *pulse) {
+  // In units of half the shortest pulse, which the PWM clock is divided
+  // to. The hardware can't do less than two of these.
+  const uint32_t clocks = (2 * nanos + base_nanos/2) / base_nanos;
+  if (clocks < 2) return false;
+  if (clocks < 16) {
+    pulse->range = clocks;
+    pulse->count = 1;
+    pulse->words[0] = clocks;
+    return true;
+  }
+  // Keep the actual range as short as possible, as we have to wait for one
+  // full period of these in the zero phase, by sending eight words. If the
+  // clocks don't divide by eight, the period is one longer and the words
+  // that are not fully on leave a single clock off, so that the pin is
+  // still on for exactly "clocks" in total.
+  const uint32_t word = clocks / 8;
+  const uint32_t remainder = clocks % 8;
+  pulse->range = word + (remainder ? 1 : 0);
+  pulse->count = 8;
+  for (uint32_t i = 0; i < 8; ++i) {
+    pulse->words[i] = word + (i < remainder ? 1 : 0);
+  }
+  return true;
+}
+
 // Public PinPulser factory
 PinPulser *PinPulser::Create(GPIO *io, gpio_bits_t gpio_mask,
                              bool allow_hardware_pulsing,
                              const std::vector<int> &nano_wait_spec) {
+  if (io->trace()) {
+    return new TracePinPulser(io->trace(), gpio_mask, nano_wait_spec);
+  }
   if (!Timers::Init()) return NULL;
   if (allow_hardware_pulsing && HardwarePinPulser::CanHandle(gpio_mask)) {
     return new HardwarePinPulser(gpio_mask, nano_wait_spec);
@@ -17,7 +17,9 @@
 #define RPI_GPIO_INTERNAL_H
 
 #include "gpio-bits.h"
+#include "refresh-metrics-internal.h"
 
+#include <stddef.h>
 #include <vector>
 
 #if __ARM_ARCH >= 7
@@ -29,6 +31,8 @@
 // Putting this in our namespace to not collide with other things called like
 // this.
 namespace rgb_matrix {
+class GPIOTrace;
+
 // For now, everything is initialized as output.
 class GPIO {
 public:
@@ -38,6 +42,15 @@ public:
   // (e.g. due to a permission problem).
   bool Init(int slowdown);
 
+  // Initialize as software GPIO: nothing is written to hardware, instead
+  // all writes are recorded in the given "trace" (see gpio-trace.h).
+  // This allows to run the refresh code on any machine, e.g. for testing
+  // and benchmarking. Does not take ownership of the trace.
+  bool InitSoftware(GPIOTrace *trace);
+
+  // The trace this GPIO writes to, or NULL if this is writing to hardware.
+  GPIOTrace *trace() const { return trace_; }
+
   // Initialize outputs.
   // Returns the bits that were available and could be set for output.
   // (never use the optional adafruit_hack_needed parameter, it is used
@@ -72,6 +85,63 @@ public:
     delay();
   }
 
+  // Clock "count" words from "data" into the shift registers. For each,
+  // the bits in "mask" are written like WriteMaskedBits(), which also takes
+  // "clock" low, then SetBits(clock) gives the rising edge. Everything that
+  // doesn't change per word is decided once, so the common case is a loop
+  // of nothing but register stores, with the slowdown stores of delay()
+  // after the data and after the clock.
+  inline void ClockOutWords(const gpio_bits_t *data, int count,
+                            gpio_bits_t mask, gpio_bits_t clock) {
+#ifdef ENABLE_WIDE_GPIO_COMPUTE_MODULE
+    const bool generic = (trace_ != NULL || uses_64_bit_);
+#else
+    const bool generic = (trace_ != NULL);
+#endif
+    if (__builtin_expect(generic, 0)) {
+      for (int i = 0; i < count; ++i) {
+        WriteMaskedBits(data[i], mask);
+        SetBits(clock);
+      }
+      return;
+    }
+    volatile uint32_t *const set_bits = gpio_set_bits_low_;
+    volatile uint32_t *const clr_bits = gpio_clr_bits_low_;
+    const uint32_t mask_low = static_cast<uint32_t>(mask);
+    const uint32_t clock_low = static_cast<uint32_t>(clock);
+#if LED_MATRIX_ALLOW_BARRIER_DELAY
+    if (slowdown_ == -1) {
+      for (int i = 0; i < count; ++i) {
+        const uint32_t value = static_cast<uint32_t>(data[i]) & mask_low;
+        *clr_bits = value ^ mask_low;
+        *set_bits = value;
+        asm volatile("dsb\tst");
+        *set_bits = clock_low;
+        asm volatile("dsb\tst");
+      }
+      return;
+    }
+#endif
+    const int slowdown = slowdown_;
+    if (slowdown <= 0) {
+      for (int i = 0; i < count; ++i) {
+        const uint32_t value = static_cast<uint32_t>(data[i]) & mask_low;
+        *clr_bits = value ^ mask_low;
+        *set_bits = value;
+        *set_bits = clock_low;
+      }
+      return;
+    }
+    for (int i = 0; i < count; ++i) {
+      const uint32_t value = static_cast<uint32_t>(data[i]) & mask_low;
+      *clr_bits = value ^ mask_low;
+      *set_bits = value;
+      for (int n = 0; n < slowdown; ++n) *clr_bits = 0;
+      *set_bits = clock_low;
+      for (int n = 0; n < slowdown; ++n) *clr_bits = 0;
+    }
+  }
+
   inline gpio_bits_t Read() const { return ReadRegisters() & input_bits_; }
 
   // Return if this is appears to be a Pi4
@@ -99,6 +169,10 @@ private:
   }
 
   inline void WriteSetBits(gpio_bits_t value) {
+    if (__builtin_expect(trace_ != NULL, 0)) {
+      RecordSetBits(value);
+      return;
+    }
     *gpio_set_bits_low_ = static_cast<uint32_t>(value & 0xFFFFFFFF);
 #ifdef ENABLE_WIDE_GPIO_COMPUTE_MODULE
     if (uses_64_bit_)
@@ -107,6 +181,10 @@ private:
   }
 
   inline void WriteClrBits(gpio_bits_t value) {
+    if (__builtin_expect(trace_ != NULL, 0)) {
+      RecordClrBits(value);
+      return;
+    }
     *gpio_clr_bits_low_ = static_cast<uint32_t>(value & 0xFFFFFFFF);
 #ifdef ENABLE_WIDE_GPIO_COMPUTE_MODULE
     if (uses_64_bit_)
@@ -114,11 +192,16 @@ private:
 #endif
   }
 
+  // Software GPIO: out of line to keep the hardware path small.
+  void RecordSetBits(gpio_bits_t value);
+  void RecordClrBits(gpio_bits_t value);
+
 private:
   gpio_bits_t output_bits_;
   gpio_bits_t input_bits_;
   gpio_bits_t reserved_bits_;
   int slowdown_;
+  GPIOTrace *trace_;
 
   volatile uint32_t *gpio_set_bits_low_;
   volatile uint32_t *gpio_clr_bits_low_;
@@ -146,6 +229,7 @@ public:
                            bool allow_hardware_pulsing,
                            const std::vector<int> &nano_wait_spec);
 
+  PinPulser() : overshoot_(NULL) {}
   virtual ~PinPulser() {}
 
   // Send a pulse with a given length (index into nano_wait_spec array).
@@ -153,8 +237,42 @@ public:
 
   // If SendPulse() is asynchronously implemented, wait for pulse to finish.
   virtual void WaitPulseFinished() {}
+
+  // Make all pulses "scale" (0..1) times as long as given in
+  // nano_wait_spec. Pulses that get too short to be sent are skipped.
+  // Only call while no pulse is in progress.
+  virtual void SetPulseScale(float scale) = 0;
+
+  // Record in "histogram" how many nanoseconds longer than requested we
+  // had to wait for pulses. Only implementations that can measure this
+  // record anything. NULL to stop recording.
+  void set_overshoot_histogram(RGBLedHistogram *histogram) {
+    overshoot_ = histogram;
+  }
+
+protected:
+  void RecordOvershoot(long nanos) {
+    if (overshoot_) internal::AddToHistogram(overshoot_, nanos > 0 ? nanos : 0);
+  }
+
+private:
+  RGBLedHistogram *overshoot_;
 };
 
+// How the PWM hardware sends a pulse: the range register is set to "range"
+// PWM clocks and each of the "count" FIFO words keeps the pin on for its
+// value of clocks within one such period.
+struct HardwarePulse {
+  uint32_t range;
+  int count;
+  uint32_t words[8];
+};
+
+// Get the HardwarePulse closest to "nanos" long with a PWM clock of half
+// the shortest pulse "base_nanos". Returns false if it is too short to
+// be sent.
+bool GetHardwarePulse(int nanos, int base_nanos, HardwarePulse *pulse);
+
 // Get rolling over microsecond counter. We get this from a hardware register
 // if possible and a terrible slow fallback otherwise.
 uint32_t GetMicrosecondCounter();
@@ -14,7 +14,7 @@
 // along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
 
 #include "graphics.h"
-#include "utf8-internal.h"
+#include "led-matrix.h"
 
 #include <stdlib.h>
 #include <functional>
@@ -57,6 +57,16 @@ bool SetImage(Canvas *c, int canvas_offset_x, int canvas_offset_y,
   const size_t next_row_skip = skip_start_row + skip_end_row;
   buffer += skip_start_row;
 
+  // A FrameCanvas encodes whole rows at once; no virtual call per pixel.
+  FrameCanvas *const frame = dynamic_cast<FrameCanvas*>(c);
+  if (frame) {
+    frame->SetPixelData(canvas_offset_x, canvas_offset_y,
+                        w - canvas_offset_x, h - canvas_offset_y,
+                        buffer, 3 * width, 3,
+                        is_bgr ? 2 : 0, 1, is_bgr ? 0 : 2);
+    return true;
+  }
+
   if (is_bgr) {
     for (int y = canvas_offset_y; y < h; ++y) {
       for (int x = canvas_offset_x; x < w; ++x) {
@@ -86,13 +96,8 @@ int DrawText(Canvas *c, const Font &font,
 int DrawText(Canvas *c, const Font &font,
              int x, int y, const Color &color, const Color *background_color,
              const char *utf8_text, int extra_spacing) {
-  const int start_x = x;
-  while (*utf8_text) {
-    const uint32_t cp = utf8_next_codepoint(utf8_text);
-    x += font.DrawGlyph(c, x, y, color, background_color, cp);
-    x += extra_spacing;
-  }
-  return x - start_x;
+  return font.DrawText(c, x, y, color, background_color, utf8_text,
+                       extra_spacing);
 }
 
 // There used to be a symbol without the optional extra_spacing parameter. Let's
@@ -108,13 +113,8 @@ int DrawText(Canvas *c, const Font &font,
 int VerticalDrawText(Canvas *c, const Font &font, int x, int y,
                      const Color &color, const Color *background_color,
                      const char *utf8_text, int extra_spacing) {
-  const int start_y = y;
-  while (*utf8_text) {
-    const uint32_t cp = utf8_next_codepoint(utf8_text);
-    font.DrawGlyph(c, x, y, color, background_color, cp);
-    y += font.height() + extra_spacing;
-  }
-  return y - start_y;
+  return font.VerticalDrawText(c, x, y, color, background_color, utf8_text,
+                               extra_spacing);
 }
 
 void DrawCircle(Canvas *c, int x0, int y0, int radius, const Color &color) {
@@ -89,6 +89,8 @@ static struct RGBLedMatrix *led_matrix_create_from_options_optional_edit(
     OPT_COPY_IF_SET(panel_type);
     OPT_COPY_IF_SET(limit_refresh_rate_hz);
     OPT_COPY_IF_SET(disable_busy_waiting);
+    OPT_COPY_IF_SET(multiplex_definition);
+    OPT_COPY_IF_SET(metrics_shm_name);
 #undef OPT_COPY_IF_SET
   }
 
@@ -136,6 +138,8 @@ static struct RGBLedMatrix *led_matrix_create_from_options_optional_edit(
     ACTUAL_VALUE_BACK_TO_OPT(panel_type);
     ACTUAL_VALUE_BACK_TO_OPT(limit_refresh_rate_hz);
     ACTUAL_VALUE_BACK_TO_OPT(disable_busy_waiting);
+    ACTUAL_VALUE_BACK_TO_OPT(multiplex_definition);
+    ACTUAL_VALUE_BACK_TO_OPT(metrics_shm_name);
 #undef ACTUAL_VALUE_BACK_TO_OPT
   }
 
@@ -216,6 +220,25 @@ uint8_t led_matrix_get_brightness(struct RGBLedMatrix *matrix) {
   return to_matrix(matrix)->brightness();
 }
 
+void led_matrix_set_refresh_brightness(struct RGBLedMatrix *matrix,
+                                       float percent) {
+  to_matrix(matrix)->SetRefreshBrightness(percent);
+}
+
+float led_matrix_get_refresh_brightness(struct RGBLedMatrix *matrix) {
+  return to_matrix(matrix)->refresh_brightness();
+}
+
+int led_matrix_set_pixel_mapper_config(struct RGBLedMatrix *matrix,
+                                       const char *pixel_mapper_config) {
+  return to_matrix(matrix)->SetPixelMapperConfig(pixel_mapper_config);
+}
+
+int led_matrix_get_refresh_metrics(struct RGBLedMatrix *matrix,
+                                   struct RGBLedRefreshMetrics *metrics) {
+  return to_matrix(matrix)->GetRefreshMetrics(metrics);
+}
+
 void led_canvas_get_size(const struct LedCanvas *canvas,
                          int *width, int *height) {
   rgb_matrix::FrameCanvas *c = to_canvas((struct LedCanvas*)canvas);
@@ -29,10 +29,15 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+
 #include "gpio.h"
 #include "thread.h"
+#include "frame-swap.h"
 #include "framebuffer-internal.h"
 #include "multiplex-mappers-internal.h"
+#include "refresh-metrics-internal.h"
 
 // Leave this in here for a while. Setting things from old defines.
 #if defined(ADAFRUIT_RGBMATRIX_HAT)
@@ -75,6 +80,10 @@ public:
   FrameCanvas *CreateFrameCanvas();
   FrameCanvas *SwapOnVSync(FrameCanvas *other, unsigned framerate_fraction);
   bool ApplyPixelMapper(const PixelMapper *mapper);
+  bool SetPixelMapperConfig(const char *pixel_mapper_config);
+
+  void set_sync_on_swap(bool on);
+  bool sync_on_swap() const { return sync_on_swap_; }
 
   bool SetPWMBits(uint8_t value);
   uint8_t pwmbits();   // return the pwm-bits of the currently active buffer.
@@ -87,22 +96,61 @@ public:
   void SetBrightness(uint8_t brightness);
   uint8_t brightness();
 
+  void SetRefreshBrightness(float percent);
+  float refresh_brightness() const { return refresh_brightness_; }
+
   uint64_t RequestInputs(uint64_t);
   uint64_t AwaitInputChange(int timeout_ms);
 
   uint64_t RequestOutputs(uint64_t output_bits);
   void OutputGPIO(uint64_t output_bits);
 
+  bool GetRefreshMetrics(RGBLedRefreshMetrics *metrics) const {
+    return metrics_->Snapshot(metrics);
+  }
+
 private:
   friend class RGBMatrix;
 
+  // What applying a PixelMapper did: for each pixel of the "width" x
+  // "height" result, the index (y * from_width + x) of the pixel it shows
+  // in the "from_width" x "from_height" map before, or -1.
+  struct Remapping {
+    int from_width, from_height;
+    int width, height;
+    std::vector<int> source;
+  };
+
+  // Get the Remapping "mapper" does to a "width" x "height" map.
+  static bool GetRemapping(const PixelMapper *mapper, int width, int height,
+                           Remapping *remapping);
+
+  // Apply "remapping" to "*map", which is replaced with the result.
+  static void ApplyRemapping(const Remapping &remapping,
+                             internal::PixelDesignatorMap **map);
+
+  // Apply "mapper" to "*map", which is replaced with the result.
+  static bool ApplyPixelMapper(const PixelMapper *mapper,
+                               internal::PixelDesignatorMap **map);
+
   // Apply pixel mappers that have been passed down via a configuration
-  // string.
-  void ApplyNamedPixelMappers(const char *pixel_mapper_config,
-                              int chain, int parallel);
+  // string. Returns false if any of them could not be applied; these are
+  // skipped.
+  static bool ApplyNamedPixelMappers(const char *pixel_mapper_config,
+                                     int chain, int parallel,
+                                     internal::PixelDesignatorMap **map);
+
+  // Bring "previous" up to date with "shown", which just replaced it on
+  // the display.
+  void SyncSwapped(FrameCanvas *previous, FrameCanvas *shown);
+  size_t FrameIndex(const FrameCanvas *frame) const;
 
   Options params_;
+  // Bitplanes of all frames: the pwm_bits we started with, so that they
+  // can be shown all and are compatible with each other.
+  const int bitplanes_;
   bool do_luminance_correct_;
+  float refresh_brightness_;
 
   FrameCanvas *active_;
 
@@ -110,8 +158,19 @@ private:
   Mutex active_frame_sync_;
   UpdateThread *updater_;
   std::vector<FrameCanvas*> created_frames_;
+  // For sync_on_swap_: per created frame, the double rows in which the
+  // display changed since the frame was last synced.
+  bool sync_on_swap_;
+  std::vector<internal::Framebuffer::RowMask> stale_rows_;
   internal::PixelDesignatorMap *shared_pixel_mapper_;
+  // Mapping of the panels themselves, before any named pixel mappers.
+  internal::PixelDesignatorMap *base_pixel_mapper_;
+  // What the mappers passed to the public ApplyPixelMapper() did, to apply
+  // them again on top of a new SetPixelMapperConfig(). The mappers
+  // themselves might be gone or re-parametrized by then.
+  std::vector<Remapping> applied_remappings_;
   uint64_t user_output_bits_;
+  internal::RefreshMetrics *metrics_;
 };
 
 using namespace internal;
@@ -121,15 +180,13 @@ class RGBMatrix::Impl::UpdateThread : public Thread {
 public:
   UpdateThread(GPIO *io, FrameCanvas *initial_frame,
                int pwm_dither_bits, bool show_refresh,
-               int limit_refresh_hz, bool allow_busy_waiting)
-    : io_(io), show_refresh_(show_refresh),
+               int limit_refresh_hz, bool allow_busy_waiting,
+               RefreshMetrics *metrics)
+    : io_(io), metrics_(metrics), show_refresh_(show_refresh),
       target_frame_usec_(limit_refresh_hz < 1 ? 0 : 1e6/limit_refresh_hz),
       allow_busy_waiting_(allow_busy_waiting),
-      running_(true),
-      current_frame_(initial_frame), next_frame_(NULL),
-      requested_frame_multiple_(1) {
-    pthread_cond_init(&frame_done_, NULL);
-    pthread_cond_init(&input_change_, NULL);
+      running_(true), pulse_scale_(1.0f), gpio_inputs_(0), input_sequence_(0),
+      input_waiters_(0), frames_(initial_frame) {
     switch (pwm_dither_bits) {
     case 0:
       start_bit_[0] = 0; start_bit_[1] = 0;
@@ -147,55 +204,70 @@ public:
   }
 
   void Stop() {
-    MutexLock l(&running_mutex_);
-    running_ = false;
+    running_.store(false, std::memory_order_relaxed);
+  }
+
+  // Applied from the next frame on.
+  void SetPulseScale(float scale) {
+    pulse_scale_.store(scale, std::memory_order_relaxed);
   }
 
   virtual void Run() {
-    unsigned frame_count = 0;
     unsigned low_bit_sequence = 0;
     uint32_t largest_time = 0;
     gpio_bits_t last_gpio_bits = 0;
+    uint64_t average_frame_ns = 0;
+    uint64_t bitplane_nanos[Framebuffer::kMaxBitPlanes];
+    static_assert(RGB_REFRESH_METRICS_BITPLANES == Framebuffer::kMaxBitPlanes,
+                  "Metrics need a histogram per possible bitplane");
+    float applied_pulse_scale = 1.0f;
 
     // Let's start measure max time only after a we were running for a few
     // seconds to not pick up start-up glitches.
-    static const int kHoldffTimeUs = 2000 * 1000;
-    uint32_t initial_holdoff_start = GetMicrosecondCounter();
+    static const uint64_t kHoldffTimeNs = 2000ULL * 1000 * 1000;
+    const uint64_t initial_holdoff_start = MonotonicNanos();
     bool max_measure_enabled = false;
 
-    while (running()) {
+    while (running_.load(std::memory_order_relaxed)) {
       const uint32_t start_time_us = GetMicrosecondCounter();
+      const uint64_t start_time_ns = MonotonicNanos();
 
-      current_frame_->framebuffer()
-        ->DumpToMatrix(io_, start_bit_[low_bit_sequence % 4]);
-
-      // SwapOnVSync() exchange.
-      {
-        MutexLock l(&frame_sync_);
-        // Do fast equality test first (likely due to frame_count reset).
-        if (frame_count == requested_frame_multiple_
-            || frame_count % requested_frame_multiple_ == 0) {
-          // We reset to avoid frame hick-up every couple of weeks
-          // run-time iff requested_frame_multiple_ is not a factor of 2^32.
-          frame_count = 0;
-          if (next_frame_ != NULL) {
-            current_frame_ = next_frame_;
-            next_frame_ = NULL;
-          }
-          pthread_cond_signal(&frame_done_);
-        }
+      const float pulse_scale = pulse_scale_.load(std::memory_order_relaxed);
+      if (pulse_scale != applied_pulse_scale) {
+        Framebuffer::SetPulseScale(pulse_scale);
+        applied_pulse_scale = pulse_scale;
+      }
+
+      Framebuffer *const frame = frames_.current()->framebuffer();
+      const int low_bit = start_bit_[low_bit_sequence % 4];
+      memset(bitplane_nanos, 0, sizeof(bitplane_nanos));
+      frame->DumpToMatrix(io_, low_bit, bitplane_nanos);
+      const uint64_t dump_ns = MonotonicNanos() - start_time_ns;
+
+      // SwapOnVSync() exchange. Does not block.
+      unsigned dropped_swaps = 0;
+      if (frames_.FrameDone() && average_frame_ns > 0) {
+        // A swap is due at the first frame boundary after it was posted, so
+        // at most the requested multiple of refreshes later. Each refresh
+        // it had to wait beyond that, e.g. as a refresh was stalled, the
+        // previous frame was shown too long.
+        const uint64_t waited_ns = MonotonicNanos()
+          - frames_.served_post_nanos();
+        const uint64_t due_ns = frames_.frame_multiple() * average_frame_ns;
+        if (waited_ns > due_ns)
+          dropped_swaps = (waited_ns - due_ns) / average_frame_ns;
       }
 
       // Read input bits.
       const gpio_bits_t inputs = io_->Read();
       if (inputs != last_gpio_bits) {
         last_gpio_bits = inputs;
-        MutexLock l(&input_sync_);
-        gpio_inputs_ = inputs;
-        pthread_cond_signal(&input_change_);
+        gpio_inputs_.store(inputs, std::memory_order_relaxed);
+        input_sequence_.fetch_add(1, std::memory_order_seq_cst);
+        if (input_waiters_.load(std::memory_order_seq_cst))
+          FutexWakeAll(&input_sequence_);
       }
 
-      ++frame_count;
       ++low_bit_sequence;
 
       if (target_frame_usec_) {
@@ -209,9 +281,20 @@ public:
         }
       }
 
-      const uint32_t end_time_us = GetMicrosecondCounter();
+      const uint64_t end_time_ns = MonotonicNanos();
+      const uint64_t frame_ns = end_time_ns - start_time_ns;
+      average_frame_ns = (average_frame_ns == 0)
+        ? frame_ns
+        : average_frame_ns - average_frame_ns / 16 + frame_ns / 16;
+      const int end_bitplane = frame->end_bitplane();
+      const int first_bitplane = std::max(low_bit,
+                                          end_bitplane - frame->pwmbits());
+      metrics_->AddFrame(frame_ns, dump_ns, bitplane_nanos,
+                         first_bitplane, end_bitplane, dropped_swaps,
+                         end_time_ns);
+
       if (show_refresh_) {
-        uint32_t usec = end_time_us - start_time_us;
+        const uint32_t usec = frame_ns / 1000;
         printf("\b\b\b\b\b\b\b\b%6.1fHz", 1e6 / usec);
         if (usec > largest_time && max_measure_enabled) {
           largest_time = usec;
@@ -220,51 +303,54 @@ public:
                  "\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b", lowest_hz);
         } else {
           // Don't measure at startup, as times will be janky.
-          max_measure_enabled = (end_time_us - initial_holdoff_start) > kHoldffTimeUs;
+          max_measure_enabled = (end_time_ns - initial_holdoff_start) > kHoldffTimeNs;
         }
       }
     }
   }
 
   FrameCanvas *SwapOnVSync(FrameCanvas *other, unsigned frame_fraction) {
-    MutexLock l(&frame_sync_);
-    FrameCanvas *previous = current_frame_;
-    next_frame_ = other;
-    requested_frame_multiple_ = frame_fraction;
-    frame_sync_.WaitOn(&frame_done_);
-    return previous;
+    return frames_.Swap(other, frame_fraction);
   }
 
   gpio_bits_t AwaitInputChange(int timeout_ms) {
-    MutexLock l(&input_sync_);
-    input_sync_.WaitOn(&input_change_, timeout_ms);
-    return gpio_inputs_;
+    const uint32_t sequence = input_sequence_.load(std::memory_order_seq_cst);
+    input_waiters_.fetch_add(1, std::memory_order_seq_cst);
+    // Wake-ups can be spurious, so only wait for what is left of the timeout.
+    const uint64_t deadline_ns = MonotonicNanos() + timeout_ms * 1000000LL;
+    while (input_sequence_.load(std::memory_order_seq_cst) == sequence) {
+      long wait_ms = -1;
+      if (timeout_ms >= 0) {
+        const uint64_t now_ns = MonotonicNanos();
+        if (now_ns >= deadline_ns)
+          break;  // timeout.
+        wait_ms = (deadline_ns - now_ns + 999999) / 1000000;
+      }
+      if (!FutexWait(&input_sequence_, sequence, wait_ms))
+        break;  // timeout.
+    }
+    input_waiters_.fetch_sub(1, std::memory_order_relaxed);
+    return gpio_inputs_.load(std::memory_order_relaxed);
   }
 
 private:
-  inline bool running() {
-    MutexLock l(&running_mutex_);
-    return running_;
-  }
-
   GPIO *const io_;
+  RefreshMetrics *const metrics_;
   const bool show_refresh_;
   const uint32_t target_frame_usec_;
   const bool allow_busy_waiting_;
   uint32_t start_bit_[4];
 
-  Mutex running_mutex_;
-  bool running_;
+  std::atomic<bool> running_;
+  std::atomic<float> pulse_scale_;
 
-  Mutex input_sync_;
-  pthread_cond_t input_change_;
-  gpio_bits_t gpio_inputs_;
+  // Input changes are announced by incrementing input_sequence_, on which
+  // AwaitInputChange() sleeps.
+  std::atomic<gpio_bits_t> gpio_inputs_;
+  std::atomic<uint32_t> input_sequence_;
+  std::atomic<int> input_waiters_;
 
-  Mutex frame_sync_;
-  pthread_cond_t frame_done_;
-  FrameCanvas *current_frame_;
-  FrameCanvas *next_frame_;
-  unsigned requested_frame_multiple_;
+  FrameSwap<FrameCanvas> frames_;
 };
 
 // Some defaults. See options-initialize.cc for the command line parsing.
@@ -325,10 +411,12 @@ RGBMatrix::Options::Options() :
   limit_refresh_rate_hz(0),
 #endif
 #ifdef DISABLE_BUSY_WAITING
-    disable_busy_waiting(true)
+    disable_busy_waiting(true),
 #else
-    disable_busy_waiting(false)
+    disable_busy_waiting(false),
 #endif
+  multiplex_definition(NULL),
+  metrics_shm_name(NULL)
 {
   // Nothing to see here.
 }
@@ -360,6 +448,8 @@ static void PrintOptions(const RGBMatrix::Options &o) {
   P_STR(panel_type);
   P_INT(limit_refresh_rate_hz);
   P_BOOL(disable_busy_waiting);
+  P_STR(multiplex_definition);
+  P_STR(metrics_shm_name);
 #undef P_INT
 #undef P_STR
 #undef P_BOOL
@@ -367,14 +457,24 @@ static void PrintOptions(const RGBMatrix::Options &o) {
 #endif  // DEBUG_MATRIX_OPTIONS
 
 RGBMatrix::Impl::Impl(GPIO *io, const Options &options)
-  : params_(options), io_(NULL), updater_(NULL), shared_pixel_mapper_(NULL),
-    user_output_bits_(0) {
+  : params_(options), bitplanes_(options.pwm_bits), refresh_brightness_(100),
+    io_(NULL), updater_(NULL), sync_on_swap_(false),
+    shared_pixel_mapper_(NULL), base_pixel_mapper_(NULL),
+    user_output_bits_(0),
+    metrics_(new RefreshMetrics(options.metrics_shm_name)) {
   assert(params_.Validate(NULL));
 #if DEBUG_MATRIX_OPTIONS
   PrintOptions(params_);
 #endif
   const MultiplexMapper *multiplex_mapper = NULL;
-  if (params_.multiplexing > 0) {
+  MultiplexMapper *defined_mapper = NULL;
+  if (params_.multiplex_definition && *params_.multiplex_definition) {
+    std::string err;
+    defined_mapper = CreateMultiplexMapperFromDefinition(
+      params_.multiplex_definition, &err);
+    multiplex_mapper = defined_mapper;  // Validated in Options::Validate().
+  }
+  else if (params_.multiplexing > 0) {
     const MuxMapperList &multiplexers = GetRegisteredMultiplexMappers();
     if (params_.multiplexing <= (int) multiplexers.size()) {
       // TODO: we could also do a find-by-name here, but not sure if worthwhile
@@ -395,11 +495,14 @@ RGBMatrix::Impl::Impl(GPIO *io, const Options &options)
   SetGPIO(io, true);
 
   // We need to apply the mapping for the panels first.
-  ApplyPixelMapper(multiplex_mapper);
+  ApplyPixelMapper(multiplex_mapper, &shared_pixel_mapper_);
+  base_pixel_mapper_ = new PixelDesignatorMap(*shared_pixel_mapper_);
+  delete defined_mapper;
 
   // .. followed by higher level mappers that might arrange panels.
   ApplyNamedPixelMappers(options.pixel_mapper_config,
-                         params_.chain_length, params_.parallel);
+                         params_.chain_length, params_.parallel,
+                         &shared_pixel_mapper_);
 }
 
 RGBMatrix::Impl::~Impl() {
@@ -408,6 +511,7 @@ RGBMatrix::Impl::~Impl() {
     updater_->WaitStopped();
   }
   delete updater_;
+  if (io_) Framebuffer::SetPulseOvershootHistogram(NULL);
 
   // Make sure LEDs are off.
   active_->Clear();
@@ -417,6 +521,8 @@ RGBMatrix::Impl::~Impl() {
     delete created_frames_[i];
   }
   delete shared_pixel_mapper_;
+  delete base_pixel_mapper_;
+  delete metrics_;
 }
 
 RGBMatrix::~RGBMatrix() {
@@ -437,10 +543,12 @@ void RGBMatrix::Impl::OutputGPIO(uint64_t output_bits) {
   io_->WriteMaskedBits(static_cast<gpio_bits_t>(output_bits), static_cast<gpio_bits_t>(user_output_bits_));
 }
 
-void RGBMatrix::Impl::ApplyNamedPixelMappers(const char *pixel_mapper_config,
-                                             int chain, int parallel) {
+bool RGBMatrix::Impl::ApplyNamedPixelMappers(const char *pixel_mapper_config,
+                                             int chain, int parallel,
+                                             PixelDesignatorMap **map) {
   if (pixel_mapper_config == NULL || strlen(pixel_mapper_config) == 0)
-    return;
+    return true;
+  bool success = true;
   char *const writeable_copy = strdup(pixel_mapper_config);
   const char *const end = writeable_copy + strlen(writeable_copy);
   char *s = writeable_copy;
@@ -455,11 +563,15 @@ void RGBMatrix::Impl::ApplyNamedPixelMappers(const char *pixel_mapper_config,
       fprintf(stderr, "Stray parameter ':%s' without mapper name ?\n", optional_param_start);
     }
     if (*s) {
-      ApplyPixelMapper(FindPixelMapper(s, chain, parallel, optional_param_start));
+      const PixelMapper *mapper = FindPixelMapper(s, chain, parallel,
+                                                  optional_param_start);
+      if (mapper == NULL || !ApplyPixelMapper(mapper, map))
+        success = false;
     }
     s = semicolon + 1;
   }
   free(writeable_copy);
+  return success;
 }
 
 void RGBMatrix::Impl::SetGPIO(GPIO *io, bool start_thread) {
@@ -482,7 +594,10 @@ bool RGBMatrix::Impl::StartRefresh() {
     updater_ = new UpdateThread(io_, active_, params_.pwm_dither_bits,
                                 params_.show_refresh_rate,
                                 params_.limit_refresh_rate_hz,
-                                !params_.disable_busy_waiting);
+                                !params_.disable_busy_waiting, metrics_);
+    updater_->SetPulseScale(refresh_brightness_ / 100.0f);
+    Framebuffer::SetPulseOvershootHistogram(
+      metrics_->pending_pulse_overshoot());
     // If we have multiple processors, the kernel
     // jumps around between these, creating some global flicker.
     // So let's tie it to the last CPU available.
@@ -503,7 +618,8 @@ FrameCanvas *RGBMatrix::Impl::CreateFrameCanvas() {
                                     params_.scan_mode,
                                     params_.led_rgb_sequence,
                                     params_.inverse_colors,
-                                    &shared_pixel_mapper_));
+                                    &shared_pixel_mapper_,
+                                    bitplanes_));
   if (created_frames_.empty()) {
     // First time. Get defaults from initial Framebuffer.
     do_luminance_correct_ = result->framebuffer()->luminance_correct();
@@ -514,6 +630,8 @@ FrameCanvas *RGBMatrix::Impl::CreateFrameCanvas() {
   result->framebuffer()->SetBrightness(params_.brightness);
 
   created_frames_.push_back(result);
+  // A new blank frame has nothing in common with what is displayed.
+  stale_rows_.push_back(sync_on_swap_ ? result->framebuffer()->all_rows() : 0);
 
   if (created_frames_.size() % 500 == 0) {
     if (created_frames_.size() == 500) {
@@ -535,11 +653,58 @@ FrameCanvas *RGBMatrix::Impl::SwapOnVSync(FrameCanvas *other,
                                           unsigned frame_fraction) {
   if (frame_fraction == 0) frame_fraction = 1; // correct user error.
   if (!updater_) return NULL;
+  // Done with drawing this one; find what the refresh can skip.
+  if (other) other->framebuffer()->PlanRefresh();
+  const uint64_t start_time_ns = MonotonicNanos();
   FrameCanvas *const previous = updater_->SwapOnVSync(other, frame_fraction);
+  metrics_->AddSwap(MonotonicNanos() - start_time_ns);
   if (other) active_ = other;
+  if (sync_on_swap_ && other && previous != other)
+    SyncSwapped(previous, other);
   return previous;
 }
 
+size_t RGBMatrix::Impl::FrameIndex(const FrameCanvas *frame) const {
+  for (size_t i = 0; i < created_frames_.size(); ++i) {
+    if (created_frames_[i] == frame) return i;
+  }
+  assert(false);  // Only frames created by us are ever swapped.
+  return 0;
+}
+
+void RGBMatrix::Impl::SyncSwapped(FrameCanvas *previous, FrameCanvas *shown) {
+  Framebuffer *const from = shown->framebuffer();
+  Framebuffer *const to = previous->framebuffer();
+  const size_t shown_index = FrameIndex(shown);
+  const size_t previous_index = FrameIndex(previous);
+
+  // The display changed where the new frame was drawn to, where it was
+  // outdated itself, and where the old one was drawn to while shown.
+  const Framebuffer::RowMask changed = from->dirty_rows()
+    | stale_rows_[shown_index] | to->dirty_rows();
+  for (size_t i = 0; i < stale_rows_.size(); ++i) {
+    stale_rows_[i] |= changed;
+  }
+  stale_rows_[shown_index] = 0;
+  from->ClearDirtyRows();
+
+  to->CopyRowsFrom(from, stale_rows_[previous_index]);
+  stale_rows_[previous_index] = 0;
+  to->ClearDirtyRows();
+}
+
+void RGBMatrix::Impl::set_sync_on_swap(bool on) {
+  if (on && !sync_on_swap_) {
+    // We don't know how any frame relates to the displayed one yet.
+    for (size_t i = 0; i < created_frames_.size(); ++i) {
+      stale_rows_[i] = created_frames_[i]->framebuffer()->all_rows();
+    }
+    stale_rows_[FrameIndex(active_)] = 0;
+    active_->framebuffer()->ClearDirtyRows();
+  }
+  sync_on_swap_ = on;
+}
+
 uint64_t RGBMatrix::Impl::AwaitInputChange(int timeout_ms) {
   if (!updater_) return 0;
   return updater_->AwaitInputChange(timeout_ms);
@@ -570,39 +735,141 @@ void RGBMatrix::Impl::SetBrightness(uint8_t brightness) {
   params_.brightness = brightness;
 }
 
+void RGBMatrix::Impl::SetRefreshBrightness(float percent) {
+  percent = (percent <= 100 ? (percent > 0 ? percent : 0) : 100);
+  refresh_brightness_ = percent;
+  if (updater_) updater_->SetPulseScale(percent / 100.0f);
+}
+
 uint8_t RGBMatrix::Impl::brightness() {
   return params_.brightness;
 }
 
 bool RGBMatrix::Impl::ApplyPixelMapper(const PixelMapper *mapper) {
   if (mapper == NULL) return true;
-  using internal::PixelDesignatorMap;
-  const int old_width = shared_pixel_mapper_->width();
-  const int old_height = shared_pixel_mapper_->height();
+  Remapping remapping;
+  if (!GetRemapping(mapper, shared_pixel_mapper_->width(),
+                    shared_pixel_mapper_->height(), &remapping)) {
+    return false;
+  }
+  ApplyRemapping(remapping, &shared_pixel_mapper_);
+  applied_remappings_.push_back(remapping);
+  return true;
+}
+
+bool RGBMatrix::Impl::GetRemapping(const PixelMapper *mapper,
+                                   int width, int height,
+                                   Remapping *remapping) {
   int new_width, new_height;
-  if (!mapper->GetSizeMapping(old_width, old_height, &new_width, &new_height)) {
+  if (!mapper->GetSizeMapping(width, height, &new_width, &new_height)) {
     return false;
   }
-  PixelDesignatorMap *new_mapper = new PixelDesignatorMap(
-    new_width, new_height, shared_pixel_mapper_->GetFillColorBits());
+  remapping->from_width = width;
+  remapping->from_height = height;
+  remapping->width = new_width;
+  remapping->height = new_height;
+  remapping->source.assign(new_width * new_height, -1);
   for (int y = 0; y < new_height; ++y) {
     for (int x = 0; x < new_width; ++x) {
       int orig_x = -1, orig_y = -1;
-      mapper->MapVisibleToMatrix(old_width, old_height,
-                                 x, y, &orig_x, &orig_y);
-      if (orig_x < 0 || orig_y < 0 ||
-          orig_x >= old_width || orig_y >= old_height) {
+      mapper->MapVisibleToMatrix(width, height, x, y, &orig_x, &orig_y);
+      if (orig_x < 0 || orig_y < 0 || orig_x >= width || orig_y >= height) {
         fprintf(stderr, "Error in PixelMapper: (%d, %d) -> (%d, %d) [range: "
-                "%dx%d]\n", x, y, orig_x, orig_y, old_width, old_height);
+                "%dx%d]\n", x, y, orig_x, orig_y, width, height);
         continue;
       }
-      const internal::PixelDesignator *orig_designator;
-      orig_designator = shared_pixel_mapper_->get(orig_x, orig_y);
-      *new_mapper->get(x, y) = *orig_designator;
+      remapping->source[y * new_width + x] = orig_y * width + orig_x;
     }
   }
-  delete shared_pixel_mapper_;
-  shared_pixel_mapper_ = new_mapper;
+  return true;
+}
+
+void RGBMatrix::Impl::ApplyRemapping(const Remapping &remapping,
+                                     PixelDesignatorMap **map) {
+  const PixelDesignatorMap *const old_map = *map;
+  assert(old_map->width() == remapping.from_width
+         && old_map->height() == remapping.from_height);
+  PixelDesignatorMap *new_mapper = new PixelDesignatorMap(
+    remapping.width, remapping.height, old_map->GetFillColorBits());
+  for (int y = 0; y < remapping.height; ++y) {
+    for (int x = 0; x < remapping.width; ++x) {
+      const int source = remapping.source[y * remapping.width + x];
+      if (source < 0) continue;
+      internal::PixelDesignator designator;
+      if (old_map->Get(source % remapping.from_width,
+                       source / remapping.from_width, &designator))
+        new_mapper->Set(x, y, designator);
+    }
+  }
+  new_mapper->Finish();
+  delete old_map;
+  *map = new_mapper;
+}
+
+bool RGBMatrix::Impl::ApplyPixelMapper(const PixelMapper *mapper,
+                                       PixelDesignatorMap **map) {
+  if (mapper == NULL) return true;
+  Remapping remapping;
+  if (!GetRemapping(mapper, (*map)->width(), (*map)->height(), &remapping))
+    return false;
+  ApplyRemapping(remapping, map);
+  return true;
+}
+
+bool RGBMatrix::Impl::SetPixelMapperConfig(const char *pixel_mapper_config) {
+  PixelDesignatorMap *new_map = new PixelDesignatorMap(*base_pixel_mapper_);
+  if (!ApplyNamedPixelMappers(pixel_mapper_config,
+                              params_.chain_length, params_.parallel,
+                              &new_map)) {
+    delete new_map;
+    return false;
+  }
+  for (size_t i = 0; i < applied_remappings_.size(); ++i) {
+    const Remapping &remapping = applied_remappings_[i];
+    if (new_map->width() != remapping.from_width
+        || new_map->height() != remapping.from_height) {
+      fprintf(stderr, "Can't apply the pixel mapper passed to "
+              "ApplyPixelMapper() for %dx%d again on %dx%d from \"%s\"\n",
+              remapping.from_width, remapping.from_height,
+              new_map->width(), new_map->height(), pixel_mapper_config);
+      delete new_map;
+      return false;
+    }
+    ApplyRemapping(remapping, &new_map);
+  }
+  const PixelDesignatorMap *const old_map = shared_pixel_mapper_;
+
+  // All canvases are re-arranged for the new mapping using a temporary
+  // framebuffer. The active one is re-arranged into the temporary first,
+  // which is shown while the active canvas is updated, so that the display
+  // never goes blank.
+  FrameCanvas *const scratch = new FrameCanvas(
+    new Framebuffer(params_.rows, params_.cols * params_.chain_length,
+                    params_.parallel, params_.scan_mode,
+                    params_.led_rgb_sequence, params_.inverse_colors,
+                    &shared_pixel_mapper_, bitplanes_));
+  Framebuffer *const scratch_buffer = scratch->framebuffer();
+  scratch_buffer->SetPWMBits(active_->framebuffer()->pwmbits());
+  scratch_buffer->CopyRemapped(active_->framebuffer(), *old_map, *new_map);
+  if (updater_) updater_->SwapOnVSync(scratch, 1);
+  active_->framebuffer()->CopyFrom(scratch_buffer);
+  if (updater_) updater_->SwapOnVSync(active_, 1);
+  for (size_t i = 0; i < created_frames_.size(); ++i) {
+    Framebuffer *const frame = created_frames_[i]->framebuffer();
+    if (created_frames_[i] == active_) continue;
+    scratch_buffer->CopyRemapped(frame, *old_map, *new_map);
+    frame->CopyFrom(scratch_buffer);
+  }
+  delete scratch;
+
+  shared_pixel_mapper_ = new_map;
+  delete old_map;
+
+  if (sync_on_swap_) {
+    // Start over, as if sync was just switched on.
+    sync_on_swap_ = false;
+    set_sync_on_swap(true);
+  }
   return true;
 }
 
@@ -721,6 +988,12 @@ FrameCanvas *RGBMatrix::SwapOnVSync(FrameCanvas *other,
 bool RGBMatrix::ApplyPixelMapper(const PixelMapper *mapper) {
   return impl_->ApplyPixelMapper(mapper);
 }
+bool RGBMatrix::SetPixelMapperConfig(const char *pixel_mapper_config) {
+  return impl_->SetPixelMapperConfig(pixel_mapper_config);
+}
+void RGBMatrix::set_sync_on_swap(bool on) { impl_->set_sync_on_swap(on); }
+bool RGBMatrix::sync_on_swap() const { return impl_->sync_on_swap(); }
+
 bool RGBMatrix::SetPWMBits(uint8_t value) { return impl_->SetPWMBits(value); }
 uint8_t RGBMatrix::pwmbits() { return impl_->pwmbits(); }
 
@@ -734,6 +1007,13 @@ void RGBMatrix::SetBrightness(uint8_t brightness) {
 }
 uint8_t RGBMatrix::brightness() { return impl_->brightness(); }
 
+void RGBMatrix::SetRefreshBrightness(float percent) {
+  impl_->SetRefreshBrightness(percent);
+}
+float RGBMatrix::refresh_brightness() const {
+  return impl_->refresh_brightness();
+}
+
 uint64_t RGBMatrix::RequestInputs(uint64_t all_interested_bits) {
   return impl_->RequestInputs(all_interested_bits);
 }
@@ -748,6 +1028,10 @@ void RGBMatrix::OutputGPIO(uint64_t output_bits) {
   impl_->OutputGPIO(output_bits);
 }
 
+bool RGBMatrix::GetRefreshMetrics(RGBLedRefreshMetrics *metrics) const {
+  return impl_->GetRefreshMetrics(metrics);
+}
+
 bool RGBMatrix::StartRefresh() { return impl_->StartRefresh(); }
 
 // -- Implementation of RGBMatrix Canvas: delegation to ContentBuffer
@@ -789,6 +1073,7 @@ void FrameCanvas::Fill(uint8_t red, uint8_t green, uint8_t blue) {
 }
 bool FrameCanvas::SetPWMBits(uint8_t value) { return frame_->SetPWMBits(value); }
 uint8_t FrameCanvas::pwmbits() { return frame_->pwmbits(); }
+int FrameCanvas::bitplanes() const { return frame_->bitplanes(); }
 
 // Map brightness of output linearly to input with CIE1931 profile.
 void FrameCanvas::set_luminance_correct(bool on) { frame_->set_luminance_correct(on); }
@@ -803,6 +1088,20 @@ void FrameCanvas::Serialize(const char **data, size_t *len) const {
 bool FrameCanvas::Deserialize(const char *data, size_t len) {
   return frame_->Deserialize(data, len);
 }
+void FrameCanvas::SetYUVImage(int x, int y, int width, int height,
+                              const YUVImage &image) {
+  frame_->SetYUVImage(x, y, width, height, image);
+}
+void FrameCanvas::SetPixelData(int x, int y, int width, int height,
+                               const uint8_t *data, int row_stride,
+                               int pixel_stride, int red_offset,
+                               int green_offset, int blue_offset) {
+  frame_->SetPixelData(x, y, width, height, data, row_stride, pixel_stride,
+                       red_offset, green_offset, blue_offset);
+}
+bool FrameCanvas::DeserializeView(const char *data, size_t len) {
+  return frame_->SetView(data, len);
+}
 void FrameCanvas::CopyFrom(const FrameCanvas &other) {
   frame_->CopyFrom(other.frame_);
 }
@@ -13,6 +13,7 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
 
+#include <string>
 #include <vector>
 
 #include "pixel-mapper.h"
@@ -34,5 +35,19 @@ public:
 typedef std::vector<const MultiplexMapper*> MuxMapperList;
 const MuxMapperList &GetRegisteredMultiplexMappers();
 
+// Create a multiplex mapper from a declarative definition instead of code,
+// see "Multiplex definitions" in the README. Returns NULL and appends a
+// description of the problem to "err" if the definition can't be parsed.
+// The caller takes ownership of the returned mapper.
+MultiplexMapper *CreateMultiplexMapperFromDefinition(const char *definition,
+                                                     std::string *err);
+
+// Check that "mapper" arranges the pixels of a panel with "cols" x "rows"
+// as seen by the user bijectively onto the multiplexed panel: each of them
+// lands inside the panel, and no two on the same spot. Returns false and
+// appends a description of the first problems to "err" otherwise.
+bool ValidateMultiplexMapper(const MultiplexMapper &mapper, int cols, int rows,
+                             std::string *err);
+
 }  // namespace internal
 }  // namespace rgb_matrix
@@ -15,6 +15,10 @@
 
 #include "multiplex-mappers-internal.h"
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 namespace rgb_matrix {
 namespace internal {
 // A Pixel Mapper maps physical pixels locations to the internal logical
@@ -494,6 +498,223 @@ public:
 };
 
 
+/*
+ * Multiplexer described by a table, typically read from a definition file.
+ *
+ * The panel is made of tiles of "tile_width" x "tile_height" visible pixels.
+ * For each pixel of the first tile, the table contains its position in the
+ * multiplexed panel; other tiles are at the same positions, offset by
+ * "step_x" and "step_y" for each tile to the right or further down.
+ */
+class TableMultiplexMapper : public MultiplexMapperBase {
+public:
+  struct Position { int x, y; };
+
+  TableMultiplexMapper(const std::string &name, int stretch_factor,
+                       int tile_width, int tile_height, int step_x, int step_y,
+                       const std::vector<Position> &table)
+    : MultiplexMapperBase(NULL, stretch_factor), table_name_(name),
+      tile_width_(tile_width), tile_height_(tile_height),
+      step_x_(step_x), step_y_(step_y), table_(table) {}
+
+  virtual const char *GetName() const { return table_name_.c_str(); }
+
+  void MapSinglePanel(int x, int y, int *matrix_x, int *matrix_y) const {
+    const Position &p
+      = table_[(y % tile_height_) * tile_width_ + x % tile_width_];
+    *matrix_x = p.x + (x / tile_width_) * step_x_;
+    *matrix_y = p.y + (y / tile_height_) * step_y_;
+  }
+
+private:
+  const std::string table_name_;
+  const int tile_width_;
+  const int tile_height_;
+  const int step_x_;
+  const int step_y_;
+  const std::vector<Position> table_;
+};
+
+// Parse "<x>,<y>" position.
+static bool ParsePosition(const char *s, TableMultiplexMapper::Position *pos) {
+  char *end;
+  pos->x = strtol(s, &end, 10);
+  if (end == s || *end != ',') return false;
+  s = end + 1;
+  pos->y = strtol(s, &end, 10);
+  return end != s && *end == '\0';
+}
+
+static bool ParsePositiveInt(const char *s, int *result) {
+  char *end;
+  const long value = strtol(s, &end, 10);
+  if (end == s || *end != '\0' || value < 1 || value > 1024) return false;
+  *result = value;
+  return true;
+}
+
+MultiplexMapper *CreateMultiplexMapperFromDefinition(const char *definition,
+                                                     std::string *err) {
+  std::string name = "custom";
+  int stretch = 0, tile_width = 0, tile_height = 0;
+  int step_x = 0, step_y = 0;
+  bool has_step = false;
+  std::vector<TableMultiplexMapper::Position> table;
+  int rows_seen = 0;
+
+  // Statements are separated by newlines or semicolons; '#' starts a
+  // comment up to the end of the line.
+  int line_no = 1;
+  char buffer[128];
+  for (const char *line = definition; *line; ++line_no) {
+    const char *const line_end = strchrnul(line, '\n');
+    const char *const comment = (const char*)memchr(line, '#', line_end - line);
+    std::string statement_line(line, comment ? comment : line_end);
+    line = *line_end ? line_end + 1 : line_end;
+
+    char *const writeable = &statement_line[0];
+    char *save_statement = NULL;
+    for (char *statement = strtok_r(writeable, ";", &save_statement);
+         statement != NULL;
+         statement = strtok_r(NULL, ";", &save_statement)) {
+      std::vector<const char*> words;
+      char *save_word = NULL;
+      for (char *w = strtok_r(statement, " \t\r", &save_word); w != NULL;
+           w = strtok_r(NULL, " \t\r", &save_word)) {
+        words.push_back(w);
+      }
+      if (words.empty()) continue;
+      const char *const keyword = words[0];
+      const size_t args = words.size() - 1;
+      const char *problem = NULL;
+      if (strcmp(keyword, "name") == 0 && args == 1) {
+        name = words[1];
+      }
+      else if (strcmp(keyword, "stretch") == 0 && args == 1) {
+        if (!ParsePositiveInt(words[1], &stretch))
+          problem = "invalid stretch factor";
+      }
+      else if (strcmp(keyword, "tile") == 0 && args == 2) {
+        if (rows_seen > 0)
+          problem = "tile size needs to be given before the rows";
+        else if (!ParsePositiveInt(words[1], &tile_width)
+                 || !ParsePositiveInt(words[2], &tile_height))
+          problem = "invalid tile size";
+      }
+      else if (strcmp(keyword, "step") == 0 && args == 2) {
+        char *end_x, *end_y;
+        step_x = strtol(words[1], &end_x, 10);
+        step_y = strtol(words[2], &end_y, 10);
+        if (*end_x != '\0' || *end_y != '\0')
+          problem = "invalid step";
+        has_step = true;
+      }
+      else if (strcmp(keyword, "row") == 0 && args >= 1) {
+        const bool is_run = (args == 1
+                             || (args == 2 && (strcmp(words[2], "+") == 0
+                                               || strcmp(words[2], "-") == 0)));
+        TableMultiplexMapper::Position pos;
+        if (tile_width == 0) {
+          problem = "tile size needs to be given before the rows";
+        } else if (rows_seen == tile_height) {
+          problem = "more rows than the tile is high";
+        } else if (is_run) {
+          // Run of consecutive matrix pixels, to the right or left.
+          const int direction = (args == 2 && words[2][0] == '-') ? -1 : 1;
+          if (!ParsePosition(words[1], &pos))
+            problem = "invalid position";
+          for (int i = 0; problem == NULL && i < tile_width; ++i) {
+            const TableMultiplexMapper::Position p
+              = { pos.x + direction * i, pos.y };
+            table.push_back(p);
+          }
+        } else if ((int)args == tile_width) {
+          for (size_t i = 1; problem == NULL && i <= args; ++i) {
+            if (!ParsePosition(words[i], &pos))
+              problem = "invalid position";
+            table.push_back(pos);
+          }
+        } else {
+          problem = "expected a start position or one for each pixel";
+        }
+        ++rows_seen;
+      }
+      else {
+        problem = "unknown statement or wrong number of parameters";
+      }
+      if (problem) {
+        snprintf(buffer, sizeof(buffer), "Multiplex definition line %d: ",
+                 line_no);
+        err->append(buffer).append(problem).append(" ('")
+          .append(keyword).append("')\n");
+        return NULL;
+      }
+    }
+  }
+
+  if (stretch == 0 || tile_width == 0) {
+    err->append("Multiplex definition needs a 'stretch' and 'tile' size.\n");
+    return NULL;
+  }
+  if (rows_seen != tile_height) {
+    snprintf(buffer, sizeof(buffer), "%d", tile_height);
+    err->append("Multiplex definition needs one 'row' for each of the ")
+      .append(buffer).append(" rows of the tile.\n");
+    return NULL;
+  }
+  if (!has_step) {
+    // Natural default: each tile takes its space in the stretched panel.
+    step_x = tile_width * stretch;
+    step_y = tile_height / stretch;
+  }
+  return new TableMultiplexMapper(name, stretch, tile_width, tile_height,
+                                  step_x, step_y, table);
+}
+
+bool ValidateMultiplexMapper(const MultiplexMapper &mapper, int cols, int rows,
+                             std::string *err) {
+  int matrix_cols = cols, matrix_rows = rows;
+  mapper.EditColsRows(&matrix_cols, &matrix_rows);
+  int visible_width, visible_height;
+  if (!mapper.GetSizeMapping(matrix_cols, matrix_rows,
+                             &visible_width, &visible_height)
+      || visible_width != cols || visible_height != rows
+      || matrix_cols * matrix_rows != cols * rows) {
+    err->append("Multiplexer ").append(mapper.GetName())
+      .append(" can't be used with this panel size.\n");
+    return false;
+  }
+
+  // Visible pixel that maps to each matrix pixel, or -1.
+  std::vector<int> mapped_from(matrix_cols * matrix_rows, -1);
+  char buffer[256];
+  int errors = 0;
+  for (int y = 0; y < rows; ++y) {
+    for (int x = 0; x < cols; ++x) {
+      int mx = -1, my = -1;
+      mapper.MapVisibleToMatrix(matrix_cols, matrix_rows, x, y, &mx, &my);
+      if (mx < 0 || my < 0 || mx >= matrix_cols || my >= matrix_rows) {
+        snprintf(buffer, sizeof(buffer), "Multiplexer %s: pixel (%d, %d) "
+                 "maps to (%d, %d), outside of the %dx%d panel.\n",
+                 mapper.GetName(), x, y, mx, my, matrix_cols, matrix_rows);
+        err->append(buffer);
+      } else if (mapped_from[my * matrix_cols + mx] >= 0) {
+        const int other = mapped_from[my * matrix_cols + mx];
+        snprintf(buffer, sizeof(buffer), "Multiplexer %s: pixels (%d, %d) "
+                 "and (%d, %d) both map to (%d, %d).\n", mapper.GetName(),
+                 other % cols, other / cols, x, y, mx, my);
+        err->append(buffer);
+      } else {
+        mapped_from[my * matrix_cols + mx] = y * cols + x;
+        continue;
+      }
+      if (++errors == 5) return false;  // Enough to get the idea.
+    }
+  }
+  return errors == 0;
+}
+
+
 /*
  * Here is where the registration happens.
  * If you add an instance of the mapper here, it will automatically be
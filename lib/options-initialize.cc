@@ -130,6 +130,24 @@ static bool ConsumeStringFlag(const char *flag_name,
   return true;
 }
 
+// Read the whole file into an allocated string.
+static bool ReadFile(const char *filename, const char **content) {
+  FILE *f = fopen(filename, "r");
+  if (f == NULL) {
+    perror(filename);
+    return false;
+  }
+  std::string data;
+  char buffer[4096];
+  size_t r;
+  while ((r = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    data.append(buffer, r);
+  }
+  fclose(f);
+  *content = strdup(data.c_str());  // Leaks like other string flags.
+  return true;
+}
+
 static bool FlagInit(int &argc, char **&argv,
                      RGBMatrix::Options *mopts,
                      RuntimeOptions *ropts,
@@ -158,6 +176,17 @@ static bool FlagInit(int &argc, char **&argv,
       if (ConsumeStringFlag("panel-type", it, end,
                             &mopts->panel_type, &err))
         continue;
+      if (ConsumeStringFlag("metrics-shm", it, end,
+                            &mopts->metrics_shm_name, &err))
+        continue;
+      const char *multiplex_file = NULL;
+      if (ConsumeStringFlag("multiplex-file", it, end, &multiplex_file, &err)) {
+        if (multiplex_file != NULL
+            && !ReadFile(multiplex_file, &mopts->multiplex_definition)) {
+          ++err;
+        }
+        continue;
+      }
       if (ConsumeIntFlag("rows", it, end, &mopts->rows, &err))
         continue;
       if (ConsumeIntFlag("cols", it, end, &mopts->cols, &err))
@@ -323,6 +352,8 @@ void PrintMatrixFlags(FILE *out, const RGBMatrix::Options &d,
 #endif
           "(Default: %d).\n"
           "\t--led-multiplexing=<0..%d> : Mux type: 0=direct; %s (Default: 0)\n"
+          "\t--led-multiplex-file=<file> : Multiplexing for other panels, "
+          "as defined in file.\n"
           "\t--led-pixel-mapper        : Semicolon-separated list of pixel-mappers to arrange pixels.\n"
           "\t                            Optional params after a colon e.g. \"U-mapper;Rotate:90\"\n"
           "\t                            Available: %s. Default: \"\"\n"
@@ -335,6 +366,7 @@ void PrintMatrixFlags(FILE *out, const RGBMatrix::Options &d,
           "\t--led-%sshow-refresh        : %show refresh rate.\n"
           "\t--led-limit-refresh=<Hz>  : Limit refresh rate to this frequency in Hz. Useful to keep a\n"
           "\t                            constant refresh rate on loaded system. 0=no limit. Default: %d\n"
+          "\t--led-metrics-shm=<name>  : Publish refresh metrics in shared memory /dev/shm/<name>.\n"
           "\t--led-%sinverse             "
           ": Switch if your matrix has inverse colors %s.\n"
           "\t--led-rgb-sequence        : Switch if your matrix has led colors "
@@ -350,7 +382,7 @@ void PrintMatrixFlags(FILE *out, const RGBMatrix::Options &d,
           d.rows, d.cols, d.chain_length, d.parallel,
           (int) muxers.size(), CreateAvailableMultiplexString(muxers).c_str(),
           available_mappers.c_str(),
-          internal::Framebuffer::kBitPlanes, d.pwm_bits,
+          internal::Framebuffer::kMaxBitPlanes, d.pwm_bits,
           d.brightness, d.scan_mode,
           d.show_refresh_rate ? "no-" : "", d.show_refresh_rate ? "Don't s" : "S",
           d.limit_refresh_rate_hz,
@@ -419,6 +451,25 @@ bool RGBMatrix::Options::Validate(std::string *err_in) const {
     success = false;
   }
 
+  if (multiplex_definition != NULL && *multiplex_definition) {
+    internal::MultiplexMapper *mapper
+      = internal::CreateMultiplexMapperFromDefinition(multiplex_definition,
+                                                      err);
+    if (mapper == NULL) {
+      success = false;
+    } else {
+      if (multiplexing != 0) {
+        err->append("Either use multiplexing or a multiplex definition.\n");
+        success = false;
+      }
+      if (rows >= 8 && cols >= 16
+          && !internal::ValidateMultiplexMapper(*mapper, cols, rows, err)) {
+        success = false;
+      }
+      delete mapper;
+    }
+  }
+
   if (row_address_type < 0 || row_address_type > 5) {
     err->append("Row address type values can be 0 (default), 1 (AB addressing), 2 (direct row select), 3 (ABC address), 4 (ABC Shift + DE direct), 5 (Test row select).\n");
     success = false;
@@ -443,11 +494,11 @@ bool RGBMatrix::Options::Validate(std::string *err_in) const {
     success = false;
   }
 
-  if (pwm_bits <= 0 || pwm_bits > internal::Framebuffer::kBitPlanes) {
+  if (pwm_bits <= 0 || pwm_bits > internal::Framebuffer::kMaxBitPlanes) {
     char buffer[256];
     snprintf(buffer, sizeof(buffer),
              "Invalid range of pwm-bits (1..%d allowed).\n",
-             internal::Framebuffer::kBitPlanes);
+             internal::Framebuffer::kMaxBitPlanes);
     err->append(buffer);
     success = false;
   }
@@ -0,0 +1,88 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Recording side of the refresh metrics (see include/refresh-metrics.h).
+
+#ifndef RPI_REFRESH_METRICS_INTERNAL_H
+#define RPI_REFRESH_METRICS_INTERNAL_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "refresh-metrics.h"
+#include "thread.h"
+
+namespace rgb_matrix {
+namespace internal {
+inline uint64_t MonotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+inline void AddToHistogram(RGBLedHistogram *h, uint64_t nanos) {
+  const int bucket = (nanos < 2) ? 0 : 63 - __builtin_clzll(nanos);
+  ++h->bucket[bucket < RGB_HISTOGRAM_BUCKETS
+              ? bucket : RGB_HISTOGRAM_BUCKETS - 1];
+  ++h->count;
+  h->sum_ns += nanos;
+  if (nanos > h->max_ns) h->max_ns = nanos;
+}
+
+// Owns the RGBLedRefreshMetrics, in process memory or in shared memory,
+// and updates them following the sequence protocol.
+class RefreshMetrics {
+public:
+  // If "shm_name" is not NULL or empty, metrics are kept in the POSIX
+  // shared memory object of that name, which is removed again in the
+  // destructor. If that can't be created, prints a warning and falls back
+  // to process memory.
+  explicit RefreshMetrics(const char *shm_name);
+  ~RefreshMetrics();
+
+  // A consistent copy of the current values. If none could be taken
+  // because the writer didn't finish an update in time, "out" is zeroed
+  // and false is returned.
+  bool Snapshot(RGBLedRefreshMetrics *out) const;
+
+  // -- Refresh thread.
+
+  // Output enable pulse overshoot. Collected here while the frame is
+  // refreshed and published with the frame in AddFrame().
+  RGBLedHistogram *pending_pulse_overshoot() { return &pending_overshoot_; }
+
+  // Publish a refreshed frame. "bitplane_nanos" has the time per bitplane
+  // for the ones shown, [first_bitplane, end_bitplane).
+  void AddFrame(uint64_t frame_nanos, uint64_t dump_nanos,
+                const uint64_t *bitplane_nanos,
+                int first_bitplane, int end_bitplane,
+                unsigned dropped_swaps, uint64_t end_time_nanos);
+
+  // -- SwapOnVSync() callers, any thread.
+  void AddSwap(uint64_t wait_nanos);
+
+private:
+  static void BeginUpdate(uint32_t *sequence);
+  static void EndUpdate(uint32_t *sequence);
+
+  RGBLedRefreshMetrics *metrics_;
+  char *shm_name_;   // Set if metrics_ are shared memory.
+  RGBLedHistogram pending_overshoot_;
+  Mutex swap_mutex_;
+};
+}  // namespace internal
+}  // namespace rgb_matrix
+
+#endif  // RPI_REFRESH_METRICS_INTERNAL_H
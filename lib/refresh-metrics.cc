@@ -0,0 +1,140 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "refresh-metrics-internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+
+namespace rgb_matrix {
+namespace internal {
+static void MergeHistogram(const RGBLedHistogram &from, RGBLedHistogram *to) {
+  for (int i = 0; i < RGB_HISTOGRAM_BUCKETS; ++i)
+    to->bucket[i] += from.bucket[i];
+  to->count += from.count;
+  to->sum_ns += from.sum_ns;
+  if (from.max_ns > to->max_ns) to->max_ns = from.max_ns;
+}
+
+static RGBLedRefreshMetrics *MapSharedMemory(const char *name) {
+  // shm_open() wants a leading slash, but people might not know.
+  std::string path = (name[0] == '/') ? "" : "/";
+  path.append(name);
+  const int fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "Can't create refresh metrics shared memory %s: %s\n",
+            path.c_str(), strerror(errno));
+    return NULL;
+  }
+  void *mem = MAP_FAILED;
+  if (ftruncate(fd, sizeof(RGBLedRefreshMetrics)) == 0) {
+    mem = mmap(NULL, sizeof(RGBLedRefreshMetrics), PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+  }
+  if (mem == MAP_FAILED) {
+    fprintf(stderr, "Can't map refresh metrics shared memory %s: %s\n",
+            path.c_str(), strerror(errno));
+    shm_unlink(path.c_str());
+  }
+  close(fd);
+  return (mem == MAP_FAILED) ? NULL : (RGBLedRefreshMetrics*) mem;
+}
+
+RefreshMetrics::RefreshMetrics(const char *shm_name)
+  : metrics_(NULL), shm_name_(NULL) {
+  if (shm_name && *shm_name) {
+    metrics_ = MapSharedMemory(shm_name);
+    if (metrics_) shm_name_ = strdup(shm_name);
+  }
+  if (metrics_ == NULL)
+    metrics_ = new RGBLedRefreshMetrics();
+  memset(metrics_, 0, sizeof(*metrics_));
+  memset(&pending_overshoot_, 0, sizeof(pending_overshoot_));
+  metrics_->version = RGB_REFRESH_METRICS_VERSION;
+  metrics_->size = sizeof(RGBLedRefreshMetrics);
+  metrics_->pid = getpid();
+  // Readers only look at the rest once the magic is there.
+  __atomic_store_n(&metrics_->magic, RGB_REFRESH_METRICS_MAGIC,
+                   __ATOMIC_RELEASE);
+}
+
+RefreshMetrics::~RefreshMetrics() {
+  if (shm_name_) {
+    std::string path = (shm_name_[0] == '/') ? "" : "/";
+    path.append(shm_name_);
+    shm_unlink(path.c_str());
+    munmap(metrics_, sizeof(RGBLedRefreshMetrics));
+    free(shm_name_);
+  } else {
+    delete metrics_;
+  }
+}
+
+bool RefreshMetrics::Snapshot(RGBLedRefreshMetrics *out) const {
+  if (rgb_refresh_metrics_read(metrics_, out)) return true;
+  memset(out, 0, sizeof(*out));
+  return false;
+}
+
+// Sequence lock: odd while writing. Readers retry if they saw an odd
+// value or it changed while they copied.
+void RefreshMetrics::BeginUpdate(uint32_t *sequence) {
+  __atomic_store_n(sequence, *sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void RefreshMetrics::EndUpdate(uint32_t *sequence) {
+  __atomic_store_n(sequence, *sequence + 1, __ATOMIC_RELEASE);
+}
+
+void RefreshMetrics::AddFrame(uint64_t frame_nanos, uint64_t dump_nanos,
+                              const uint64_t *bitplane_nanos,
+                              int first_bitplane, int end_bitplane,
+                              unsigned dropped_swaps,
+                              uint64_t end_time_nanos) {
+  BeginUpdate(&metrics_->refresh_sequence);
+  metrics_->pwm_bits = end_bitplane - first_bitplane;
+  ++metrics_->frames;
+  metrics_->last_frame_ns = end_time_nanos;
+  AddToHistogram(&metrics_->frame_time, frame_nanos);
+  AddToHistogram(&metrics_->dump_time, dump_nanos);
+  for (int b = first_bitplane; b < end_bitplane; ++b) {
+    AddToHistogram(&metrics_->bitplane_time[b], bitplane_nanos[b]);
+  }
+  if (pending_overshoot_.count) {
+    MergeHistogram(pending_overshoot_, &metrics_->pulse_overshoot);
+    memset(&pending_overshoot_, 0, sizeof(pending_overshoot_));
+  }
+  metrics_->dropped_swaps += dropped_swaps;
+  EndUpdate(&metrics_->refresh_sequence);
+}
+
+void RefreshMetrics::AddSwap(uint64_t wait_nanos) {
+  MutexLock l(&swap_mutex_);
+  BeginUpdate(&metrics_->swap_sequence);
+  ++metrics_->swaps;
+  AddToHistogram(&metrics_->swap_wait, wait_nanos);
+  EndUpdate(&metrics_->swap_sequence);
+}
+}  // namespace internal
+}  // namespace rgb_matrix
@@ -0,0 +1,121 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Checks that the bulk encoder behind SetPixels() (vectorized where the
+// CPU allows) produces exactly the same bitplane buffer as setting every
+// pixel with SetPixel(), for all PWM bits, inverse colors and luminance
+// correction, and for rows of odd widths that are clipped at the edges.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include "framebuffer-internal.h"
+#include "gpio-trace.h"
+#include "gpio.h"
+#include "graphics.h"
+
+using rgb_matrix::Color;
+using rgb_matrix::GPIO;
+using rgb_matrix::GPIOTrace;
+using rgb_matrix::internal::Framebuffer;
+using rgb_matrix::internal::PixelDesignatorMap;
+
+static const int kRows = 32;
+static const int kParallel = 2;
+
+static bool SameBuffer(const Framebuffer &a, const Framebuffer &b) {
+  const char *a_data, *b_data;
+  size_t a_len, b_len;
+  a.Serialize(&a_data, &a_len);
+  b.Serialize(&b_data, &b_len);
+  return a_len == b_len && memcmp(a_data, b_data, a_len) == 0;
+}
+
+// Write a block of random colors at (x, y) with both paths; return if
+// the results match.
+static bool CheckBlock(Framebuffer *bulk, Framebuffer *single,
+                       int x, int y, int width, int height) {
+  std::vector<Color> colors(width * height);
+  for (size_t i = 0; i < colors.size(); ++i) {
+    const int r = rand();
+    colors[i] = Color(r, r >> 8, r >> 16);
+  }
+  bulk->SetPixels(x, y, width, height, colors.data());
+  for (int iy = 0; iy < height; ++iy) {
+    for (int ix = 0; ix < width; ++ix) {
+      const Color &c = colors[iy * width + ix];
+      single->SetPixel(x + ix, y + iy, c.r, c.g, c.b);
+    }
+  }
+  return SameBuffer(*bulk, *single);
+}
+
+int main(int argc, char *argv[]) {
+  GPIOTrace trace;
+  GPIO io;
+  io.InitSoftware(&trace);
+  Framebuffer::InitHardwareMapping("regular");
+  Framebuffer::InitGPIO(&io, kRows, kParallel, false, 130, 0, 0);
+
+  static const int kBitPlanes[] = { 4, Framebuffer::kDefaultBitPlanes,
+                                    Framebuffer::kMaxBitPlanes };
+  static const int kColumns[] = { 32, 37, 64 };
+  static const int kWidths[] = { 1, 3, 5, 7, 13, 31, 33, 67 };
+
+  srand(42);
+  int checks = 0, failures = 0;
+  for (int bitplanes : kBitPlanes) {
+    for (int columns : kColumns) {
+      for (int pwm_bits = 1; pwm_bits <= bitplanes; ++pwm_bits) {
+        for (int inverse = 0; inverse < 2; ++inverse) {
+          for (int luminance = 0; luminance < 2; ++luminance) {
+            PixelDesignatorMap *mapper = NULL;
+            Framebuffer bulk(kRows, columns, kParallel, 0, "RGB", inverse,
+                             &mapper, bitplanes);
+            Framebuffer single(kRows, columns, kParallel, 0, "RGB", inverse,
+                               &mapper, bitplanes);
+            Framebuffer *const frames[] = { &bulk, &single };
+            for (Framebuffer *f : frames) {
+              f->SetPWMBits(pwm_bits);
+              f->set_luminance_correct(luminance);
+            }
+            for (int width : kWidths) {
+              // Inside, and overlapping the left, right and bottom edges.
+              const int xs[] = { 0, 1, -2, columns - width / 2 };
+              for (int x : xs) {
+                const int y = (x + width) % (kRows * kParallel) - 1;
+                ++checks;
+                if (CheckBlock(&bulk, &single, x, y, width, 3))
+                  continue;
+                ++failures;
+                fprintf(stderr, "Mismatch: bitplanes=%d columns=%d "
+                        "pwm_bits=%d inverse=%d luminance=%d "
+                        "block %dx3 at (%d,%d)\n",
+                        bitplanes, columns, pwm_bits, inverse, luminance,
+                        width, x, y);
+                bulk.CopyFrom(&single);  // Resync for the next check.
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+  printf("%d of %d checks failed.\n", failures, checks);
+  return failures == 0 ? 0 : 1;
+}
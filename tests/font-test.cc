@@ -0,0 +1,120 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Checks that a compiled font file with a glyph whose spans reach beyond
+// the maximum font width doesn't break the font: the glyph is treated as
+// missing, and creating the outline font still works.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "graphics.h"
+
+using rgb_matrix::Font;
+
+// A single 8x1 glyph 'A' with two spans of one pixel each. Compiled, it is
+// the last thing in the file and needs no padding, so the length of its
+// last span is the last byte of the file.
+static const char kBdfFont[] =
+  "STARTFONT 2.1\n"
+  "FONTBOUNDINGBOX 8 1 0 0\n"
+  "STARTCHAR A\n"
+  "ENCODING 65\n"
+  "DWIDTH 8 0\n"
+  "BBX 8 1 0 0\n"
+  "BITMAP\n"
+  "A0\n"
+  "ENDCHAR\n"
+  "ENDFONT\n";
+
+static bool WriteFile(const std::string &path, const std::string &content) {
+  FILE *f = fopen(path.c_str(), "wb");
+  if (f == NULL) return false;
+  const bool success = fwrite(content.data(), 1, content.size(), f)
+    == content.size();
+  return (fclose(f) == 0) && success;
+}
+
+static bool ReadFile(const std::string &path, std::string *content) {
+  FILE *f = fopen(path.c_str(), "rb");
+  if (f == NULL) return false;
+  char buffer[4096];
+  size_t r;
+  content->clear();
+  while ((r = fread(buffer, 1, sizeof(buffer), f)) > 0)
+    content->append(buffer, r);
+  fclose(f);
+  return true;
+}
+
+// Load "path" and create its outline font; returns the width of 'A' or -1
+// if the font doesn't have it.
+static int OutlineWidth(const std::string &path) {
+  Font font;
+  if (!font.LoadFont(path.c_str())) return -1;
+  Font *outline = font.CreateOutlineFont();
+  const int width = font.CharacterWidth('A');
+  delete outline;
+  return width;
+}
+
+int main(int argc, char *argv[]) {
+  char dir[] = "/tmp/font-test-XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  const std::string bdf_file = std::string(dir) + "/font.bdf";
+  const std::string compiled_file = std::string(dir) + "/font.rgbf";
+  const std::string corrupt_file = std::string(dir) + "/corrupt.rgbf";
+
+  int failures = 0;
+  Font font;
+  std::string compiled;
+  if (!WriteFile(bdf_file, kBdfFont) || !font.LoadFont(bdf_file.c_str())
+      || !font.WriteCompiledFont(compiled_file.c_str())
+      || !ReadFile(compiled_file, &compiled)) {
+    fprintf(stderr, "Can't create compiled font in %s\n", dir);
+    return 1;
+  }
+
+  const int valid_width = OutlineWidth(compiled_file);
+  printf("Compiled font: 'A' is %d wide\n", valid_width);
+  if (valid_width != 8) ++failures;
+
+  compiled[compiled.size() - 1] = (char)250;
+  WriteFile(corrupt_file, compiled);
+  const int corrupt_width = OutlineWidth(corrupt_file);
+  printf("Span beyond the maximum font width: %s\n",
+         corrupt_width < 0 ? "glyph rejected" : "NOT rejected");
+  if (corrupt_width >= 0) ++failures;
+
+  compiled[compiled.size() - 1] = 0;
+  WriteFile(corrupt_file, compiled);
+  const int empty_width = OutlineWidth(corrupt_file);
+  printf("Empty span: %s\n",
+         empty_width < 0 ? "glyph rejected" : "NOT rejected");
+  if (empty_width >= 0) ++failures;
+
+  unlink(bdf_file.c_str());
+  unlink(compiled_file.c_str());
+  unlink(corrupt_file.c_str());
+  rmdir(dir);
+  return failures == 0 ? 0 : 1;
+}
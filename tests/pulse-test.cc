@@ -0,0 +1,91 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Checks the pulses the PWM hardware gets for the bitplanes when they are
+// scaled with the refresh brightness: each has to be on for its scaled
+// length rounded to the PWM clock, so that every bitplane stays twice as
+// long as the one before, and none gets shorter with a larger scale.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#include "framebuffer-internal.h"
+#include "gpio.h"
+
+using rgb_matrix::GetHardwarePulse;
+using rgb_matrix::HardwarePulse;
+using rgb_matrix::internal::Framebuffer;
+
+// PWM clocks the pin is on for; 0 for pulses that are not sent.
+static int OnClocks(int nanos, int base_nanos, const char *what) {
+  HardwarePulse pulse;
+  if (!GetHardwarePulse(nanos, base_nanos, &pulse)) return 0;
+  int on = 0;
+  bool valid = pulse.range >= 2
+    && (pulse.count == 8 || (pulse.count == 1 && pulse.range < 16));
+  for (int i = 0; i < pulse.count; ++i) {
+    valid &= pulse.words[i] <= pulse.range;
+    on += pulse.words[i];
+  }
+  if (!valid) {
+    fprintf(stderr, "%s: invalid pulse for %dns\n", what, nanos);
+    return -1;
+  }
+  return on;
+}
+
+int main(int argc, char *argv[]) {
+  static const int kLsbNanos[] = { 50, 130, 300 };
+  int checks = 0, failures = 0;
+  for (int lsb : kLsbNanos) {
+    std::vector<int> last_on(Framebuffer::kMaxBitPlanes, 0);
+    for (int percent = 1; percent <= 100; ++percent) {
+      const float scale = percent / 100.0f;
+      char what[64];
+      int previous_on = 0;
+      for (int b = 0; b < Framebuffer::kMaxBitPlanes; ++b) {
+        snprintf(what, sizeof(what), "lsb %dns, scale %.2f, bitplane %d",
+                 lsb, scale, b);
+        // Same as the pulser does it; the PWM clock is half the lsb.
+        const int nanos = (lsb << b) * scale + 0.5f;
+        const int on = OnClocks(nanos, lsb, what);
+        const double want = 2.0 * nanos / lsb;
+        ++checks;
+        if (on < 0) {
+          ++failures;
+        } else if (on > 0 && fabs(on - want) > 0.5) {
+          ++failures;
+          fprintf(stderr, "%s: on for %d clocks, expected %.1f\n",
+                  what, on, want);
+        } else if (b > 0 && previous_on > 0 && abs(on - 2 * previous_on) > 1) {
+          ++failures;
+          fprintf(stderr, "%s: on for %d clocks, not twice the %d of the "
+                  "bitplane before\n", what, on, previous_on);
+        } else if (on < last_on[b]) {
+          ++failures;
+          fprintf(stderr, "%s: on for %d clocks, shorter than %d with a "
+                  "smaller scale\n", what, on, last_on[b]);
+        }
+        previous_on = on;
+        last_on[b] = on;
+      }
+    }
+  }
+  printf("%d of %d checks failed.\n", failures, checks);
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,187 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Checks that streams recorded with more PWM bits play on a matrix with
+// fewer: an old stream with its 11 bitplanes and a current compressed one
+// have to show exactly what drawing the same colors on a 7 bit canvas
+// gives. Streams with fewer bitplanes than the canvas are refused.
+// Uncompressed streams in memory are shown in place, without copying, and
+// GetNext() tells; compressed streams are copied.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "content-streamer.h"
+#include "framebuffer-internal.h"
+#include "gpio-trace.h"
+#include "gpio.h"
+#include "led-matrix.h"
+
+using rgb_matrix::FrameCanvas;
+using rgb_matrix::GPIO;
+using rgb_matrix::GPIOTrace;
+using rgb_matrix::MemStreamIO;
+using rgb_matrix::RGBMatrix;
+using rgb_matrix::RuntimeOptions;
+using rgb_matrix::StreamReader;
+using rgb_matrix::StreamWriter;
+using rgb_matrix::internal::Framebuffer;
+
+static const int kRows = 32;
+static const int kFrames = 3;
+
+static RGBMatrix *CreateMatrix(int pwm_bits) {
+  RGBMatrix::Options options;
+  options.rows = kRows;
+  options.pwm_bits = pwm_bits;
+  RuntimeOptions runtime;
+  runtime.do_gpio_init = false;
+  runtime.daemon = 0;
+  runtime.drop_privileges = 0;
+  return RGBMatrix::CreateFromOptions(options, runtime);
+}
+
+static void DrawFrame(FrameCanvas *canvas, int frame) {
+  srand(frame);
+  for (int y = 0; y < canvas->height(); ++y) {
+    for (int x = 0; x < canvas->width(); ++x) {
+      const int r = rand();
+      canvas->SetPixel(x, y, r, r >> 8, r >> 16);
+    }
+  }
+}
+
+static std::string Serialized(const FrameCanvas &canvas) {
+  const char *data;
+  size_t len;
+  canvas.Serialize(&data, &len);
+  return std::string(data, len);
+}
+
+// Record kFrames frames drawn on "canvas".
+static void Record(FrameCanvas *canvas, int keyframe_interval,
+                   MemStreamIO *out) {
+  StreamWriter writer(out, keyframe_interval);
+  for (int i = 0; i < kFrames; ++i) {
+    DrawFrame(canvas, i);
+    writer.Stream(*canvas, 1000);
+  }
+}
+
+// Old streams were raw frames and had zero where the header now records
+// the bitplanes; turn "in" into such a stream.
+static void MakeLegacy(MemStreamIO *in, MemStreamIO *out) {
+  std::string stream;
+  char buffer[4096];
+  ssize_t r;
+  in->Rewind();
+  while ((r = in->Read(buffer, sizeof(buffer))) > 0) stream.append(buffer, r);
+  stream[24] &= ~0x3e;  // The bitplanes bits after is_wide_gpio.
+  out->Append(stream.data(), stream.size());
+}
+
+// Play "stream" on "canvas"; returns the number of frames that differ
+// from "expected", or -1 if it couldn't be played.
+static int Play(MemStreamIO *stream, FrameCanvas *canvas,
+                const std::vector<std::string> &expected) {
+  StreamReader reader(stream);
+  int differences = 0;
+  for (int i = 0; i < kFrames; ++i) {
+    if (!reader.GetNext(canvas, NULL)) return -1;
+    if (Serialized(*canvas) != expected[i]) ++differences;
+  }
+  return differences;
+}
+
+int main(int argc, char *argv[]) {
+  GPIOTrace trace;
+  trace.set_keep_events(false);
+  GPIO io;
+  io.InitSoftware(&trace);
+  Framebuffer::InitHardwareMapping("regular");
+  Framebuffer::InitGPIO(&io, kRows, 1, false, 130, 0, 0);
+
+  RGBMatrix *const wide = CreateMatrix(11);
+  RGBMatrix *const narrow = CreateMatrix(7);
+  if (wide == NULL || narrow == NULL) return 1;
+  FrameCanvas *const wide_canvas = wide->CreateFrameCanvas();
+  FrameCanvas *const narrow_canvas = narrow->CreateFrameCanvas();
+
+  std::vector<std::string> narrow_frames;
+  for (int i = 0; i < kFrames; ++i) {
+    DrawFrame(narrow_canvas, i);
+    narrow_frames.push_back(Serialized(*narrow_canvas));
+  }
+
+  int failures = 0;
+  MemStreamIO raw, legacy, compressed, narrow_stream;
+  Record(wide_canvas, 0, &raw);
+  MakeLegacy(&raw, &legacy);
+  Record(wide_canvas, StreamWriter::kDefaultKeyframeInterval, &compressed);
+  Record(narrow_canvas, 0, &narrow_stream);
+
+  const int legacy_result = Play(&legacy, narrow_canvas, narrow_frames);
+  printf("Legacy 11 bitplane stream on 7 bitplanes: %d frames differ\n",
+         legacy_result);
+  if (legacy_result != 0) ++failures;
+
+  const int compressed_result = Play(&compressed, narrow_canvas,
+                                     narrow_frames);
+  printf("Compressed 11 bitplane stream on 7 bitplanes: %d frames differ\n",
+         compressed_result);
+  if (compressed_result != 0) ++failures;
+
+  // Expected to complain on stderr.
+  const int refused_result = Play(&narrow_stream, wide_canvas, narrow_frames);
+  printf("7 bitplane stream on 11 bitplanes: %s\n",
+         refused_result < 0 ? "refused" : "NOT refused");
+  if (refused_result >= 0) ++failures;
+
+  // With zero-copy, the canvas has to show the frame inside the stream.
+  StreamReader reader(&raw);
+  reader.set_zero_copy(true);
+  bool reported_in_place = false;
+  bool in_place = reader.GetNext(wide_canvas, NULL, &reported_in_place)
+    && reported_in_place;
+  if (in_place) {
+    raw.Seek(0);
+    const char *stream_begin = raw.ReadView(raw.Size());
+    const char *data;
+    size_t len;
+    wide_canvas->Serialize(&data, &len);
+    in_place = (data > stream_begin && data + len <= stream_begin + raw.Size());
+  }
+  printf("Uncompressed stream in memory: %s\n",
+         in_place ? "shown in place" : "NOT shown in place");
+  if (!in_place) ++failures;
+
+  StreamReader compressed_reader(&compressed);
+  compressed_reader.set_zero_copy(true);
+  bool compressed_in_place = true;
+  const bool compressed_copied
+    = compressed_reader.GetNext(wide_canvas, NULL, &compressed_in_place)
+    && !compressed_in_place;
+  printf("Compressed stream in memory: %s\n",
+         compressed_copied ? "reported as copied" : "NOT reported as copied");
+  if (!compressed_copied) ++failures;
+
+  delete wide;
+  delete narrow;
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,93 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2015 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Converts BDF fonts into compiled fonts, which Font::LoadFont() maps into
+// memory instead of parsing them.
+
+#include "graphics.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+using rgb_matrix::Font;
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [options] <font-file> [<font-file>...] "
+          "<output-file>\n", progname);
+  fprintf(stderr, "Converts BDF fonts into a compiled font that loads "
+          "instantly.\n"
+          "Multiple input fonts are merged; glyphs of earlier fonts take "
+          "precedence.\n");
+  fprintf(stderr, "Options:\n"
+          "\t-O            : Write the outline of the font instead of "
+          "the font itself.\n"
+          "\t-v            : Verbose.\n");
+  return 1;
+}
+
+static double GetTime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+  bool outline = false;
+  bool verbose = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "Ov")) != -1) {
+    switch (opt) {
+    case 'O': outline = true; break;
+    case 'v': verbose = true; break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (argc - optind < 2)
+    return usage(argv[0]);
+  const char *output = argv[argc - 1];
+
+  // Glyphs loaded later replace earlier ones, so load the last font first.
+  Font font;
+  for (int i = argc - 2; i >= optind; --i) {
+    const double start = GetTime();
+    if (!font.LoadFont(argv[i])) {
+      fprintf(stderr, "Couldn't load font '%s'\n", argv[i]);
+      return 1;
+    }
+    if (verbose) {
+      fprintf(stderr, "Loaded %s in %.1fms\n", argv[i],
+              (GetTime() - start) * 1e3);
+    }
+  }
+
+  Font *outline_font = outline ? font.CreateOutlineFont() : NULL;
+  const Font &result = outline ? *outline_font : font;
+  const bool success = result.WriteCompiledFont(output);
+  delete outline_font;
+  if (!success) return 1;
+
+  if (verbose) {
+    const double start = GetTime();
+    Font compiled;
+    compiled.LoadFont(output);
+    fprintf(stderr, "Wrote %s; loads in %.3fms\n", output,
+            (GetTime() - start) * 1e3);
+  }
+  return 0;
+}
@@ -23,6 +23,7 @@
 #include "pixel-mapper.h"
 #include "content-streamer.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <math.h>
 #include <signal.h>
@@ -35,8 +36,12 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <map>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <Magick++.h>
@@ -92,14 +97,17 @@ static void StoreInStream(const Magick::Image &img, int delay_time_us,
   scratch->Clear();
   const int x_offset = do_center ? (scratch->width() - img.columns()) / 2 : 0;
   const int y_offset = do_center ? (scratch->height() - img.rows()) / 2 : 0;
+  // Access the pixel cache directly; going through pixelColor() for each
+  // pixel is many times slower.
+  const Magick::PixelPacket *pixels =
+    img.getConstPixels(0, 0, img.columns(), img.rows());
   for (size_t y = 0; y < img.rows(); ++y) {
-    for (size_t x = 0; x < img.columns(); ++x) {
-      const Magick::Color &c = img.pixelColor(x, y);
-      if (c.alphaQuantum() < 255) {
+    for (size_t x = 0; x < img.columns(); ++x, ++pixels) {
+      if (pixels->opacity < 255) {
         scratch->SetPixel(x + x_offset, y + y_offset,
-                          ScaleQuantumToChar(c.redQuantum()),
-                          ScaleQuantumToChar(c.greenQuantum()),
-                          ScaleQuantumToChar(c.blueQuantum()));
+                          ScaleQuantumToChar(pixels->red),
+                          ScaleQuantumToChar(pixels->green),
+                          ScaleQuantumToChar(pixels->blue));
       }
     }
   }
@@ -173,12 +181,216 @@ static bool LoadImageAndScale(const char *filename,
   return true;
 }
 
+struct LoadRequest {
+  const char *filename;
+  ImageParams params;
+};
+
+// Load an image or animation and encode it into an in-memory stream, or
+// open a stream file. Returns NULL if neither worked.
+static FileInfo *LoadFile(const LoadRequest &request,
+                          int width, int height, bool do_center, bool do_mmap,
+                          FrameCanvas *scratch, std::string *err_msg) {
+  // These parameters are needed once we do scrolling.
+  const bool fill_width = false;
+  const bool fill_height = false;
+
+  FileInfo *file_info = NULL;
+  std::vector<Magick::Image> image_sequence;
+  if (LoadImageAndScale(request.filename, width, height,
+                        fill_width, fill_height, &image_sequence, err_msg)) {
+    file_info = new FileInfo();
+    file_info->params = request.params;
+    file_info->content_stream = new rgb_matrix::MemStreamIO();
+    file_info->is_multi_frame = image_sequence.size() > 1;
+    // Uncompressed, so that DisplayAnimation() shows the frames in place
+    // instead of decoding and copying each; at the price of more memory.
+    rgb_matrix::StreamWriter out(file_info->content_stream, 0);
+    for (size_t i = 0; i < image_sequence.size(); ++i) {
+      const Magick::Image &img = image_sequence[i];
+      int64_t delay_time_us;
+      if (file_info->is_multi_frame) {
+        delay_time_us = img.animationDelay() * 10000; // unit in 1/100s
+      } else {
+        delay_time_us = file_info->params.wait_ms * 1000;  // single image.
+      }
+      if (delay_time_us <= 0) delay_time_us = 100 * 1000;  // 1/10sec
+      StoreInStream(img, delay_time_us, do_center, scratch, &out);
+    }
+    return file_info;
+  }
+
+  // Ok, not an image. Let's see if it is one of our streams.
+  int fd = open(request.filename, O_RDONLY);
+  if (fd < 0) {
+    *err_msg += std::string("; ") + strerror(errno);
+    return NULL;
+  }
+  file_info = new FileInfo();
+  file_info->params = request.params;
+  if (do_mmap) {
+    rgb_matrix::MemMapViewInput *stream_input =
+      new rgb_matrix::MemMapViewInput(fd);
+    if (stream_input->IsInitialized()) {
+      file_info->content_stream = stream_input;
+    } else {
+      delete stream_input;
+    }
+  }
+  if (!file_info->content_stream) {
+    file_info->content_stream = new rgb_matrix::FileStreamIO(fd);
+  }
+  StreamReader reader(file_info->content_stream);
+  if (reader.GetNext(scratch, NULL)) {  // header+size ok
+    file_info->is_multi_frame = reader.GetNext(scratch, NULL);
+    reader.Rewind();
+  } else {
+    *err_msg += "; Can't read as image or compatible stream";
+    delete file_info->content_stream;
+    delete file_info;
+    file_info = NULL;
+  }
+  return file_info;
+}
+
+// Loads files on a pool of worker threads, each with its own scratch
+// canvas. Results are handed out in request order as soon as they are
+// ready, so display can start while the rest is still loading.
+//
+// At most one decoded image sequence per worker is in memory at any time.
+// If "max_ahead" is > 0, workers also don't run further ahead than that
+// many files past the last one handed out, for callers that release files
+// after use.
+class ImageLoader {
+public:
+  ImageLoader(RGBMatrix *matrix, const std::vector<LoadRequest> &requests,
+              int threads, size_t max_ahead, bool do_center, bool do_mmap)
+    : requests_(requests), results_(requests.size()),
+      width_(matrix->width()), height_(matrix->height()),
+      do_center_(do_center), do_mmap_(do_mmap), max_ahead_(max_ahead),
+      next_(0), handed_out_(0), remaining_(requests.size()), stop_(false),
+      start_ms_(GetTimeInMillis()), done_ms_(start_ms_) {
+    threads = std::max(1, std::min(threads, (int)requests.size()));
+    for (int i = 0; i < threads; ++i) {
+      FrameCanvas *scratch = matrix->CreateFrameCanvas();
+      workers_.push_back(std::thread(&ImageLoader::Work, this, scratch));
+    }
+  }
+
+  // Stops after the files currently in progress.
+  ~ImageLoader() {
+    {
+      std::lock_guard<std::mutex> l(mutex_);
+      stop_ = true;
+    }
+    work_available_.notify_all();
+    for (size_t i = 0; i < workers_.size(); ++i) workers_[i].join();
+    for (size_t i = 0; i < results_.size(); ++i) {
+      if (results_[i].info && !results_[i].handed_out) {
+        delete results_[i].info->content_stream;
+        delete results_[i].info;
+      }
+    }
+  }
+
+  size_t size() const { return requests_.size(); }
+
+  // Wait for the file with the given index and return it, or NULL if it
+  // could not be loaded, with the reason in "err_msg". Also returns NULL
+  // as soon as interrupt_received is set.
+  FileInfo *Get(size_t index, std::string *err_msg) {
+    std::unique_lock<std::mutex> l(mutex_);
+    Result &r = results_[index];
+    while (!r.done && !interrupt_received) {
+      result_available_.wait_for(l, std::chrono::milliseconds(100));
+    }
+    if (!r.done) {
+      *err_msg = "interrupted";
+      return NULL;
+    }
+    r.handed_out = true;
+    if (index + 1 > handed_out_) {
+      handed_out_ = index + 1;
+      work_available_.notify_all();
+    }
+    *err_msg = r.err_msg;
+    return r.info;
+  }
+
+  // Time since loading started.
+  tmillis_t elapsed_ms() const { return GetTimeInMillis() - start_ms_; }
+
+  // Time from start until all files were loaded, as far as done yet.
+  tmillis_t duration_ms() {
+    std::lock_guard<std::mutex> l(mutex_);
+    return done_ms_ - start_ms_;
+  }
+
+private:
+  struct Result {
+    Result() : done(false), handed_out(false), info(NULL) {}
+    bool done;
+    bool handed_out;
+    FileInfo *info;
+    std::string err_msg;
+  };
+
+  void Work(FrameCanvas *scratch) {
+    for (;;) {
+      size_t index;
+      {
+        std::unique_lock<std::mutex> l(mutex_);
+        while (!stop_ && next_ < requests_.size()
+               && max_ahead_ > 0 && next_ >= handed_out_ + max_ahead_) {
+          work_available_.wait(l);
+        }
+        if (stop_ || next_ >= requests_.size())
+          return;
+        index = next_++;
+      }
+
+      std::string err_msg;
+      FileInfo *info = LoadFile(requests_[index], width_, height_,
+                                do_center_, do_mmap_, scratch, &err_msg);
+
+      std::lock_guard<std::mutex> l(mutex_);
+      results_[index].info = info;
+      results_[index].err_msg = err_msg;
+      results_[index].done = true;
+      if (--remaining_ == 0) done_ms_ = GetTimeInMillis();
+      result_available_.notify_all();
+    }
+  }
+
+  const std::vector<LoadRequest> requests_;
+  std::vector<Result> results_;
+  const int width_;
+  const int height_;
+  const bool do_center_;
+  const bool do_mmap_;
+  const size_t max_ahead_;
+
+  std::mutex mutex_;
+  std::condition_variable work_available_;
+  std::condition_variable result_available_;
+  size_t next_;         // Next request to be picked up by a worker.
+  size_t handed_out_;   // All before this index have been asked for.
+  size_t remaining_;
+  bool stop_;
+  const tmillis_t start_ms_;
+  tmillis_t done_ms_;
+  std::vector<std::thread> workers_;
+};
+
 void DisplayAnimation(const FileInfo *file,
                       RGBMatrix *matrix, FrameCanvas *offscreen_canvas) {
   const tmillis_t duration_ms = (file->is_multi_frame
                                  ? file->params.anim_duration_ms
                                  : file->params.wait_ms);
   rgb_matrix::StreamReader reader(file->content_stream);
+  // Show uncompressed streams in place: loaded images, and with -m stream
+  // files written with -K0.
+  reader.set_zero_copy(true);
   int loops = file->params.loops;
   const tmillis_t end_time_ms = GetTimeInMillis() + duration_ms;
   const tmillis_t override_anim_delay = file->params.anim_delay_ms;
@@ -209,6 +421,10 @@ static int usage(const char *progname) {
   fprintf(stderr, "Options:\n"
           "\t-O<streamfile>            : Output to stream-file instead of matrix (Don't need to be root).\n"
           "\t-C                        : Center images.\n"
+          "\t-K<keyframe-interval>     : Stream output: keyframe every that many frames (default %d).\n"
+          "\t                            Compressed streams are smaller, but each frame is decoded and copied on playback.\n"
+          "\t                            0 writes uncompressed streams, which -m shows in place without copying.\n"
+          "\t-j<threads>               : Number of threads loading images (default: number of CPUs).\n"
           "\t-m                        : if this is a stream, mmap() it. This can work around IO latencies in SD-card and refilling kernel buffers. This will use physical memory so only use if you have enough to map file size\n"
 
           "\nThese options affect images FOLLOWING them on the command line,\n"
@@ -228,8 +444,8 @@ static int usage(const char *progname) {
           "\nOptions affecting display of multiple images:\n"
           "\t-f                        : "
           "Forever cycle through the list of files on the command line.\n"
-          "\t-s                        : If multiple images are given: shuffle.\n"
-          );
+          "\t-s                        : If multiple images are given: shuffle.\n",
+          rgb_matrix::StreamWriter::kDefaultKeyframeInterval);
 
   fprintf(stderr, "\nGeneral LED matrix options:\n");
   rgb_matrix::PrintMatrixFlags(stderr);
@@ -283,9 +499,11 @@ int main(int argc, char *argv[]) {
   }
 
   const char *stream_output = NULL;
+  int keyframe_interval = rgb_matrix::StreamWriter::kDefaultKeyframeInterval;
+  int load_threads = std::max(1u, std::thread::hardware_concurrency());
 
   int opt;
-  while ((opt = getopt(argc, argv, "w:t:l:fr:c:P:LhCR:sO:V:D:m")) != -1) {
+  while ((opt = getopt(argc, argv, "w:t:l:fr:c:P:LhCR:sO:K:V:D:mj:")) != -1) {
     switch (opt) {
     case 'w':
       img_param.wait_ms = roundf(atof(optarg) * 1000.0f);
@@ -302,6 +520,9 @@ int main(int argc, char *argv[]) {
     case 'm':
       do_mmap = true;
       break;
+    case 'j':
+      load_threads = atoi(optarg);
+      break;
     case 'f':
       do_forever = true;
       break;
@@ -336,6 +557,9 @@ int main(int argc, char *argv[]) {
     case 'O':
       stream_output = strdup(optarg);
       break;
+    case 'K':
+      keyframe_interval = atoi(optarg);
+      break;
     case 'V':
       img_param.vsync_multiple = atoi(optarg);
       if (img_param.vsync_multiple < 1) img_param.vsync_multiple = 1;
@@ -369,10 +593,6 @@ int main(int argc, char *argv[]) {
   printf("Size: %dx%d. Hardware gpio mapping: %s\n",
          matrix->width(), matrix->height(), matrix_options.hardware_mapping);
 
-  // These parameters are needed once we do scrolling.
-  const bool fill_width = false;
-  const bool fill_height = false;
-
   // In case the output to stream is requested, set up the stream object.
   rgb_matrix::StreamIO *stream_io = NULL;
   rgb_matrix::StreamWriter *global_stream_writer = NULL;
@@ -383,88 +603,57 @@ int main(int argc, char *argv[]) {
       return 1;
     }
     stream_io = new rgb_matrix::FileStreamIO(fd);
-    global_stream_writer = new rgb_matrix::StreamWriter(stream_io);
+    global_stream_writer = new rgb_matrix::StreamWriter(stream_io,
+                                                        keyframe_interval);
   }
 
-  const tmillis_t start_load = GetTimeInMillis();
-  fprintf(stderr, "Loading %d files...\n", argc - optind);
-  // Preparing all the images beforehand as the Pi might be too slow to
-  // be quickly switching between these. So preprocess.
-  std::vector<FileInfo*> file_imgs;
+  std::vector<LoadRequest> requests;
   for (int imgarg = optind; imgarg < argc; ++imgarg) {
-    const char *filename = argv[imgarg];
-    FileInfo *file_info = NULL;
+    LoadRequest request;
+    request.filename = argv[imgarg];
+    request.params = filename_params[argv[imgarg]];
+    requests.push_back(request);
+  }
+  if (do_shuffle && !stream_output) {
+    // Also the first round is shown while loading, so shuffle right away.
+    std::random_shuffle(requests.begin(), requests.end());
+  }
 
-    std::string err_msg;
-    std::vector<Magick::Image> image_sequence;
-    if (LoadImageAndScale(filename, matrix->width(), matrix->height(),
-                          fill_width, fill_height, &image_sequence, &err_msg)) {
-      file_info = new FileInfo();
-      file_info->params = filename_params[filename];
-      file_info->content_stream = new rgb_matrix::MemStreamIO();
-      file_info->is_multi_frame = image_sequence.size() > 1;
-      rgb_matrix::StreamWriter out(file_info->content_stream);
-      for (size_t i = 0; i < image_sequence.size(); ++i) {
-        const Magick::Image &img = image_sequence[i];
-        int64_t delay_time_us;
-        if (file_info->is_multi_frame) {
-          delay_time_us = img.animationDelay() * 10000; // unit in 1/100s
-        } else {
-          delay_time_us = file_info->params.wait_ms * 1000;  // single image.
-        }
-        if (delay_time_us <= 0) delay_time_us = 100 * 1000;  // 1/10sec
-        StoreInStream(img, delay_time_us, do_center, offscreen_canvas,
-                      global_stream_writer ? global_stream_writer : &out);
-      }
-    } else {
-      // Ok, not an image. Let's see if it is one of our streams.
-      int fd = open(filename, O_RDONLY);
-      if (fd >= 0) {
-        file_info = new FileInfo();
-        file_info->params = filename_params[filename];
-        if (do_mmap) {
-          rgb_matrix::MemMapViewInput *stream_input =
-            new rgb_matrix::MemMapViewInput(fd);
-          if (stream_input->IsInitialized()) {
-            file_info->content_stream = stream_input;
-          } else {
-            delete stream_input;
-          }
-        }
-        if (!file_info->content_stream) {
-          file_info->content_stream = new rgb_matrix::FileStreamIO(fd);
-        }
-        StreamReader reader(file_info->content_stream);
-        if (reader.GetNext(offscreen_canvas, NULL)) {  // header+size ok
-          file_info->is_multi_frame = reader.GetNext(offscreen_canvas, NULL);
-          reader.Rewind();
-          if (global_stream_writer) {
-            CopyStream(&reader, global_stream_writer, offscreen_canvas);
-          }
-        } else {
-          err_msg += "; Can't read as image or compatible stream";
-          delete file_info->content_stream;
-          delete file_info;
-          file_info = NULL;
-        }
-      }
-      else {
-        perror("Opening file");
-      }
-    }
+  signal(SIGTERM, InterruptHandler);
+  signal(SIGINT, InterruptHandler);
 
-    if (file_info) {
-      file_imgs.push_back(file_info);
-    } else {
-      fprintf(stderr, "%s skipped: Unable to open (%s)\n",
-              filename, err_msg.c_str());
-    }
-  }
+  fprintf(stderr, "Loading %d files...\n", filename_count);
+  // Preparing all the images beforehand as the Pi might be too slow to
+  // be quickly switching between these. So preprocess, in parallel while
+  // already showing the files that are ready. When writing a stream, files
+  // are released after they are written, so we only need to keep a couple
+  // of them ahead.
+  ImageLoader *loader = new ImageLoader(matrix, requests, load_threads,
+                                        stream_output ? 2 * load_threads : 0,
+                                        do_center, do_mmap);
 
   if (stream_output) {
+    int written = 0;
+    for (size_t i = 0; i < loader->size() && !interrupt_received; ++i) {
+      std::string err_msg;
+      FileInfo *file_info = loader->Get(i, &err_msg);
+      if (interrupt_received) break;
+      if (!file_info) {
+        fprintf(stderr, "%s skipped: Unable to open (%s)\n",
+                requests[i].filename, err_msg.c_str());
+        continue;
+      }
+      StreamReader reader(file_info->content_stream);
+      CopyStream(&reader, global_stream_writer, offscreen_canvas);
+      delete file_info->content_stream;
+      delete file_info;
+      ++written;
+    }
+    delete loader;
+    global_stream_writer->AppendIndex();  // Allow seeking in the output.
     delete global_stream_writer;
     delete stream_io;
-    if (file_imgs.size()) {
+    if (written) {
       fprintf(stderr, "Done: Output to stream %s; "
               "this can now be opened with led-image-viewer with the exact same panel configuration settings such as rows, chain, parallel and hardware-mapping\n", stream_output);
     }
@@ -476,46 +665,72 @@ int main(int argc, char *argv[]) {
     return 0;
   }
 
-  // Some parameter sanity adjustments.
-  if (file_imgs.empty()) {
-    // e.g. if all files could not be interpreted as image.
-    fprintf(stderr, "No image could be loaded.\n");
-    return 1;
-  } else if (file_imgs.size() == 1) {
-    // Single image: show forever.
-    file_imgs[0]->params.wait_ms = distant_future;
-  } else {
-    for (size_t i = 0; i < file_imgs.size(); ++i) {
-      ImageParams &params = file_imgs[i]->params;
+  // First round: show each file as soon as it is loaded.
+  std::vector<FileInfo*> file_imgs;
+  ImageParams first_params;  // As given, in case it is the only file shown.
+  for (size_t i = 0; i < loader->size() && !interrupt_received; ++i) {
+    std::string err_msg;
+    FileInfo *file_info = loader->Get(i, &err_msg);
+    if (interrupt_received) break;
+    if (!file_info) {
+      fprintf(stderr, "%s skipped: Unable to open (%s)\n",
+              requests[i].filename, err_msg.c_str());
+      continue;
+    }
+
+    // Some parameter sanity adjustments.
+    ImageParams &params = file_info->params;
+    if (file_imgs.empty()) first_params = params;
+    if (loader->size() == 1) {
+      // Single image: show forever.
+      params.wait_ms = distant_future;
+    } else if (params.loops < 0 && params.anim_duration_ms == distant_future) {
       // Forever animation ? Set to loop only once, otherwise that animation
       // would just run forever, stopping all the images after it.
-      if (params.loops < 0 && params.anim_duration_ms == distant_future) {
-        params.loops = 1;
-      }
+      params.loops = 1;
     }
-  }
+    file_imgs.push_back(file_info);
 
-  fprintf(stderr, "Loading took %.3fs; now: Display.\n",
-          (GetTimeInMillis() - start_load) / 1000.0);
+    if (file_imgs.size() == 1) {
+      fprintf(stderr, "First file ready after %.3fs; now: Display.\n",
+              loader->elapsed_ms() / 1000.0);
+    }
+    DisplayAnimation(file_info, matrix, offscreen_canvas);
+  }
 
-  signal(SIGTERM, InterruptHandler);
-  signal(SIGINT, InterruptHandler);
+  if (!interrupt_received) {
+    if (file_imgs.empty()) {
+      // e.g. if all files could not be interpreted as image.
+      fprintf(stderr, "No image could be loaded.\n");
+      delete loader;
+      return 1;
+    }
+    fprintf(stderr, "Loading took %.3fs.\n", loader->duration_ms() / 1000.0);
+    if (file_imgs.size() == 1 && loader->size() > 1) {
+      // All others failed to load: show the single image forever, as if
+      // only that was given.
+      file_imgs[0]->params = first_params;
+      file_imgs[0]->params.wait_ms = distant_future;
+      DisplayAnimation(file_imgs[0], matrix, offscreen_canvas);
+    }
+  }
 
-  do {
+  while (do_forever && !interrupt_received) {
     if (do_shuffle) {
       std::random_shuffle(file_imgs.begin(), file_imgs.end());
     }
     for (size_t i = 0; i < file_imgs.size() && !interrupt_received; ++i) {
       DisplayAnimation(file_imgs[i], matrix, offscreen_canvas);
     }
-  } while (do_forever && !interrupt_received);
-
+  }
   if (interrupt_received) {
     fprintf(stderr, "Caught signal. Exiting.\n");
   }
 
-  // Animation finished. Shut down the RGB matrix.
+  // Animation finished. Shut down the RGB matrix; the loader might still
+  // have to finish files in progress, so turn the panels dark right away.
   matrix->Clear();
+  delete loader;
   delete matrix;
 
   // Leaking the FileInfos, but don't care at program end.
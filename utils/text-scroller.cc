@@ -20,6 +20,7 @@
 #include <fstream>
 #include <streambuf>
 #include <string>
+#include <vector>
 
 #include <getopt.h>
 #include <math.h>
@@ -44,7 +45,7 @@ static int usage(const char *progname) {
   fprintf(stderr, "Takes text and scrolls it with speed -s\n");
   fprintf(stderr, "Options:\n");
   fprintf(stderr,
-          "\t-f <font-file>    : Path to *.bdf-font to be used.\n"
+          "\t-f <font-file>    : Path to *.bdf-font or compiled font to be used.\n"
           "\t-i <textfile>     : Input from file.\n"
           "\t-s <speed>        : Approximate letters per second. \n"
           "\t                    Positive: scroll right to left; Negative: scroll left to right\n"
@@ -76,15 +77,103 @@ static bool FullSaturation(const Color &c) {
     && (c.b == 0 || c.b == 255);
 }
 
-static void add_micros(struct timespec *accumulator, long micros) {
-  const long billion = 1000000000;
-  const int64_t nanos = (int64_t) micros * 1000;
-  accumulator->tv_sec += nanos / billion;
-  accumulator->tv_nsec += nanos % billion;
-  while (accumulator->tv_nsec > billion) {
-    accumulator->tv_nsec -= billion;
-    accumulator->tv_sec += 1;
+static double GetTime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Off-screen canvas the whole text is rendered to once. Each frame then
+// only copies the visible window to the matrix.
+class TextStrip : public Canvas {
+public:
+  // A strip "width" x "height" pixels, with strip column 0 corresponding to
+  // text position "x_origin".
+  TextStrip(int x_origin, int width, int height)
+    : x_origin_(x_origin), width_(width), height_(height),
+      pixels_(width * height) {}
+
+  virtual int width() const { return width_; }
+  virtual int height() const { return height_; }
+  virtual void SetPixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
+    x -= x_origin_;
+    if (x < 0 || x >= width_ || y < 0 || y >= height_) return;
+    pixels_[y * width_ + x] = Color(r, g, b);
+  }
+  virtual void Clear() { Fill(0, 0, 0); }
+  virtual void Fill(uint8_t r, uint8_t g, uint8_t b) {
+    std::fill(pixels_.begin(), pixels_.end(), Color(r, g, b));
+  }
+
+  // Copy to "canvas", with text position 0 at canvas column "x". Only the
+  // part visible on the canvas is actually copied.
+  void CopyTo(FrameCanvas *canvas, int x) const {
+    canvas->SetPixelData(x + x_origin_, 0, width_, height_,
+                         reinterpret_cast<const uint8_t*>(pixels_.data()),
+                         width_ * sizeof(Color), sizeof(Color), 0, 1, 2);
   }
+
+private:
+  const int x_origin_;
+  const int width_;
+  const int height_;
+  std::vector<Color> pixels_;
+};
+
+// Render "line" with the given fonts and colors into a new strip as high as
+// the canvas. Returns the strip; the advance of the text is returned in
+// "length".
+static TextStrip *RenderText(const std::string &line, int letter_spacing,
+                             const rgb_matrix::Font &font,
+                             const rgb_matrix::Font *outline_font,
+                             const Color &color, const Color &bg_color,
+                             const Color &outline_color,
+                             int y, int height, int *length) {
+  // Drawing to an empty strip just determines the advance.
+  TextStrip measure(0, 0, 0);
+  *length = rgb_matrix::DrawText(&measure, font, 0, 0, color, NULL,
+                                 line.c_str(), letter_spacing);
+  int outline_length = 0;
+  if (outline_font) {
+    outline_length = rgb_matrix::DrawText(&measure, *outline_font, 0, 0,
+                                          outline_color, NULL, line.c_str(),
+                                          letter_spacing - 2);
+  }
+
+  // Leave room for the outline and letters overlapping with negative
+  // spacing.
+  const int margin = 1 + abs(letter_spacing);
+  TextStrip *strip = new TextStrip(-margin,
+                                   std::max(*length, outline_length)
+                                   + 2 * margin,
+                                   height);
+  strip->Fill(bg_color.r, bg_color.g, bg_color.b);
+  if (outline_font) {
+    // The outline font, we need to write with a negative (-2) text-spacing,
+    // as we want to have the same letter pitch as the regular text that
+    // we then write on top.
+    rgb_matrix::DrawText(strip, *outline_font, -1, y + font.baseline(),
+                         outline_color, NULL, line.c_str(),
+                         letter_spacing - 2);
+  }
+  rgb_matrix::DrawText(strip, font, 0, y + font.baseline(), color, NULL,
+                       line.c_str(), letter_spacing);
+  return strip;
+}
+
+// Time between two refreshes of the matrix, as seen by SwapOnVSync().
+static double MeasureRefreshPeriod(RGBMatrix *matrix,
+                                   FrameCanvas **offscreen) {
+  std::vector<double> periods;
+  double last = -1;
+  for (int i = 0; i < 8; ++i) {
+    *offscreen = matrix->SwapOnVSync(*offscreen);
+    const double now = GetTime();
+    if (last >= 0) periods.push_back(now - last);
+    last = now;
+  }
+  std::sort(periods.begin(), periods.end());
+  return periods[periods.size() / 2];
 }
 
 // Read line and return if it changed.
@@ -243,12 +332,24 @@ int main(int argc, char *argv[]) {
 
   // Create a new canvas to be used with led_matrix_swap_on_vsync
   FrameCanvas *offscreen_canvas = canvas->CreateFrameCanvas();
+  offscreen_canvas->Fill(bg_color.r, bg_color.g, bg_color.b);
 
   const int scroll_direction = (speed >= 0) ? -1 : 1;
   speed = fabs(speed);
-  int delay_speed_usec = 1000000;
+  const double pixels_per_second
+    = speed * std::max(1, font.CharacterWidth('W'));
+
+  // Each frame is shown for a multiple of the refresh period, chosen such
+  // that slow scrolling moves about one pixel per frame, while fast
+  // scrolling moves as many pixels as needed to keep up.
+  unsigned frame_fraction = 1;
+  double frame_period = 0;
   if (speed > 0) {
-    delay_speed_usec = 1000000 / speed / font.CharacterWidth('W');
+    const double refresh_period = MeasureRefreshPeriod(canvas,
+                                                       &offscreen_canvas);
+    frame_fraction = std::max(1, (int)(1.0 / pixels_per_second
+                                       / refresh_period));
+    frame_period = frame_fraction * refresh_period;
   }
 
   if (!xorigin_configured) {
@@ -261,60 +362,66 @@ int main(int argc, char *argv[]) {
   }
 
   int x = x_orig;
-  int y = y_orig;
   int length = 0;
-
-  struct timespec next_frame = {0, 0};
-
-  uint64_t frame_counter = 0;
+  TextStrip *strip = RenderText(line, letter_spacing, font, outline_font,
+                                color, bg_color, outline_color, y_orig,
+                                canvas->height(), &length);
+
+  // Position is derived from the time a frame will be shown, so render or
+  // swap delays never slow down scrolling.
+  const double start_time = GetTime();
+  double show_time = start_time;
+  uint64_t pixels_scrolled = 0;
+
+  // Blinking follows the scrolled pixels. A frame can scroll several of
+  // them, so instead of sampling the position modulo the blink period,
+  // which can land in the same phase every frame, a phase ends once the
+  // position passed its end and the next one starts from there: each is
+  // shown for its number of pixels, but at least for one frame.
+  const bool blinking = (blink_on > 0 && blink_off > 0);
+  bool blink_is_on = true;
+  uint64_t blink_phase_end = blink_on;
   while (!interrupt_received && loops != 0) {
     if (input_file && ReadLineOnChange(input_file, &line, &last_change)) {
+      delete strip;
+      strip = RenderText(line, letter_spacing, font, outline_font,
+                         color, bg_color, outline_color, y_orig,
+                         canvas->height(), &length);
       x = x_orig;
     }
-    ++frame_counter;
     offscreen_canvas->Fill(bg_color.r, bg_color.g, bg_color.b);
-    const bool draw_on_frame = (blink_on <= 0)
-      || (frame_counter % (blink_on + blink_off) < (uint64_t)blink_on);
-
-    if (draw_on_frame) {
-      if (outline_font) {
-        // The outline font, we need to write with a negative (-2) text-spacing,
-        // as we want to have the same letter pitch as the regular text that
-        // we then write on top.
-        rgb_matrix::DrawText(offscreen_canvas, *outline_font,
-                             x - 1, y + font.baseline(),
-                             outline_color, NULL,
-                             line.c_str(), letter_spacing - 2);
-      }
-
-      // length = holds how many pixels our text takes up
-      length = rgb_matrix::DrawText(offscreen_canvas, font,
-                                    x, y + font.baseline(),
-                                    color, NULL,
-                                    line.c_str(), letter_spacing);
+    if (blinking && pixels_scrolled >= blink_phase_end) {
+      blink_is_on = !blink_is_on;
+      blink_phase_end = std::max(blink_phase_end, pixels_scrolled)
+        + (blink_is_on ? blink_on : blink_off);
+    }
+    if (!blinking || blink_is_on) {
+      strip->CopyTo(offscreen_canvas, x);
     }
 
-    x += scroll_direction;
-    if ((scroll_direction < 0 && x + length < 0) ||
-        (scroll_direction > 0 && x > canvas->width())) {
-      x = x_orig + ((scroll_direction > 0) ? -length : 0);
-      if (loops > 0) --loops;
+    // Swap the offscreen_canvas with canvas on vsync, avoids flickering
+    offscreen_canvas = canvas->SwapOnVSync(offscreen_canvas, frame_fraction);
+    if (speed <= 0) {
+      pause();  // Nothing to scroll.
+      continue;
     }
 
-    // Make sure render-time delays are not influencing scroll-time
-    if (speed > 0) {
-      if (next_frame.tv_sec == 0 && next_frame.tv_nsec == 0) {
-        // First time. Start timer, but don't wait.
-        clock_gettime(CLOCK_MONOTONIC, &next_frame);
-      } else {
-        add_micros(&next_frame, delay_speed_usec);
-        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next_frame, NULL);
+    // The next frame is shown one frame period after this one; unless we
+    // fell behind, then it is the next one we can make.
+    show_time += frame_period;
+    const double now = GetTime();
+    if (show_time < now) show_time = now + frame_period;
+    const uint64_t target = (show_time - start_time) * pixels_per_second;
+    for (/**/; pixels_scrolled < target && loops != 0; ++pixels_scrolled) {
+      x += scroll_direction;
+      if ((scroll_direction < 0 && x + length < 0) ||
+          (scroll_direction > 0 && x > canvas->width())) {
+        x = x_orig + ((scroll_direction > 0) ? -length : 0);
+        if (loops > 0) --loops;
       }
     }
-    // Swap the offscreen_canvas with canvas on vsync, avoids flickering
-    offscreen_canvas = canvas->SwapOnVSync(offscreen_canvas);
-    if (speed <= 0) pause();  // Nothing to scroll.
   }
+  delete strip;
 
   // Finished. Shut down the RGB matrix.
   canvas->Clear();
@@ -46,7 +46,13 @@ extern "C" {
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <thread>
+#include <vector>
 
 #include "led-matrix.h"
 #include "content-streamer.h"
@@ -75,6 +81,32 @@ void CopyFrame(AVFrame *pFrame, FrameCanvas *canvas,
   }
 }
 
+// Fill "image" with the planes of "frame" if it is in a format
+// FrameCanvas::SetYUVImage() can take directly.
+static bool GetYUVImage(const AVFrame *frame, rgb_matrix::YUVImage *image) {
+  switch (frame->format) {
+  case AV_PIX_FMT_YUV420P:
+  case AV_PIX_FMT_YUVJ420P:
+    image->format = rgb_matrix::YUVImage::YUV420P;
+    break;
+  case AV_PIX_FMT_NV12:
+    image->format = rgb_matrix::YUVImage::NV12;
+    break;
+  default:
+    return false;
+  }
+  image->width = frame->width;
+  image->height = frame->height;
+  for (int i = 0; i < 3; ++i) {
+    image->planes[i] = frame->data[i];
+    image->strides[i] = frame->linesize[i];
+  }
+  image->full_range = (frame->format == AV_PIX_FMT_YUVJ420P
+                       || frame->color_range == AVCOL_RANGE_JPEG);
+  image->bt709 = (frame->colorspace == AVCOL_SPC_BT709);
+  return true;
+}
+
 // Scale "width" and "height" to fit within target rectangle of given size.
 void ScaleToFitKeepAscpet(int fit_in_width, int fit_in_height,
                           int *width, int *height) {
@@ -86,6 +118,241 @@ void ScaleToFitKeepAscpet(int fit_in_width, int fit_in_height,
   *height = roundf(*height / ratio);
 }
 
+static int64_t GetNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Bounded queue of pre-rendered frames between the decoding thread and
+// the thread presenting them. Owns all FrameCanvases that are neither
+// being filled nor on screen.
+class FrameQueue {
+public:
+  struct Frame {
+    FrameCanvas *canvas;
+    int64_t pts_nanos;      // Presentation time relative to start of round.
+    bool first_of_round;    // Start of (re-)play; timing restarts here.
+    int64_t decode_nanos;   // Time to read and decode.
+    int64_t convert_nanos;  // Time to scale and copy into the canvas.
+  };
+
+  // Pre-allocate "depth" canvases.
+  FrameQueue(RGBMatrix *matrix, int depth) : finished_(false), closed_(false) {
+    for (int i = 0; i < depth; ++i) free_.push_back(matrix->CreateFrameCanvas());
+  }
+
+  // Start over for the next video.
+  void Reset() {
+    std::lock_guard<std::mutex> l(mutex_);
+    finished_ = closed_ = false;
+  }
+
+  // -- Decoder side.
+
+  // Wait for a canvas to render into. Returns NULL if the presenting side
+  // has closed the queue.
+  FrameCanvas *GetFree() {
+    std::unique_lock<std::mutex> l(mutex_);
+    while (free_.empty() && !closed_) changed_.wait(l);
+    if (closed_) return NULL;
+    FrameCanvas *result = free_.back();
+    free_.pop_back();
+    return result;
+  }
+
+  void Push(const Frame &frame) {
+    std::lock_guard<std::mutex> l(mutex_);
+    ready_.push_back(frame);
+    changed_.notify_all();
+  }
+
+  // No more frames.
+  void Finish() {
+    std::lock_guard<std::mutex> l(mutex_);
+    finished_ = true;
+    changed_.notify_all();
+  }
+
+  // -- Presenting side.
+
+  // Wait for the next frame. Returns false at the end of the video or
+  // when interrupted.
+  bool Pop(Frame *frame) {
+    std::unique_lock<std::mutex> l(mutex_);
+    while (ready_.empty() && !finished_ && !interrupt_received) {
+      changed_.wait_for(l, std::chrono::milliseconds(100));
+    }
+    if (ready_.empty() || interrupt_received) return false;
+    *frame = ready_.front();
+    ready_.pop_front();
+    return true;
+  }
+
+  // Is there another frame ready right now ?
+  bool HasReady() {
+    std::lock_guard<std::mutex> l(mutex_);
+    return !ready_.empty();
+  }
+
+  // Give back a canvas that is done being shown (or dropped).
+  void Release(FrameCanvas *canvas) {
+    std::lock_guard<std::mutex> l(mutex_);
+    free_.push_back(canvas);
+    changed_.notify_all();
+  }
+
+  // Stop the decoder: no more frames wanted. Recycles frames not shown.
+  void Close() {
+    std::lock_guard<std::mutex> l(mutex_);
+    closed_ = true;
+    for (size_t i = 0; i < ready_.size(); ++i) free_.push_back(ready_[i].canvas);
+    ready_.clear();
+    changed_.notify_all();
+  }
+
+private:
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  std::vector<FrameCanvas*> free_;
+  std::deque<Frame> ready_;
+  bool finished_;
+  bool closed_;
+};
+
+// Accumulates latencies for the -v report.
+class LatencyStat {
+public:
+  LatencyStat() : count_(0), sum_(0), max_(0) {}
+  void Add(int64_t nanos) {
+    ++count_;
+    sum_ += nanos;
+    if (nanos > max_) max_ = nanos;
+  }
+  void Print(const char *name) const {
+    if (count_ == 0) return;
+    fprintf(stderr, "%-8s avg %7.2fms  max %7.2fms\n", name,
+            sum_ / 1e6 / count_, max_ / 1e6);
+  }
+private:
+  int64_t count_;
+  int64_t sum_;
+  int64_t max_;
+};
+
+// Everything the decoder thread needs to know about the current video.
+struct DecodeJob {
+  AVFormatContext *format_context;
+  AVCodecContext *codec_context;
+  SwsContext *sws_ctx;
+  AVFrame *output_frame;
+  int video_stream;
+  long frame_wait_nanos;
+  int display_offset_x, display_offset_y;
+  int display_width, display_height;
+  unsigned int frame_skip;
+  int64_t framecount_limit;
+  bool loop_forever;
+  long decoded_frames;  // Out.
+};
+
+// Decoder thread: decode, scale and copy frames into canvases of the
+// queue, as far ahead as the queue allows.
+static void DecodeFrames(DecodeJob *job, FrameQueue *queue) {
+  AVCodecContext *const codec_context = job->codec_context;
+  AVPacket *packet = av_packet_alloc();
+  AVFrame *decode_frame = av_frame_alloc();  // Decode video into this
+  bool closed = false;
+  do {
+    int64_t frames_left = job->framecount_limit;
+    unsigned int frames_to_skip = job->frame_skip;
+    if (job->loop_forever) {
+      av_seek_frame(job->format_context, job->video_stream, 0,
+                    AVSEEK_FLAG_ANY);
+      avcodec_flush_buffers(codec_context);
+    }
+    int64_t pts_nanos = 0;
+    bool first_of_round = true;
+
+    int decode_in_flight = 0;
+    bool state_reading = true;
+    int64_t decode_start = GetNanos();
+
+    while (!closed && !interrupt_received && frames_left > 0) {
+      if (state_reading &&
+          av_read_frame(job->format_context, packet) != 0) {
+        state_reading = false;  // ran out of packets from input
+      }
+
+      if (!state_reading && decode_in_flight == 0)
+        break;  // Decoder fully drained.
+
+      // Is this a packet from the video stream?
+      if (state_reading && packet->stream_index != job->video_stream) {
+        av_packet_unref(packet);
+        continue;  // Not interested in that.
+      }
+
+      if (state_reading) {
+        // Decode video frame
+        if (avcodec_send_packet(codec_context, packet) == 0) {
+          ++decode_in_flight;
+        }
+        av_packet_unref(packet);
+      } else {
+        avcodec_send_packet(codec_context, nullptr); // Trigger decode drain
+      }
+
+      while (decode_in_flight &&
+             avcodec_receive_frame(codec_context, decode_frame) == 0) {
+        --decode_in_flight;
+
+        if (frames_to_skip) { frames_to_skip--; continue; }
+
+        FrameQueue::Frame frame;
+        frame.decode_nanos = GetNanos() - decode_start;
+        frame.canvas = queue->GetFree();  // Waiting here doesn't count.
+        if (frame.canvas == NULL) {
+          closed = true;
+          break;
+        }
+
+        const int64_t convert_start = GetNanos();
+        rgb_matrix::YUVImage yuv;
+        if (GetYUVImage(decode_frame, &yuv)) {
+          // Common case: convert, scale and encode in one go.
+          frame.canvas->SetYUVImage(job->display_offset_x,
+                                    job->display_offset_y,
+                                    job->display_width, job->display_height,
+                                    yuv);
+        } else {
+          // Convert the image from its native format to RGB
+          sws_scale(job->sws_ctx, (uint8_t const * const *)decode_frame->data,
+                    decode_frame->linesize, 0, codec_context->height,
+                    job->output_frame->data, job->output_frame->linesize);
+          CopyFrame(job->output_frame, frame.canvas,
+                    job->display_offset_x, job->display_offset_y,
+                    job->display_width, job->display_height);
+        }
+        frame.convert_nanos = GetNanos() - convert_start;
+        frame.pts_nanos = pts_nanos;
+        frame.first_of_round = first_of_round;
+        queue->Push(frame);
+
+        pts_nanos += job->frame_wait_nanos;
+        first_of_round = false;
+        job->decoded_frames++;
+        if (--frames_left <= 0) break;
+        decode_start = GetNanos();
+      }
+    }
+  } while (job->loop_forever && !closed && !interrupt_received);
+
+  queue->Finish();
+  av_packet_free(&packet);
+  av_frame_free(&decode_frame);
+}
+
 static int usage(const char *progname, const char *msg = NULL) {
   if (msg) {
     fprintf(stderr, "%s\n", msg);
@@ -102,7 +369,10 @@ static int usage(const char *progname, const char *msg = NULL) {
           "\t                     this can result in more smooth playback. Choose multiple for desired framerate.\n"
           "\t                     (Tip: use --led-limit-refresh for stable rate)\n"
 	  "\t-T <threads>       : Number of threads used to decode (default 1, max=%d)\n"
-          "\t-v                 : verbose; prints video metadata and other info.\n"
+          "\t-Q <frames>        : Number of frames decoded ahead (default 4).\n"
+          "\t-D <ms>            : Drop frames that are more than this late if a newer one is ready\n"
+          "\t                     (default: one frame time; -1: never drop).\n"
+          "\t-v                 : verbose; prints video metadata, decode/convert/present latencies and other info.\n"
           "\t-f                 : Loop forever.\n",
 	  (int)std::thread::hardware_concurrency());
 
@@ -111,14 +381,6 @@ static int usage(const char *progname, const char *msg = NULL) {
   return 1;
 }
 
-static void add_nanos(struct timespec *accumulator, long nanoseconds) {
-  accumulator->tv_nsec += nanoseconds;
-  while (accumulator->tv_nsec > 1000000000) {
-    accumulator->tv_nsec -= 1000000000;
-    accumulator->tv_sec += 1;
-  }
-}
-
 // Convert deprecated color formats to new and manually set the color range.
 // YUV has funny ranges (16-235), while the YUVJ are 0-255. SWS prefers to
 // deal with the YUV range, but then requires to set the output range.
@@ -180,9 +442,11 @@ int main(int argc, char *argv[]) {
   int stream_output_fd = -1;
   unsigned int frame_skip = 0;
   int64_t framecount_limit = INT64_MAX;
+  int queue_depth = 4;
+  int64_t drop_late_nanos = -2;  // Default: one frame time.
 
   int opt;
-  while ((opt = getopt(argc, argv, "vO:R:Lfc:s:FV:T:")) != -1) {
+  while ((opt = getopt(argc, argv, "vO:R:Lfc:s:FV:T:Q:D:")) != -1) {
     switch (opt) {
     case 'v':
       verbose = true;
@@ -215,6 +479,16 @@ int main(int argc, char *argv[]) {
     case 'T':
       thread_count = atoi(optarg);
       break;
+    case 'Q':
+      queue_depth = atoi(optarg);
+      if (queue_depth < 1)
+        return usage(argv[0], "-Q: Queue needs at least one frame");
+      break;
+    case 'D':
+      drop_late_nanos = atoi(optarg);
+      if (drop_late_nanos >= 0) drop_late_nanos *= 1000000;
+      else drop_late_nanos = -1;
+      break;
     case 'F':
       maintain_aspect_ratio = false;
       break;
@@ -243,7 +517,7 @@ int main(int argc, char *argv[]) {
   if (matrix == NULL) {
     return 1;
   }
-  FrameCanvas *offscreen_canvas = matrix->CreateFrameCanvas();
+  FrameQueue frame_queue(matrix, queue_depth);
 
   long frame_count = 0;
   StreamIO *stream_io = NULL;
@@ -371,84 +645,85 @@ int main(int argc, char *argv[]) {
       }
 
 
-      struct timespec next_frame;
-
-      AVPacket *packet = av_packet_alloc();
-      AVFrame *decode_frame = av_frame_alloc();  // Decode video into this
-      do {
-        int64_t frames_left = framecount_limit;
-        unsigned int frames_to_skip = frame_skip;
-        if (one_video_forever) {
-          av_seek_frame(format_context, videoStream, 0, AVSEEK_FLAG_ANY);
-          avcodec_flush_buffers(codec_context);
+      DecodeJob job;
+      job.format_context = format_context;
+      job.codec_context = codec_context;
+      job.sws_ctx = sws_ctx;
+      job.output_frame = output_frame;
+      job.video_stream = videoStream;
+      job.frame_wait_nanos = frame_wait_nanos;
+      job.display_offset_x = display_offset_x;
+      job.display_offset_y = display_offset_y;
+      job.display_width = display_width;
+      job.display_height = display_height;
+      job.frame_skip = frame_skip;
+      job.framecount_limit = framecount_limit;
+      job.loop_forever = one_video_forever;
+      job.decoded_frames = 0;
+
+      // Decoding happens in its own thread, running ahead as far as the
+      // queue allows, so that hiccups in decoding don't show on the matrix.
+      // We present the frames here.
+      frame_queue.Reset();
+      std::thread decoder(DecodeFrames, &job, &frame_queue);
+
+      const int64_t drop_threshold = (drop_late_nanos == -2)
+        ? frame_wait_nanos : drop_late_nanos;
+      LatencyStat decode_stat, convert_stat, present_stat, late_stat;
+      long presented = 0, dropped = 0;
+      int64_t round_start = 0;
+      FrameQueue::Frame frame;
+      while (frame_queue.Pop(&frame)) {
+        decode_stat.Add(frame.decode_nanos);
+        convert_stat.Add(frame.convert_nanos);
+        if (stream_writer) {
+          if (verbose) fprintf(stderr, "%6ld", frame_count + presented + 1);
+          stream_writer->Stream(*frame.canvas, frame_wait_nanos/1000);
+          frame_queue.Release(frame.canvas);
+          ++presented;
+          continue;
         }
-        clock_gettime(CLOCK_MONOTONIC, &next_frame);
-
-        int decode_in_flight = 0;
-        bool state_reading = true;
-
-        while (!interrupt_received && frames_left > 0) {
-          if (state_reading &&
-              av_read_frame(format_context, packet) != 0) {
-            state_reading = false;  // ran out of packets from input
-          }
-
-          if (!state_reading && decode_in_flight == 0)
-            break;  // Decoder fully drained.
 
-          // Is this a packet from the video stream?
-          if (state_reading && packet->stream_index != videoStream) {
-            av_packet_unref(packet);
-            continue;  // Not interested in that.
-          }
-
-          if (state_reading) {
-            // Decode video frame
-            if (avcodec_send_packet(codec_context, packet) == 0) {
-              ++decode_in_flight;
+        if (frame.first_of_round) round_start = GetNanos();
+        if (!use_vsync_for_frame_timing) {
+          const int64_t due = round_start + frame.pts_nanos;
+          const int64_t late = GetNanos() - due;
+          if (late > 0) {
+            late_stat.Add(late);
+            if (drop_threshold >= 0 && late > drop_threshold
+                && frame_queue.HasReady()) {
+              // Fell behind; skip to the newer frame.
+              frame_queue.Release(frame.canvas);
+              ++dropped;
+              continue;
             }
-            av_packet_unref(packet);
           } else {
-            avcodec_send_packet(codec_context, nullptr); // Trigger decode drain
-          }
-
-          while (decode_in_flight &&
-                 avcodec_receive_frame(codec_context, decode_frame) == 0) {
-            --decode_in_flight;
-
-            if (frames_to_skip) { frames_to_skip--; continue; }
-
-            // Determine absolute end of this frame now so that we don't include
-            // decoding overhead. TODO: skip frames if getting too slow ?
-            add_nanos(&next_frame, frame_wait_nanos);
-
-            // Convert the image from its native format to RGB
-            sws_scale(sws_ctx, (uint8_t const * const *)decode_frame->data,
-                      decode_frame->linesize, 0, codec_context->height,
-                      output_frame->data, output_frame->linesize);
-            CopyFrame(output_frame, offscreen_canvas,
-                      display_offset_x, display_offset_y,
-                      display_width, display_height);
-            frame_count++;
-            frames_left--;
-            if (stream_writer) {
-              if (verbose) fprintf(stderr, "%6ld", frame_count);
-              stream_writer->Stream(*offscreen_canvas, frame_wait_nanos/1000);
-            } else {
-              offscreen_canvas = matrix->SwapOnVSync(offscreen_canvas,
-                                                     vsync_multiple);
-            }
-            if (!stream_writer && !use_vsync_for_frame_timing) {
-              clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next_frame, NULL);
-            }
+            const struct timespec due_time = { (time_t)(due / 1000000000),
+                                               (long)(due % 1000000000) };
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due_time, NULL);
           }
         }
-      } while (one_video_forever && !interrupt_received);
+        const int64_t present_start = GetNanos();
+        FrameCanvas *previous = matrix->SwapOnVSync(frame.canvas,
+                                                    vsync_multiple);
+        present_stat.Add(GetNanos() - present_start);
+        frame_queue.Release(previous);
+        ++presented;
+      }
+      frame_queue.Close();
+      decoder.join();
+      frame_count += job.decoded_frames;
 
-      av_packet_free(&packet);
+      if (verbose) {
+        fprintf(stderr, "\n%ld frames decoded, %ld shown, %ld dropped\n",
+                job.decoded_frames, presented, dropped);
+        decode_stat.Print("decode");
+        convert_stat.Print("convert");
+        present_stat.Print("present");
+        late_stat.Print("late");
+      }
 
       av_frame_free(&output_frame);
-      av_frame_free(&decode_frame);
       avcodec_close(codec_context);
       avformat_close_input(&format_context);
     }
@@ -461,6 +736,7 @@ int main(int argc, char *argv[]) {
   }
 
   delete matrix;
+  if (stream_writer) stream_writer->AppendIndex();  // Allow seeking.
   delete stream_writer;
   delete stream_io;
   fprintf(stderr, "Total of %ld frames decoded\n", frame_count);